@@ -502,9 +502,11 @@ class RemoteServer(EtherboneIPC):
                         for addr in record.reads.get_addrs():
                             reads += self.comm.read(addr)
 
+                        # reply goes to return address, it tags pipelined reads
                         addr_size = self.addr_width // 8
+                        base_ret_addr = record.reads.base_ret_addr
                         record = EtherboneRecord(addr_size)
-                        record.writes = EtherboneWrites(addr_size=addr_size, datas=reads)
+                        record.writes = EtherboneWrites(addr_size=addr_size, base_addr=base_ret_addr, datas=reads)
                         record.wcount = len(record.writes)
 
                         packet = EtherbonePacket(self.addr_width)
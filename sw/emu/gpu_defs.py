@@ -22,16 +22,27 @@ GPU_CTRL_ZCLEAR     = 0x08
 
 # Capabilities reg shifts
 GPU_CAP_LIGHTING    = 8
+GPU_CAP_TEXPARAMS   = 9
+GPU_CAP_TEXFORMATS  = 10
+GPU_CAP_INDEXED     = 11
+GPU_CAP_VERTEX_BUFFERS = 12
 
 # Pipeline commands (only ones used in python)
 GPU_PIPE_CMD_SYNC       = 0xFFFF0010
 GPU_PIPE_CMD_CLEAR_FB   = 0xFFFF0011
 GPU_PIPE_CMD_FRAGMENT   = 0xFFFF0320
+GPU_PIPE_CMD_COLORSPAN  = 0xFFFF0025
+GPU_PIPE_CMD_FRAME_END  = 0xFFFF00F1   # emulator only, see oglory_gpu_defs.hh
+
+# Shared framebuffer exported by fragment ops stage (see frame_export.hh)
+FRAME_EXPORT_MAGIC          = 0x4246474F
+FRAME_EXPORT_HEADER_SIZE    = 4096
 
 # Masks
 GPU_BASE_MASK           = 0xF0000000
 GPU_ADDR_MASK           = 0x0FFFFFFF
 GPU_PIPE_CMD_MASK       = 0xFFFF0000
+GPU_PIPE_CMD_CODE_MASK  = 0xFFFF00FF
 GPU_CMDBASE_MASK        = (~((1<<16)-1)) & GPU_ADDR_MASK
 
 # Utils functions
@@ -2,13 +2,65 @@ import sdl2
 import sdl2.ext
 import ctypes
 import numpy
+import mmap
 import os
+import time
+
+from gpu_defs import *
 
 # COEF_X = 3
 # COEF_Y = 2
 COEF_X = 1
 COEF_Y = 1
 
+class SharedFramebuffer():
+    # double buffered frames published by fragment ops to memfd on frame end, rows go top down
+    HEADER_WRITING      = 4
+    HEADER_PUBLISHED    = 5
+    PUBLISH_TIMEOUT     = 5.0
+    
+    def __init__(self, size_x, size_y):
+        self.size_x = size_x
+        self.size_y = size_y
+        frame_size = size_x * size_y * 4
+        size = FRAME_EXPORT_HEADER_SIZE + 2 * frame_size
+        self.fd = os.memfd_create("oglory_fb", 0)
+        os.ftruncate(self.fd, size)
+        self.mem = mmap.mmap(self.fd, size)
+        self.header = numpy.frombuffer(self.mem, dtype='uint32', count=8)
+        self.addrs = [ctypes.addressof(ctypes.c_char.from_buffer(self.mem, FRAME_EXPORT_HEADER_SIZE + i*frame_size)) for i in range(2)]
+        self.surfaces = None
+        self.frames_ended = 0
+        
+    def Name(self):
+        return "memfd:" + str(self.fd)
+        
+    def WaitFrame(self):
+        # wait till fragment ops publishes last ended frame
+        deadline = time.monotonic() + self.PUBLISH_TIMEOUT
+        while int(self.header[self.HEADER_PUBLISHED]) < self.frames_ended:
+            if time.monotonic() > deadline:
+                print("Frame", self.frames_ended, "was not published in time")
+                return
+            time.sleep(0.0005)
+        
+    def BlitFrame(self, surface):
+        # blit last published frame from shared memory, retry if writer reused its buffer meanwhile
+        if not self.surfaces:
+            # buffers are wrapped to surfaces of screen pixel format, so blit is plain copy
+            fmt = surface.format.contents.format
+            self.surfaces = [sdl2.SDL_CreateRGBSurfaceWithFormatFrom(ctypes.c_void_p(a), self.size_x, self.size_y, 32, self.size_x*4, fmt) for a in self.addrs]
+            for s in self.surfaces:
+                sdl2.SDL_SetSurfaceBlendMode(s, sdl2.SDL_BLENDMODE_NONE)
+        self.WaitFrame()
+        while True:
+            frame = int(self.header[self.HEADER_PUBLISHED])
+            if frame == 0:
+                return False
+            sdl2.SDL_BlitScaled(self.surfaces[frame % 2], None, surface, None)
+            if int(self.header[self.HEADER_WRITING]) < frame + 2:
+                return True
+
 class GpuDisplay():
     
     def __init__(self, size_x, size_y, draw_backbuffer = 0):
@@ -55,11 +107,15 @@ class GpuDisplay():
         sdl2.ext.fill(self.surface, sdl2.ext.Color(0, 0, 0), (0, 0, self.size_x * COEF_X, self.size_y * COEF_Y))  
         pass
     
-    def DrawFramebuffer(self):
+    def DrawFramebuffer(self, shared_fb = None):
         # copy framebuffer to screen
         # if not self.draw_backbuffer:
-        pixels = sdl2.ext.pixels2d(self.surface)
-        numpy.copyto(pixels, self.framebuffer) 
+        if shared_fb:
+            # frames exported by pipeline go to screen directly
+            shared_fb.BlitFrame(self.surface)
+        else:
+            pixels = sdl2.ext.pixels2d(self.surface)
+            numpy.copyto(pixels, self.framebuffer) 
         self.window.refresh()
     
     def ClearFramebuffer(self):    
@@ -2,7 +2,8 @@ import time
 import sys
 import os
 import mmap
-from threading import Thread, Event
+import struct
+from threading import Thread, Event, Lock
 
 from gpu_defs import *
 
@@ -31,6 +32,7 @@ class GpuMemory():
         self.readbuf_start.clear()
         self.clear_zbuf = Event()
         self.clear_zbuf.clear()
+        self.fifo_lock = Lock()
         self.readbuf_thread = Thread(target = self.ReadBufThread, daemon = False)
         self.readbuf_thread.start()
         
@@ -82,7 +84,10 @@ class GpuMemory():
                 return [sync_bit | readbuf_bit | busy_bit]
             elif reg_addr == GPU_REG_CAP_OFF:
                 # capabilities reg
-                return [(self.HasLighting() << GPU_CAP_LIGHTING)]
+                tex_params = self.HasTexParams()
+                indexed = self.HasIndexed()
+                return [(self.HasLighting() << GPU_CAP_LIGHTING) | (tex_params << GPU_CAP_TEXPARAMS) | (tex_params << GPU_CAP_TEXFORMATS) |
+                        (indexed << GPU_CAP_INDEXED) | (indexed << GPU_CAP_VERTEX_BUFFERS)]
             elif reg_addr == GPU_REG_BOARD0_OFF:
                 # board word 0
                 return [0x6C756D45]
@@ -99,15 +104,23 @@ class GpuMemory():
         
     def write(self, addr, data):
         self.pipe.pipe_ready.wait()
-        assert(len(data) == 1)
-        dat = data[0]
-        
+        # burst writes go to auto-incremented addresses
+        if (addr & GPU_BASE_MASK == GPU_MEMBUF_BASE) and (len(data) > 1):
+            mem_addr = addr & GPU_ADDR_MASK
+            self.mem[mem_addr:mem_addr+len(data)*4] = struct.pack("<%dI" % len(data), *data)
+        else:
+            for i, dat in enumerate(data):
+                self.write_word(addr + i*4, dat)
+            
+    def write_word(self, addr, dat):
         if (addr & GPU_BASE_MASK == GPU_REGS_BASE):
             # GPU register access
             reg_addr = addr & GPU_ADDR_MASK
             if reg_addr == GPU_REG_CTRL_OFF:
                 # command reg
                 if dat & GPU_CTRL_FBSWITCH:
+                    if self.pipe.shared_fb:
+                        self.EndFrame()
                     self.pipe.NextFrame()
             elif reg_addr == GPU_REG_CMDSIZE_OFF:
                 assert(self.readbuf_thread_flag == 0)   # check that read is not running
@@ -130,17 +143,43 @@ class GpuMemory():
         else:
             raise ValueError("Incorrect address write via Etherbone:", hex(addr), hex(dat))
             
+    def EndFrame(self):
+        # mark frame end in command stream, so fragment ops publishes completed frame
+        with self.fifo_lock:
+            self.fifo.write(GPU_PIPE_CMD_FRAME_END.to_bytes(4, "little"))
+            self.fifo.flush()
+        self.pipe.shared_fb.frames_ended += 1
+            
     def HasLighting(self):
         for s in self.pipe.config["stages"]:
             if "ILLUMINATION" in s["comment"].upper():
                 return True
         return False
             
+    def HasTexParams(self):
+        # texture layouts & formats are supported by emulated texturing but not by HDL one,
+        # it computes mipmap LOD for spans only, so emulated rasterizer has to produce them
+        texturing = rast_spans = False
+        for s in self.pipe.config["stages"]:
+            if "TEXTURING" in s["comment"].upper():
+                texturing = not ("cocotb" in s)
+            elif "RASTERIZER" in s["comment"].upper():
+                rast_spans = not ("cocotb" in s) and int(s.get("options", {}).get("spans", 0)) != 0
+        return texturing and rast_spans
+            
+    def HasIndexed(self):
+        # indexed drawing & vertex buffers are supported by emulated vertex transform but not by HDL one
+        for s in self.pipe.config["stages"]:
+            if "VERTEX" in s["comment"].upper():
+                return not ("cocotb" in s)
+        return False
+            
     def ReadBufThread(self):
         while not self.terminate.is_set():
             self.readbuf_start.wait()
             self.readbuf_start.clear()
             next_cmd = self.cmd_base
+            self.fifo_lock.acquire()
             for i in range(self.cmd_base, self.cmd_base+self.cmd_size*4, 4):
                 if i == next_cmd:
                     cmd = self.read_mem_word(i)
@@ -158,5 +197,6 @@ class GpuMemory():
                 print("TB cmd file write done")
                 sys.exit(0)
             self.fifo.flush()
+            self.fifo_lock.release()
             self.readbuf_done.set()
     
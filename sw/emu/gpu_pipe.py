@@ -5,11 +5,13 @@ from threading import Thread, Event
 
 from etherbone import RemoteServer
 
-from gpu_display import GpuDisplay
-from gpu_stage import GpuPipelineStage
+from gpu_display import GpuDisplay, SharedFramebuffer
+from gpu_stage import GpuPipelineStage, GpuThreadedPipeline
 from gpu_memory import GpuMemory
 from gpu_defs import *
 
+RING_FIFO_SIZE  = 4*1024*1024
+
 class GpuPipeline():
     def __init__(self, config):
         # Parse config
@@ -17,6 +19,7 @@ class GpuPipeline():
         self.size_x = config["display_size_x"]
         self.size_y = config["display_size_y"]
         self.stage_num = len(config["stages"])
+        self.threaded = self.UseThreadedPipeline()
         
         self.pipe_ready = Event()
         self.pipe_ready.clear()
@@ -28,15 +31,32 @@ class GpuPipeline():
         else:
             self.gpu_mem = None
 
-        # Create stages & fifos
-        self.stages = [None] * self.stage_num
-        for s in range(self.stage_num):
-            fifos = self.FifoNames(s)
-            if self.gpu_mem or s != 0:
-                # no need to create first input fifo if no memory
-                self.CreateFifo(fifos[0])
-            self.CreateFifo(fifos[1])
-            self.stages[s] = GpuPipelineStage(config, s, fifos)
+        # Create fifos (stage output is shared memory ring if requested & both sides support it)
+        self.fifos = [None] * (self.stage_num + 1)
+        for s in range(self.stage_num + 1):
+            if s == 0:
+                if self.gpu_mem:
+                    # no need to create first input fifo if no memory
+                    self.fifos[s] = self.CreateFifo(self.FifoNames(s)[0])
+                else:
+                    self.fifos[s] = self.FifoNames(s)[0]
+            elif self.threaded and s < self.stage_num:
+                continue    # stages are linked inside oglory_pipeline
+            elif self.UseRingFifo(s-1):
+                self.fifos[s] = self.CreateRingFifo()
+            else:
+                self.fifos[s] = self.CreateFifo(self.FifoNames(s-1)[1])
+
+        # Create framebuffer shared with the last stage if it should export whole frames
+        self.shared_fb = SharedFramebuffer(self.size_x, self.size_y) if self.UseSharedFramebuffer() else None
+
+        # Create stages
+        if self.threaded:
+            self.stages = [GpuThreadedPipeline(config, (self.fifos[0], self.fifos[self.stage_num]), self.shared_fb)]
+        else:
+            self.stages = [None] * self.stage_num
+            for s in range(self.stage_num):
+                self.stages[s] = GpuPipelineStage(config, s, (self.fifos[s], self.fifos[s+1]), self.shared_fb if s == self.stage_num-1 else None)
             
         # Create etherbone server
         if self.gpu_mem:
@@ -73,6 +93,42 @@ class GpuPipeline():
         except:
             pass
         os.mkfifo(name)
+        return name
+        
+    def CreateRingFifo(self):
+        # zero filled memfd is an empty ring, stages get it as inherited fd
+        fd = os.memfd_create("oglory_ring", 0)
+        os.ftruncate(fd, RING_FIFO_SIZE)
+        return "memfd:" + str(fd)
+        
+    def UseRingFifo(self, stage):
+        stages = self.config["stages"]
+        if stages[stage].get("transport", "pipe").lower() != "shm":
+            return False
+        if (stage == self.stage_num-1) or ("cocotb" in stages[stage]) or ("cocotb" in stages[stage+1]):
+            print("Pipeline stage", stage, "output can't be shared memory ring, falling back to pipe")
+            return False
+        return True
+        
+    def UseThreadedPipeline(self):
+        if self.config.get("threaded", "false").lower() != "true":
+            return False
+        if any("cocotb" in s for s in self.config["stages"]):
+            print("Pipeline with cocotb stages can't be threaded, falling back to processes")
+            return False
+        return True
+        
+    def UseSharedFramebuffer(self):
+        if self.config.get("shared_framebuffer", "false").lower() != "true":
+            return False
+        # frame end marker is injected by emulated registers & goes through every stage
+        if not self.gpu_mem:
+            print("Shared framebuffer requires etherbone registers, falling back to fragments")
+            return False
+        if any("cocotb" in s for s in self.config["stages"]):
+            print("Pipeline with cocotb stages can't export framebuffer, falling back to fragments")
+            return False
+        return True
         
     def ReadFifo(self):
         bword = self.fb_fifo.read(4)
@@ -81,6 +137,14 @@ class GpuPipeline():
         if cmd == GPU_PIPE_CMD_FRAGMENT:
             bword = self.fb_fifo.read(12)
             return (int.from_bytes(bword[:2], "little"), int.from_bytes(bword[2:4], "little"), int.from_bytes(bword[4:8], "little"), int.from_bytes(bword[8:12], "little"))
+        elif (cmd & GPU_PIPE_CMD_CODE_MASK) == GPU_PIPE_CMD_COLORSPAN:
+            # consecutive pixels of a line, first argument is start coords & others are colors
+            bword = self.fb_fifo.read(PipeCmdArgsNum(cmd) * 4)
+            x = int.from_bytes(bword[:2], "little")
+            y = int.from_bytes(bword[2:4], "little")
+            for i in range(4, len(bword), 4):
+                self.display.PutFragment((x, y, 0, int.from_bytes(bword[i:i+4], "little")))
+                x += 1
         elif cmd == GPU_PIPE_CMD_CLEAR_FB:
             self.display.ClearFramebuffer()
         elif cmd == GPU_PIPE_CMD_SYNC:
@@ -97,7 +161,7 @@ class GpuPipeline():
             return None
         
     def NextFrame(self):
-        self.display.DrawFramebuffer()
+        self.display.DrawFramebuffer(self.shared_fb)
         self.frame_count += 1
         print("Frame", self.frame_count)
         
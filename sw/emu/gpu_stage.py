@@ -1,14 +1,26 @@
 import subprocess as sp
 import sys
+import os
 
 class GpuPipelineStage():
-    def __init__(self, config, stage_num, fifos):
+    def __init__(self, config, stage_num, fifos, shared_fb = None):
         stage_config = config["stages"][stage_num]
         self.stage_num = stage_num
 
+        # shared memory ring fifos are passed as inherited descriptors
+        ring_fds = [int(f[len("memfd:"):]) for f in fifos if f.startswith("memfd:")]
+
+        # optional stage parameters are passed as key=value arguments
+        options = [str(k) + "=" + str(v) for k, v in stage_config.get("options", {}).items()]
+
+        # last stage could publish frames to shared framebuffer instead of sending fragments
+        if shared_fb:
+            options.append("framebuffer=" + shared_fb.Name())
+            ring_fds.append(shared_fb.fd)
+
         # launch stage binary
-        print("Pipeline stage", stage_num, stage_config["comment"] + ":", "launching binary", stage_config["binary"])
-        self.executor = sp.Popen([stage_config["binary"], str(config["display_size_x"]), str(config["display_size_y"]), fifos[0], fifos[1]], stdout=sys.stdout, stderr=sys.stdout)
+        print("Pipeline stage", stage_num, stage_config["comment"] + ":", "launching binary", stage_config["binary"], *options)
+        self.executor = sp.Popen([stage_config["binary"], str(config["display_size_x"]), str(config["display_size_y"]), fifos[0], fifos[1]] + options, stdout=sys.stdout, stderr=sys.stdout, pass_fds=ring_fds)
         
     def Stop(self):
         self.executor.terminate()
@@ -16,3 +28,23 @@ class GpuPipelineStage():
     def CheckAlive(self):
         return (self.executor.poll() is None)
             
+
+class GpuThreadedPipeline():
+    # all stages are threads of single oglory_pipeline process linked with in-memory rings
+    def __init__(self, config, fifos, shared_fb = None):
+        args = ["bin/oglory_pipeline", str(config["display_size_x"]), str(config["display_size_y"]), fifos[0], fifos[1]]
+        for stage_config in config["stages"]:
+            # stage shared object is built alongside the binary
+            lib = stage_config.get("library", os.path.join("lib", os.path.basename(stage_config["binary"]) + "_stage.so"))
+            args += [lib] + [str(k) + "=" + str(v) for k, v in stage_config.get("options", {}).items()]
+        if shared_fb:
+            args.append("framebuffer=" + shared_fb.Name())
+
+        print("Threaded pipeline:", " ".join(args[5:]))
+        self.executor = sp.Popen(args, stdout=sys.stdout, stderr=sys.stdout, pass_fds=[shared_fb.fd] if shared_fb else [])
+
+    def Stop(self):
+        self.executor.terminate()
+
+    def CheckAlive(self):
+        return (self.executor.poll() is None)
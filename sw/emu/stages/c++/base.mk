@@ -5,13 +5,14 @@ BIN_DIR=$(TARGET_DIR)/bin
 LIB_DIR=$(TARGET_DIR)/lib
 PROGNAME=$(BIN_DIR)/$(DIRNAME)
 LIBNAME=$(LIB_DIR)/$(DIRNAME).so
-HEADERS=$(wildcard *.hh *.h)
-CXXFLAGS += -g -I../include
+STAGE_LIBNAME=$(LIB_DIR)/$(DIRNAME)_stage.so
+HEADERS=$(wildcard *.hh *.h ../include/*.hh)
+CXXFLAGS += -g -O2 -ffp-contract=off -I../include
 #CXXFLAGS += -O3 -I../include
 
 .PHONY: all
 
-all: $(PROGNAME) $(LIBNAME)
+all: $(PROGNAME) $(LIBNAME) $(STAGE_LIBNAME)
 
 $(PROGNAME): *.cc $(HEADERS)
 	mkdir -p $(BIN_DIR)
@@ -20,3 +21,8 @@ $(PROGNAME): *.cc $(HEADERS)
 $(LIBNAME): *.cc $(HEADERS)
 	mkdir -p $(LIB_DIR)
 	c++ $(CXXFLAGS) -shared -fPIC -DVERBOSE=1 -DBUILD_LIB=1 *.cc -o $(LIBNAME)
+
+# stage for threaded oglory_pipeline
+$(STAGE_LIBNAME): *.cc $(HEADERS)
+	mkdir -p $(LIB_DIR)
+	c++ $(CXXFLAGS) -shared -fPIC -Wl,-Bsymbolic -DBUILD_BINARY=1 -DBUILD_STAGE=1 *.cc -o $(STAGE_LIBNAME)
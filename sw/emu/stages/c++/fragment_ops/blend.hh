@@ -0,0 +1,165 @@
+#ifndef _BLEND_HH
+#define _BLEND_HH
+
+#include <cstdint>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <gpu_pipeline.hh>
+
+// Integer blending bit-exact with fragment_axis.vhd. Color channels & factors are
+// 8 bit fixed point fractions (value / 256), so factor ONE is 255/256 as in hardware.
+// Every product is resized to 8 fractional bits with round to nearest, ties to even
+// (fixed_pkg resize), sum of source & destination parts saturates to 255.
+// Only factors implemented in hardware are supported: ZERO, ONE, ONE_MINUS_SRC_COLOR,
+// SRC_ALPHA & ONE_MINUS_SRC_ALPHA, all others give zero factor.
+//
+// Kernel for every (source, destination) factor pair is instantiated from templates,
+// so factor selection is resolved at compile time & kernel is chosen on state change.
+
+// Blend n source colors with framebuffer pixels dst[i], results are stored both to
+// framebuffer & back to colors. Pixels should be distinct.
+typedef void (*BlendKernel)(uint32_t *colors, uint32_t *const *dst, uint32_t n);
+
+static inline bool BlendFuncSupported(const uint32_t func)
+{
+    return  (func == BLENDF_ZERO) || (func == BLENDF_ONE) || (func == BLENDF_ONE_MINUS_SRC_COLOR) ||
+            (func == BLENDF_SRC_ALPHA) || (func == BLENDF_ONE_MINUS_SRC_ALPHA);
+}
+
+// Factor of channel i (0 - blue .. 3 - alpha) for source color src
+template <uint32_t FUNC>
+static inline uint32_t BlendFactor(const uint32_t src, const int i)
+{
+    switch (FUNC)
+    {
+        case BLENDF_ONE:                    return 0xFF;
+        case BLENDF_ONE_MINUS_SRC_COLOR:    return 0xFF - ((src >> (i * 8)) & 0xFF);
+        case BLENDF_SRC_ALPHA:              return src >> 24;
+        case BLENDF_ONE_MINUS_SRC_ALPHA:    return 0xFF - (src >> 24);
+        default:                            return 0;
+    }
+}
+
+// Channel multiplied by factor with round half to even
+static inline uint32_t BlendMul(const uint32_t c, const uint32_t f)
+{
+    uint32_t t = c * f;
+    return (t + 0x7F + ((t >> 8) & 1)) >> 8;
+}
+
+template <uint32_t SRC_FUNC, uint32_t DST_FUNC>
+static void BlendScalar(uint32_t *colors, uint32_t *const *dst, const uint32_t n)
+{
+    for (uint32_t k = 0; k < n; k++)
+    {
+        uint32_t s = colors[k];
+        uint32_t d = *dst[k];
+        uint32_t res = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            uint32_t c = BlendMul((s >> (i * 8)) & 0xFF, BlendFactor<SRC_FUNC>(s, i)) +
+                         BlendMul((d >> (i * 8)) & 0xFF, BlendFactor<DST_FUNC>(s, i));
+            res |= std::min(c, 0xFFu) << (i * 8);
+        }
+        *dst[k] = colors[k] = res;
+    }
+}
+
+#if defined(__SSE2__)
+// SSE2 kernels work on 16 bit channels, 2 pixels per register & 4 pixels per iteration.
+// Products fit 16 bits (255*255 + 0x80 < 2^16), so same rounding is done in lanes.
+
+// Factors for 16 bit channels of source colors src
+template <uint32_t FUNC>
+static inline __m128i BlendFactorSse2(const __m128i src)
+{
+    const __m128i max = _mm_set1_epi16(0xFF);
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, 0xFF), 0xFF);
+    switch (FUNC)
+    {
+        case BLENDF_ONE:                    return max;
+        case BLENDF_ONE_MINUS_SRC_COLOR:    return _mm_sub_epi16(max, src);
+        case BLENDF_SRC_ALPHA:              return alpha;
+        case BLENDF_ONE_MINUS_SRC_ALPHA:    return _mm_sub_epi16(max, alpha);
+        default:                            return _mm_setzero_si128();
+    }
+}
+
+static inline __m128i BlendMulSse2(const __m128i c, const __m128i f)
+{
+    __m128i t = _mm_mullo_epi16(c, f);
+    __m128i odd = _mm_and_si128(_mm_srli_epi16(t, 8), _mm_set1_epi16(1));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(0x7F)), odd), 8);
+}
+
+template <uint32_t SRC_FUNC, uint32_t DST_FUNC>
+static inline __m128i BlendSse2Pixels(const __m128i s, const __m128i d)
+{
+    __m128i res = _mm_setzero_si128();
+    if (SRC_FUNC != BLENDF_ZERO)
+        res = BlendMulSse2(s, BlendFactorSse2<SRC_FUNC>(s));
+    if (DST_FUNC != BLENDF_ZERO)
+        res = _mm_add_epi16(res, BlendMulSse2(d, BlendFactorSse2<DST_FUNC>(s)));
+    return res;
+}
+
+template <uint32_t SRC_FUNC, uint32_t DST_FUNC>
+static void BlendSse2(uint32_t *colors, uint32_t *const *dst, const uint32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        __m128i s = _mm_loadu_si128((__m128i*)(colors + k));
+        __m128i d = _mm_setr_epi32(*dst[k], *dst[k + 1], *dst[k + 2], *dst[k + 3]);
+        __m128i lo = BlendSse2Pixels<SRC_FUNC, DST_FUNC>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = BlendSse2Pixels<SRC_FUNC, DST_FUNC>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        // sums are at most 0x1FE, unsigned saturation of pack clamps them to 0xFF
+        _mm_storeu_si128((__m128i*)(colors + k), _mm_packus_epi16(lo, hi));
+        for (int i = 0; i < 4; i++)
+            *dst[k + i] = colors[k + i];
+    }
+    BlendScalar<SRC_FUNC, DST_FUNC>(colors + k, dst + k, n - k);
+}
+#endif
+
+template <uint32_t SRC_FUNC, uint32_t DST_FUNC>
+static BlendKernel BlendKernelFor(const bool simd)
+{
+    #if defined(__SSE2__)
+    if (simd)
+        return BlendSse2<SRC_FUNC, DST_FUNC>;
+    #endif
+    return BlendScalar<SRC_FUNC, DST_FUNC>;
+}
+
+template <uint32_t SRC_FUNC>
+static BlendKernel SelectBlendKernelDst(const uint32_t dst_func, const bool simd)
+{
+    switch (dst_func)
+    {
+        case BLENDF_ONE:                    return BlendKernelFor<SRC_FUNC, BLENDF_ONE>(simd);
+        case BLENDF_ONE_MINUS_SRC_COLOR:    return BlendKernelFor<SRC_FUNC, BLENDF_ONE_MINUS_SRC_COLOR>(simd);
+        case BLENDF_SRC_ALPHA:              return BlendKernelFor<SRC_FUNC, BLENDF_SRC_ALPHA>(simd);
+        case BLENDF_ONE_MINUS_SRC_ALPHA:    return BlendKernelFor<SRC_FUNC, BLENDF_ONE_MINUS_SRC_ALPHA>(simd);
+        default:                            return BlendKernelFor<SRC_FUNC, BLENDF_ZERO>(simd);
+    }
+}
+
+// Kernel for blend functions from fragment state
+static inline BlendKernel SelectBlendKernel(const uint32_t src_func, const uint32_t dst_func, const bool simd)
+{
+    switch (src_func)
+    {
+        case BLENDF_ONE:                    return SelectBlendKernelDst<BLENDF_ONE>(dst_func, simd);
+        case BLENDF_ONE_MINUS_SRC_COLOR:    return SelectBlendKernelDst<BLENDF_ONE_MINUS_SRC_COLOR>(dst_func, simd);
+        case BLENDF_SRC_ALPHA:              return SelectBlendKernelDst<BLENDF_SRC_ALPHA>(dst_func, simd);
+        case BLENDF_ONE_MINUS_SRC_ALPHA:    return SelectBlendKernelDst<BLENDF_ONE_MINUS_SRC_ALPHA>(dst_func, simd);
+        default:                            return SelectBlendKernelDst<BLENDF_ZERO>(dst_func, simd);
+    }
+}
+
+#endif
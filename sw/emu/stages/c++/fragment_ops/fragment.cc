@@ -2,70 +2,24 @@
 #include <cstdint> 
 #include <cstdlib> 
 #include <cstring>
+#include <memory>
 
 #include <gpu_pipeline.hh> 
+#include <fragment_span.hh> 
+#include <simd.hh>
 
-#define DRAW_DEPTH_BUF  0
-
-void blend_factor(float *factor, const float *src, const float *dst, uint16_t func)
-{
-    switch (func)
-    {
-        case BLENDF_ZERO:
-            std::fill(factor, factor + 4, 0);
-            break;
-        case BLENDF_ONE:
-            std::fill(factor, factor + 4, 1);
-            break;
-        case BLENDF_ONE_MINUS_SRC_COLOR:
-            for (int i = 0; i < 4; ++i) factor[i] = 1 - src[i];
-            break;
-        case BLENDF_SRC_ALPHA:
-            std::fill(factor, factor + 4, src[3]);
-            break;
-        case BLENDF_ONE_MINUS_SRC_ALPHA:
-            std::fill(factor, factor + 4, 1 - src[3]);
-            break;
-        default:
-            assert(false);  // TODO: add error message
-            break;
-    }
-}
-
-uint32_t blending(uint32_t src_color, uint16_t src_func, uint32_t dst_color, uint16_t dst_func)
-{
-    float src_weight = 1;
-    float dst_weight = 1;
-    float src[] = {
-        ((uint8_t*)&src_color)[2] / float(255),
-        ((uint8_t*)&src_color)[1] / float(255),
-        ((uint8_t*)&src_color)[0] / float(255),
-        ((uint8_t*)&src_color)[3] / float(255),
-    };  // argb => rgba
-    float src_factor[4];
-    float dst[] = {
-        ((uint8_t*)&dst_color)[2] / float(255),
-        ((uint8_t*)&dst_color)[1] / float(255),
-        ((uint8_t*)&dst_color)[0] / float(255),
-        ((uint8_t*)&dst_color)[3] / float(255),
-    };
-    float dst_factor[4];
+#include "render_target.hh"
+#include "blend.hh"
+#include "frame_export.hh"
 
-    blend_factor(src_factor, src, dst, src_func);
-    blend_factor(dst_factor, src, dst, dst_func);
-
-    float result[4];
-    for (int i = 0; i < 4; ++i) {
-        result[i] = Clamp(src[i] * src_factor[i] + dst[i] * dst_factor[i]);
-    }
-
-    return ArgbToU32(result[3], result[0], result[1], result[2]);
-}
+#define DRAW_DEPTH_BUF  0
 
+// Fragments are blended in batches of distinct pixels: consecutive fragments of one line
+const uint32_t BLEND_BATCH_SIZE = 64;
 
-int main(int argc, char **argv) 
+STAGE_MAIN(int argc, char **argv)
 {
-    if (argc != 5)
+    if (argc < 5)
     {
         puts("Wrong parameters!");
         return 1;
@@ -80,46 +34,125 @@ int main(int argc, char **argv)
     bool blending_enabled = false;
     uint16_t blend_src_func = BLENDF_ONE;
     uint16_t blend_dst_func = BLENDF_ZERO;
-    
-    // Fill depth buffer with large vals
-    uint32_t depth_buffer[SCREEN_WIDTH*SCREEN_HEIGHT];
-    for (int i = 0; i < SCREEN_WIDTH; ++i)
-        for (int j = 0; j < SCREEN_HEIGHT; ++j)
-            depth_buffer[i*SCREEN_HEIGHT + j] = PIPELINE_MAX_Z;
-
-
-    // Fill frame buffer with zeroes
-    uint32_t frame_buffer[SCREEN_WIDTH*SCREEN_HEIGHT];
-    for (int i = 0; i < SCREEN_WIDTH; ++i)
-        for (int j = 0; j < SCREEN_HEIGHT; ++j)
-            frame_buffer[i*SCREEN_HEIGHT + j] = 0;
-
+    BlendKernel blend_kernel = nullptr;
         
     // Open input & output FIFOs
-    IoFifo iofifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    IoFifo iofifo(argv[3], argv[4], options);
+    
+    // Frame buffer is zero filled on allocation, fill depth buffer with large vals
+    // fast_clear=0 makes every clear fill whole buffer instead of lazy per tile clears
+    RenderTarget target(SCREEN_WIDTH, SCREEN_HEIGHT, options.GetInt("fast_clear", 1));
+    target.ClearDepth(PIPELINE_MAX_Z);
+    
+    // spans=1 sends passed fragments to display as color spans
+    bool color_spans = options.GetInt("spans", 0);
+    ColorSpanWriter span_writer(iofifo);
+    SpanSetup span_setup = {};
+    
+    // framebuffer=memfd:N publishes whole frames to shared memory on frame end instead of sending fragments
+    std::unique_ptr<FrameExport> frame_export;
+    if (options.Has("framebuffer"))
+        frame_export.reset(new FrameExport(options.Get("framebuffer"), SCREEN_WIDTH, SCREEN_HEIGHT));
+    
+    // simd=off selects scalar blending kernels
+    bool simd_blend = (SimdSelect(options) != SIMD_NONE);
+    blend_kernel = SelectBlendKernel(blend_src_func, blend_dst_func, simd_blend);
+    uint32_t blend_colors[BLEND_BATCH_SIZE];
+    uint32_t *blend_dst[BLEND_BATCH_SIZE];
+    uint32_t blend_x[BLEND_BATCH_SIZE], blend_z[BLEND_BATCH_SIZE];
+    uint32_t blend_y = 0;
+    uint32_t blend_count = 0;
+    
+    auto output_fragment = [&](uint32_t x, uint32_t y, uint32_t z, uint32_t color)
+    {
+        #if !DRAW_DEPTH_BUF
+        if (frame_export)
+            return;
+        if (color_spans)
+            span_writer.Write(x, y, color);
+        else
+            iofifo.WriteFragment(x, y, z, color);
+        #endif
+    };
+    
+    // Blend collected fragments & send them further
+    auto flush_blend = [&]()
+    {
+        if (!blend_count)
+            return;
+        blend_kernel(blend_colors, blend_dst, blend_count);
+        for (uint32_t i = 0; i < blend_count; i++)
+            output_fragment(blend_x[i], blend_y, blend_z[i], blend_colors[i]);
+        blend_count = 0;
+    };
+    
+    // Pass all pending fragments, should be done before any other output or state change
+    auto flush_output = [&]()
+    {
+        flush_blend();
+        span_writer.Flush();
+    };
+    
+    // Depth & alpha tests, blending & framebuffer update for one fragment
+    auto process_fragment = [&](uint32_t x, uint32_t y, uint32_t z, uint32_t color)
+    {
+        uint32_t a = (color & 0xFF000000) >> 24;
+        
+        // Depth buffer test
+        if (depth_test_enabled)
+        {
+            if (z > target.Depth(x, y))     // passes on LESS OR EQUAL
+                return;
+            if (mask_depth_update)
+                target.Depth(x, y) = z; 
+        }
+        
+        if (alpha_test_enabled && a <= 171)                 // passes on GREATER
+            return;
+
+        if (blending_enabled)
+        {
+            // fragment of pixel already in batch should see blended color of previous one
+            if (blend_count && (y != blend_y || x <= blend_x[blend_count-1] || blend_count == BLEND_BATCH_SIZE))
+                flush_blend();
+            blend_y = y;
+            blend_x[blend_count] = x;
+            blend_z[blend_count] = z;
+            blend_colors[blend_count] = color;
+            blend_dst[blend_count] = &target.Color(x, y);
+            blend_count++;
+            return;
+        }
+        target.Color(x, y) = color; 
+        output_fragment(x, y, z, color);
+    };
     
     while (1)
     {
+        // don't keep collected fragments while waiting for input
+        if ((blend_count || color_spans) && !iofifo.InputReady())
+            flush_output();
+        
         uint32_t cmd = iofifo.ReadFromFifo32();
         switch (cmd)
         {
             case (GPU_PIPE_CMD_CLEAR_ZB):
             {
+                flush_output();
                 #if DRAW_DEPTH_BUF
-                for (uint32_t x = 0; x < SCREEN_WIDTH; ++x) 
+                for (uint32_t y = 0; y < SCREEN_HEIGHT; ++y) 
                 { 
-                    for (uint32_t y = 0; y < SCREEN_HEIGHT; ++y) 
+                    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x) 
                     { 
-                        uint32_t c = 255 - (uint32_t)((depth_buffer[y * SCREEN_WIDTH + x]) * 255. / PIPELINE_MAX_Z);
+                        uint32_t c = 255 - (uint32_t)(target.Depth(x, y) * 255. / PIPELINE_MAX_Z);
                         iofifo.WriteFragment(x, y, 0, (c << 16) | (c << 8) | c);
                     }
                 }
                 #endif
                 
                 // fill depth buffer with max Z vals
-                for (int i = 0; i < SCREEN_WIDTH; ++i)
-                    for (int j = 0; j < SCREEN_HEIGHT; ++j)
-                        depth_buffer[i*SCREEN_HEIGHT + j] = PIPELINE_MAX_Z;
+                target.ClearDepth(PIPELINE_MAX_Z);
                 break;
             }
             case (GPU_PIPE_CMD_FRAGMENT):
@@ -128,39 +161,43 @@ int main(int argc, char **argv)
                 uint32_t fragment[4];
                 iofifo.ReadFragment(fragment);
                 
-                uint32_t x = fragment[0];
-                uint32_t y = fragment[1];
-                uint32_t z = fragment[2];
-                uint32_t color = fragment[3];
-                uint32_t a = (color & 0xFF000000) >> 24;
-                
-                // Depth buffer test
-                if (depth_test_enabled)
+                process_fragment(fragment[0], fragment[1], fragment[2], fragment[3]);
+                iofifo.CommandDone(cmd);
+                break;
+            }
+            case (GPU_PIPE_CMD_SPAN_SETUP):
+            {
+                ReadSpanSetup(iofifo, cmd, span_setup);
+                break;
+            }
+            case (GPU_PIPE_CMD_SPAN):
+            {
+                // textured spans should be handled by texturing stage
+                if (span_setup.texture)
                 {
-                    if (z > depth_buffer[y * SCREEN_WIDTH + x])    // passes on LESS OR EQUAL
-                        continue;
-                    if (mask_depth_update)
-                        depth_buffer[y * SCREEN_WIDTH + x] = z; 
+                    flush_output();
+                    iofifo.BypassCmd(cmd);
+                    break;
                 }
                 
-                if (alpha_test_enabled && a <= 171)                 // passes on GREATER
-                    continue;
-
-                if (blending_enabled)
+                Span span;
+                ReadSpan(iofifo, span);
+                for (uint32_t x = span.x; x < span.x + span.length; x++)
                 {
-                    color = blending(color, blend_src_func, frame_buffer[y * SCREEN_WIDTH + x], blend_dst_func);
+                    SpanPixel p;
+                    if (!SpanPixelSetup(span_setup, span, x, p))
+                        continue;
+                    uint32_t color = ArgbToU32(SpanAttrib(span_setup, p, 3), SpanAttrib(span_setup, p, 0), 
+                                               SpanAttrib(span_setup, p, 1), SpanAttrib(span_setup, p, 2));
+                    process_fragment(x, span.y, p.z, color);
                 }
-                frame_buffer[y * SCREEN_WIDTH + x] = color; 
-
-                #if !DRAW_DEPTH_BUF
-                iofifo.WriteFragment(x, y, z, color);
-                iofifo.Flush();
-                #endif
+                iofifo.CommandDone(cmd);
                 break;
             }
             case (GPU_PIPE_CMD_FRAG_STATE):
             {
                 // Update state
+                flush_output();
                 uint32_t state_word = iofifo.ReadFromFifo32();
                 depth_test_enabled = (state_word & GPU_STATE_FRAG_DEPTH);
                 mask_depth_update = (state_word & GPU_STATE_FRAG_DEPTHMASK);
@@ -169,15 +206,31 @@ int main(int argc, char **argv)
                 
                 blend_src_func = (state_word >> GPU_STATE_FRAG_BLENDSF_SHIFT) & 0xF;
                 blend_dst_func = (state_word >> GPU_STATE_FRAG_BLENDDF_SHIFT) & 0xF;
+                blend_kernel = SelectBlendKernel(blend_src_func, blend_dst_func, simd_blend);
+                if (blending_enabled && !(BlendFuncSupported(blend_src_func) && BlendFuncSupported(blend_dst_func)))
+                    fprintf(stderr, "Unsupported blending functions %u %u, zero factor is used\n", blend_src_func, blend_dst_func);
                 verbose("Fragment config: depth_test %d depth_update_mask %d alpha_test %d blending %d\n", depth_test_enabled, mask_depth_update, alpha_test_enabled, blending_enabled);
                 break;
             }
+            case (GPU_PIPE_CMD_SYNC):
+            {
+                flush_output();
+                iofifo.BypassCmd(cmd);
+                break;
+            }
+            case (GPU_PIPE_CMD_FRAME_END):
+            {
+                // frame is complete, publish it to display (marker goes no further)
+                flush_output();
+                if (frame_export)
+                    frame_export->Publish(target);
+                break;
+            }
             case (GPU_PIPE_CMD_CLEAR_FB):
             {
                 // fill frame buffer with zero vals
-                for (int i = 0; i < SCREEN_WIDTH; ++i)
-                    for (int j = 0; j < SCREEN_HEIGHT; ++j)
-                        frame_buffer[i*SCREEN_HEIGHT + j] = 0;
+                flush_output();
+                target.ClearColor(0);
                 iofifo.BypassCmd(cmd);  // in emulator it is required to pass clear command to the end
                 break;
             }
@@ -185,6 +238,9 @@ int main(int argc, char **argv)
             {
                 // just pass to next stage all unknown commands
                 assert((cmd & 0xFFFF0000) == 0xFFFF0000);
+                if (cmd == GPU_PIPE_CMD_TEXSPAN_SETUP)
+                    span_setup.texture = true;
+                flush_output();
                 iofifo.BypassCmd(cmd);
                 break;
             }
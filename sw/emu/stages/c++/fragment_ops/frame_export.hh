@@ -0,0 +1,90 @@
+#ifndef _FRAME_EXPORT_HH
+#define _FRAME_EXPORT_HH
+
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring_fifo.hh"
+#include "render_target.hh"
+
+// Double buffered framebuffer in shared memory (memfd created by pipeline launcher
+// and passed as "framebuffer=memfd:N" option). Fragment ops copies resolved color
+// buffer to it on GPU_PIPE_CMD_FRAME_END, which emulator injects into pipeline on
+// frame switch, so display shows whole frames straight from shared memory.
+//
+// Layout: header page, then two buffers of width*height pixels, rows go top down.
+// Frame N is written to buffer N % 2. Writer sets "writing" before copy & "published"
+// after it, so reader of published frame N has to retry if "writing" reached N + 2.
+
+const uint32_t FRAME_EXPORT_MAGIC       = 0x4246474F;   // "OGFB"
+const size_t FRAME_EXPORT_HEADER_SIZE   = 4096;
+
+class FrameExport
+{
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t width;
+        uint32_t height;
+        uint32_t frames;                    // number of buffers
+        std::atomic<uint32_t> writing;      // number of frame being written
+        std::atomic<uint32_t> published;    // number of last complete frame (0 - none)
+    };
+
+    Header *hdr;
+    uint32_t *buffers;
+    void *mmap_addr;
+    size_t mmap_len;
+    uint32_t frame = 0;
+
+    public:
+    FrameExport(const std::string &name, uint32_t width, uint32_t height)
+    {
+        struct stat st;
+        int fd = RingFifo::IsRingName(name) ? atoi(name.c_str() + RING_FIFO_PREFIX.size()) : -1;
+        size_t len = FRAME_EXPORT_HEADER_SIZE + 2 * (size_t)width * height * sizeof(uint32_t);
+        if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < len)
+        {
+            std::cerr << "Failed to open shared framebuffer " << name << std::endl;
+            exit(ENFILE);
+        }
+
+        mmap_len = st.st_size;
+        mmap_addr = mmap(NULL, mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mmap_addr == MAP_FAILED)
+        {
+            std::cerr << "Failed to map shared framebuffer " << name << std::endl;
+            exit(ENFILE);
+        }
+
+        hdr = (Header*)mmap_addr;
+        buffers = (uint32_t*)((uint8_t*)mmap_addr + FRAME_EXPORT_HEADER_SIZE);
+        hdr->width = width;
+        hdr->height = height;
+        hdr->frames = 2;
+        frame = hdr->published.load();
+        hdr->magic = FRAME_EXPORT_MAGIC;
+    }
+
+    ~FrameExport()
+    {
+        munmap(mmap_addr, mmap_len);
+    }
+
+    // Copy current color buffer to free buffer & make it visible
+    void Publish(RenderTarget &target)
+    {
+        frame++;
+        hdr->writing.store(frame, std::memory_order_seq_cst);
+        target.CopyColor(buffers + (frame % 2) * (size_t)target.width * target.height, true);
+        hdr->published.store(frame, std::memory_order_release);
+    }
+};
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef _RENDER_TARGET_HH
+#define _RENDER_TARGET_HH
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Max supported resolution (4K with some margin, coords are 16 bit in fragments anyway)
+const uint32_t RENDER_TARGET_MAX_WIDTH  = 4096;
+const uint32_t RENDER_TARGET_MAX_HEIGHT = 4096;
+// Rows are padded to cache line
+const uint32_t RENDER_TARGET_ALIGN      = 64;
+// Size of tiles for lazy clears, tile row is one cache line
+const uint32_t RENDER_TILE_WIDTH        = RENDER_TARGET_ALIGN / sizeof(uint32_t);
+const uint32_t RENDER_TILE_HEIGHT       = 16;
+
+// One plane of render target (color or depth). Storage is mapped from anonymous memory,
+// so it is page aligned & could use huge pages, every row starts on cache line boundary.
+//
+// In lazy clear mode clear only starts new generation. Tiles with older generation are
+// filled with clear value on first access, so every read sees cleared value as before.
+class RenderBuffer
+{
+    uint32_t *data = nullptr;
+    size_t words = 0;
+    uint32_t stride = 0;            // row pitch in pixels
+
+    bool lazy_clear = false;
+    uint32_t tiles_x = 0;
+    std::vector<uint32_t> tile_gen; // generation of the last clear applied to tile
+    uint32_t gen = 0;               // current clear generation
+    uint32_t clear_value = 0;
+
+    // Streaming row-major fill, cleared buffer isn't needed in cache right after clear
+    static void Fill(uint32_t *buf, size_t words, uint32_t value)
+    {
+        #if defined(__SSE2__)
+        const __m128i v = _mm_set1_epi32(value);
+        __m128i *p = (__m128i*)buf;
+        __m128i *end = (__m128i*)(buf + words);   // buffers are multiple of cache line
+        for (; p < end; p += 4)
+        {
+            _mm_stream_si128(p + 0, v);
+            _mm_stream_si128(p + 1, v);
+            _mm_stream_si128(p + 2, v);
+            _mm_stream_si128(p + 3, v);
+        }
+        _mm_sfence();
+        #else
+        std::fill(buf, buf + words, value);
+        #endif
+    }
+
+    // Apply pending clear to tile, it is going to be used so plain stores are fine
+    void ClearTile(uint32_t tile)
+    {
+        uint32_t x0 = (tile % tiles_x) * RENDER_TILE_WIDTH;
+        uint32_t y0 = (tile / tiles_x) * RENDER_TILE_HEIGHT;
+        uint32_t *row = data + (size_t)y0 * stride + x0;
+        for (uint32_t y = 0; y < RENDER_TILE_HEIGHT && (size_t)(y0 + y) * stride < words; y++, row += stride)
+            std::fill(row, row + RENDER_TILE_WIDTH, clear_value);
+        tile_gen[tile] = gen;
+    }
+
+    public:
+    RenderBuffer() = default;
+    RenderBuffer(const RenderBuffer&) = delete;
+    RenderBuffer& operator=(const RenderBuffer&) = delete;
+
+    ~RenderBuffer()
+    {
+        if (data)
+            munmap(data, words * sizeof(uint32_t));
+    }
+
+    void Init(uint32_t height, uint32_t row_pitch, bool lazy)
+    {
+        stride = row_pitch;
+        words = (size_t)stride * height;
+        size_t len = words * sizeof(uint32_t);
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            perror("Failed to allocate render target");
+            exit(1);
+        }
+        #ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);
+        #endif
+        data = (uint32_t*)p;
+
+        lazy_clear = lazy;
+        tiles_x = stride / RENDER_TILE_WIDTH;
+        tile_gen.assign(tiles_x * ((height + RENDER_TILE_HEIGHT - 1) / RENDER_TILE_HEIGHT), 0);
+    }
+
+    uint32_t &At(uint32_t x, uint32_t y)
+    {
+        if (lazy_clear)
+        {
+            uint32_t tile = (y / RENDER_TILE_HEIGHT) * tiles_x + x / RENDER_TILE_WIDTH;
+            if (tile_gen[tile] != gen)
+                ClearTile(tile);
+        }
+        return data[(size_t)y * stride + x];
+    }
+
+    void Clear(uint32_t value)
+    {
+        if (!lazy_clear)
+        {
+            Fill(data, words, value);
+            return;
+        }
+
+        // on generation counter wrap old tiles could look cleared, so apply pending clear everywhere
+        if (gen == UINT32_MAX)
+        {
+            Resolve();
+            std::fill(tile_gen.begin(), tile_gen.end(), 0);
+            gen = 0;
+        }
+        gen++;
+        clear_value = value;
+    }
+
+    // Copy width x height pixels to dst rows dst_stride apart (negative flips image),
+    // tiles with pending clear give clear value
+    void CopyTo(uint32_t *dst, ptrdiff_t dst_stride, uint32_t width, uint32_t height)
+    {
+        for (uint32_t y = 0; y < height; y++, dst += dst_stride)
+        {
+            const uint32_t *row = data + (size_t)y * stride;
+            if (!lazy_clear)
+            {
+                std::copy(row, row + width, dst);
+                continue;
+            }
+            const uint32_t *gens = &tile_gen[(y / RENDER_TILE_HEIGHT) * tiles_x];
+            for (uint32_t x = 0; x < width; x += RENDER_TILE_WIDTH)
+            {
+                uint32_t len = std::min(RENDER_TILE_WIDTH, width - x);
+                if (gens[x / RENDER_TILE_WIDTH] == gen)
+                    std::copy(row + x, row + x + len, dst + x);
+                else
+                    std::fill(dst + x, dst + x + len, clear_value);
+            }
+        }
+    }
+
+    // Apply pending clear to all tiles
+    void Resolve()
+    {
+        for (uint32_t tile = 0; tile < tile_gen.size(); tile++)
+            if (tile_gen[tile] != gen)
+                ClearTile(tile);
+    }
+};
+
+// Color & depth buffers of fragment ops
+class RenderTarget
+{
+    RenderBuffer color;
+    RenderBuffer depth;
+
+    public:
+    const uint32_t width;
+    const uint32_t height;
+    const uint32_t stride;      // row pitch in pixels
+
+    RenderTarget(uint32_t width, uint32_t height, bool lazy_clear = true) :
+        width(width), height(height),
+        stride((width + RENDER_TILE_WIDTH - 1) / RENDER_TILE_WIDTH * RENDER_TILE_WIDTH)
+    {
+        if (!width || !height || width > RENDER_TARGET_MAX_WIDTH || height > RENDER_TARGET_MAX_HEIGHT)
+        {
+            fprintf(stderr, "Unsupported resolution %ux%u (max %ux%u)\n", width, height, RENDER_TARGET_MAX_WIDTH, RENDER_TARGET_MAX_HEIGHT);
+            exit(1);
+        }
+        color.Init(height, stride, lazy_clear);
+        depth.Init(height, stride, lazy_clear);
+    }
+
+    uint32_t &Color(uint32_t x, uint32_t y)
+    {
+        return color.At(x, y);
+    }
+
+    uint32_t &Depth(uint32_t x, uint32_t y)
+    {
+        return depth.At(x, y);
+    }
+
+    // Resolved color buffer without row padding, top_down puts upper (last) row first like on screen
+    void CopyColor(uint32_t *dst, bool top_down = false)
+    {
+        if (top_down)
+            color.CopyTo(dst + (size_t)(height - 1) * width, -(ptrdiff_t)width, width, height);
+        else
+            color.CopyTo(dst, width, width, height);
+    }
+
+    void ClearColor(uint32_t value)
+    {
+        color.Clear(value);
+    }
+
+    void ClearDepth(uint32_t value)
+    {
+        depth.Clear(value);
+    }
+};
+
+#endif
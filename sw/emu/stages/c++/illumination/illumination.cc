@@ -105,9 +105,9 @@ void illumination()
 } 
 
 #if BUILD_BINARY
-int main(int argc, char **argv) 
+STAGE_MAIN(int argc, char **argv)
 {
-    if (argc != 5) {
+    if (argc < 5) {
         puts("Wrong parameters!");
         return 1;
     }
@@ -116,7 +116,8 @@ int main(int argc, char **argv)
     const uint32_t SCREEN_HEIGHT    = atoi(argv[2]);
         
     // Open output FIFO
-    iofifo = new IoFifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    iofifo = new IoFifo(argv[3], argv[4], options);
     
     while (1)
     {
@@ -125,6 +126,7 @@ int main(int argc, char **argv)
         {
             case GPU_PIPE_CMD_POLY_VERTEX4N3:
                 illumination();
+                iofifo->CommandDone(cmd);
                 break;
                 
             case GPU_PIPE_CMD_POLY_VERTEX3N3:
@@ -0,0 +1,147 @@
+#ifndef _FRAGMENT_SPAN_HH
+#define _FRAGMENT_SPAN_HH
+
+#include <cmath>
+
+#include "gpu_pipeline.hh"
+
+// Fragment spans. Instead of separate fragments rasterizer could send polygon attributes
+// once (SPAN_SETUP or TEXSPAN_SETUP) & then runs of covered pixels (SPAN) with values of
+// edge functions at the start of a line. Edge functions step by dx per pixel & consumers
+// derive depth, colors & texcoords of every pixel with exactly the same operations as
+// rasterizer, so results are bit-exact with separate fragments. Textured setup also has
+// edge functions step along y, so texturing could find texcoord derivatives for mipmapping.
+//
+// SPAN_SETUP:      dx[3], z[3], w[3], area, colors[3][4]
+// TEXSPAN_SETUP:   dx[3], z[3], w[3], area, texcoords[3][2], dy[3]
+// SPAN:            y << 16 | x, length, line[3]
+//
+// COLORSPAN carries final colors of consecutive pixels from fragment ops to display:
+// y << 16 | x, color[N], number of pixels N is in arguments number field of command.
+
+//const float EDGE_ZERO_VAL = 0.0078125; // exp = 120
+const float EDGE_ZERO_VAL = 0.001953125; // exp = 118
+
+static inline float check_zero_edge(float w)
+{
+    return (fabs(w) < EDGE_ZERO_VAL) ? 0. : w;
+}
+
+// Calculate vertex attribs with FMACs to align precision with hardware
+static inline float fmac_attribs(float v0, float v1, float v2, float w0, float w1, float w2)
+{
+    return fmaf(w2, v2, fmaf(w1, v1, w0*v0));
+}
+
+// Polygon attributes from span setup command
+struct SpanSetup
+{
+    float dx[3];        // edge functions step along x
+    float z[3];         // vertices depth
+    float w[3];         // vertices w
+    float area;         // reciprocal of polygon area
+    float attr[3][4];   // vertices colors or texcoords divided by w
+    float dy[3];        // edge functions step along y (textured setup only)
+    bool texture;
+};
+
+// Largest number of span setup arguments
+const uint32_t SPAN_SETUP_ARGS = (GPU_PIPE_CMD_SPAN_SETUP >> 8) & 0xFF;
+
+// Span of covered pixels
+struct Span
+{
+    uint32_t x, y;
+    uint32_t length;
+    float line[3];      // edge functions at line y
+};
+
+// Pixel of span
+struct SpanPixel
+{
+    float w[3];         // edge functions
+    float wn;           // reciprocal of interpolated w
+    uint32_t z;
+};
+
+static inline void ReadSpanSetup(IoFifo &fifo, const uint32_t cmd, SpanSetup &s)
+{
+    s.texture = (cmd == GPU_PIPE_CMD_TEXSPAN_SETUP);
+    fifo.ReadFloats(s.dx, 3);
+    fifo.ReadFloats(s.z, 3);
+    fifo.ReadFloats(s.w, 3);
+    s.area = fifo.ReadFromFifoFloat();
+    for (int i = 0; i < 3; i++)
+        fifo.ReadFloats(s.attr[i], s.texture ? 2 : 4);
+    if (s.texture)
+        fifo.ReadFloats(s.dy, 3);
+}
+
+static inline void ReadSpan(IoFifo &fifo, Span &span)
+{
+    uint32_t words[2];
+    fifo.ReadWords(words, 2);
+    span.x = words[0] & 0xFFFF;
+    span.y = (words[0] >> 16) & 0xFFFF;
+    span.length = words[1];
+    fifo.ReadFloats(span.line, 3);
+}
+
+// Edge functions, depth & w of span pixel x, returns false if pixel is out of depth range
+static inline bool SpanPixelSetup(const SpanSetup &s, const Span &span, uint32_t x, SpanPixel &p)
+{
+    float px = x + 0.5f;
+    for (int i = 0; i < 3; i++)
+        p.w[i] = check_zero_edge(fmaf(px, s.dx[i], span.line[i]));
+
+    float fz = (s.z[0] * p.w[0] + s.z[1] * p.w[1] + s.z[2] * p.w[2]) * s.area;
+    if (fz < 0 || fz > 1)
+        return false;
+    p.z = (uint32_t)(fz * PIPELINE_MAX_Z) & PIPELINE_MAX_Z;
+
+    p.wn = 1. / fmac_attribs(s.w[0], s.w[1], s.w[2], p.w[0], p.w[1], p.w[2]);
+    return true;
+}
+
+// Perspective correct attribute i (color channel or texcoord) of span pixel
+static inline float SpanAttrib(const SpanSetup &s, const SpanPixel &p, int i)
+{
+    return fmac_attribs(s.attr[0][i], s.attr[1][i], s.attr[2][i], p.w[0], p.w[1], p.w[2]) * p.wn;
+}
+
+// Collects final colors of consecutive pixels into COLORSPAN commands
+class ColorSpanWriter
+{
+    IoFifo &fifo;
+    uint32_t words[2 + GPU_PIPE_COLORSPAN_MAX];
+    uint32_t x0 = 0, y0 = 0;
+    uint32_t length = 0;
+
+    public:
+    ColorSpanWriter(IoFifo &fifo) : fifo(fifo) {}
+
+    void Write(const uint32_t x, const uint32_t y, const uint32_t color)
+    {
+        if (length && (y != y0 || x != x0 + length || length == GPU_PIPE_COLORSPAN_MAX))
+            Flush();
+        if (!length)
+        {
+            x0 = x;
+            y0 = y;
+        }
+        words[2 + length++] = color;
+    }
+
+    // Pass collected span to FIFO, should be called before any other output
+    void Flush()
+    {
+        if (!length)
+            return;
+        words[0] = GPU_PIPE_CMD_COLORSPAN | ((length + 1) << 8);
+        words[1] = (y0 << 16) | x0;
+        fifo.WriteWords(words, 2 + length);
+        length = 0;
+    }
+};
+
+#endif
@@ -54,6 +54,14 @@ enum { X, Y, Z, W };    // coords enum
 #include <iofifo.hh> 
 #include <oglory_gpu_defs.hh> 
 
+// Stage entry point: process main for stage binary or function called
+// in own thread by oglory_pipeline for stage shared object
+#if BUILD_STAGE
+#define STAGE_MAIN extern "C" int oglory_stage_main
+#else
+#define STAGE_MAIN int main
+#endif
+
 #if VERBOSE
 #define verbose(...) printf(__VA_ARGS__)
 #else
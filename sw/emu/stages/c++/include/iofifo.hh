@@ -1,140 +1,484 @@
 #ifndef _IOFIFO_HH
 #define _IOFIFO_HH
 
-#include <string> 
-#include <iostream> 
-#include <fstream> 
-#include <cassert> 
-#include <cstdlib> 
-#include <cstdint> 
-#include <errno.h> 
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#if BUILD_STAGE
+#include <pthread.h>
+#endif
 
 #include "oglory_gpu_defs.hh"
+#include "ring_fifo.hh"
+#include "stage_options.hh"
+
+// Size of user-space FIFO buffers in words
+const size_t IOFIFO_BUF_WORDS   = 64*1024;
+// Requested kernel pipe buffer size
+const int IOFIFO_PIPE_SIZE      = 1024*1024;
+// Default max time output could stay buffered while stage is busy
+const long IOFIFO_DEADLINE_US   = 1000;
+// Deadline is checked once per this amount of finished commands
+const uint32_t IOFIFO_DEADLINE_CHECK_CMDS = 32;
+
+// Output flush policy
+enum IoFifoFlushMode
+{
+    IOFIFO_FLUSH_EAGER,         // flush after every command
+    IOFIFO_FLUSH_ADAPTIVE       // flush on sync commands, full buffer, deadline or when stage waits for input
+};
+
+// Flush reasons counted in stats
+enum IoFifoFlushReason
+{
+    IOFIFO_FLUSH_FORCED,
+    IOFIFO_FLUSH_CMD,
+    IOFIFO_FLUSH_FULL,
+    IOFIFO_FLUSH_DEADLINE,
+    IOFIFO_FLUSH_IDLE,
+    IOFIFO_FLUSH_REASONS
+};
 
 class IoFifo
 {
-    std::ofstream out_fifo;
-    std::ifstream in_fifo;
-    
+    // named pipes (or files) are accessed with raw syscalls through own buffers
+    int out_fd = -1;
+    int in_fd = -1;
+    uint32_t *out_buf = nullptr;
+    uint32_t *in_buf = nullptr;
+    size_t out_pos = 0;         // words in output buffer
+    size_t in_pos = 0;          // words consumed from input buffer
+    size_t in_words = 0;        // whole words in input buffer
+    size_t in_bytes = 0;        // bytes in input buffer (could end with partial word)
+
+    // shared memory rings used instead of streams if FIFO name is "memfd:N"
+    RingFifo *out_ring = nullptr;
+    RingFifo *in_ring = nullptr;
+
+    // flush policy
+    IoFifoFlushMode flush_mode = IOFIFO_FLUSH_ADAPTIVE;
+    long deadline_us = IOFIFO_DEADLINE_US;
+    uint64_t pending_since = 0;     // time when first word went to empty output buffer
+    uint32_t deadline_cmds = 0;
+
+    // stats
+    std::string name;
+    long stats_period = 0;          // print stats every N syncs if not zero
+    uint64_t sync_count = 0;
+    uint64_t words_out = 0;
+    uint64_t flush_count[IOFIFO_FLUSH_REASONS] = {};
+
+    static uint64_t TimeUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    bool OutPending() const
+    {
+        return out_ring ? out_ring->Pending() : (out_pos != 0);
+    }
+
+    // Output deadline is counted from the first word written after flush
+    void MarkPending()
+    {
+        if (!OutPending())
+            pending_since = TimeUs();
+    }
+
+    void Flush(IoFifoFlushReason reason)
+    {
+        if (!OutPending())
+            return;
+        if (out_ring)
+            out_ring->Flush();
+        else
+        {
+            WriteOut(out_buf, out_pos);
+            out_pos = 0;
+        }
+        flush_count[reason]++;
+    }
+
+    // Flush output before blocking on input so next stage never waits for data we already have
+    void IdleFlush()
+    {
+        if (!InputReady())
+            Flush(IOFIFO_FLUSH_IDLE);
+    }
+
+    // Output buffer is full
+    void FlushFull()
+    {
+        WriteOut(out_buf, out_pos);
+        out_pos = 0;
+        flush_count[IOFIFO_FLUSH_FULL]++;
+    }
+
+    // Write whole output buffer to pipe
+    void WriteOut(const uint32_t *buf, size_t words)
+    {
+        const uint8_t *p = (const uint8_t*)buf;
+        size_t len = words * sizeof(uint32_t);
+        while (len)
+        {
+            ssize_t ret = write(out_fd, p, len);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Failed to write output FIFO: " << strerror(errno) << std::endl;
+                exit(EPIPE);
+            }
+            p += ret;
+            len -= ret;
+        }
+    }
+
+    // Previous stage is gone, finish gracefully passing everything already processed
+    [[noreturn]] void InputClosed()
+    {
+        Flush();
+        if (stats_period)
+            PrintStats();
+
+        // let next stage see end of stream
+        if (out_ring)
+            out_ring->Close();
+        else if (out_fd >= 0)
+        {
+            close(out_fd);
+            out_fd = -1;
+        }
+
+        #if BUILD_STAGE
+        // stage is a thread of oglory_pipeline, finish only it
+        pthread_exit(nullptr);
+        #else
+        exit(0);
+        #endif
+    }
+
+    // Refill input buffer, blocks till at least one whole word is received
+    void FillIn()
+    {
+        // keep tail of partially received word
+        size_t partial = in_bytes - in_words*sizeof(uint32_t);
+        memmove(in_buf, (uint8_t*)in_buf + in_bytes - partial, partial);
+        in_bytes = partial;
+        in_pos = 0;
+        in_words = 0;
+
+        if (OutPending())
+            IdleFlush();
+
+        while (in_bytes < sizeof(uint32_t))
+        {
+            ssize_t ret = read(in_fd, (uint8_t*)in_buf + in_bytes, IOFIFO_BUF_WORDS*sizeof(uint32_t) - in_bytes);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                InputClosed();
+            in_bytes += ret;
+        }
+        in_words = in_bytes / sizeof(uint32_t);
+    }
+
     public:
-    
+
     // ######################## Initialization ########################
-    
-    IoFifo(std::string ififo_name, std::string ofifo_name)
+
+    IoFifo(std::string ififo_name, std::string ofifo_name, const StageOptions &options = StageOptions())
     {
-        
-        in_fifo.open(ififo_name.c_str());
-        
-        if (!ofifo_name.empty())
+        SetFlushPolicy(options);
+
+        if (RingFifo::IsRingName(ififo_name))
+            in_ring = new RingFifo(ififo_name);
+        else if (!ififo_name.empty())
         {
-            out_fifo.open(ofifo_name.c_str());
-            if (!out_fifo.is_open())
+            in_fd = open(ififo_name.c_str(), O_RDONLY);
+            if (in_fd < 0)
             {
-                std::cerr << "Failed to open output file " << ififo_name << std::endl;
+                std::cerr << "Failed to open input file " << ififo_name << std::endl;
                 exit(ENFILE);
             }
+            in_buf = new uint32_t[IOFIFO_BUF_WORDS];
         }
-        
-        if (!ififo_name.empty())
+
+        if (RingFifo::IsRingName(ofifo_name))
+            out_ring = new RingFifo(ofifo_name);
+        else if (!ofifo_name.empty())
         {
-            if (!in_fifo.is_open())
+            out_fd = open(ofifo_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd < 0)
             {
-                std::cerr << "Failed to open input file " << ififo_name << std::endl;
+                std::cerr << "Failed to open output file " << ofifo_name << std::endl;
                 exit(ENFILE);
             }
+            // larger kernel buffer means less context switches between stages (fails for regular files)
+            fcntl(out_fd, F_SETPIPE_SZ, IOFIFO_PIPE_SIZE);
+            out_buf = new uint32_t[IOFIFO_BUF_WORDS];
+        }
+    }
+
+    ~IoFifo()
+    {
+        Flush();
+        delete out_ring;
+        delete in_ring;
+        delete[] out_buf;
+        delete[] in_buf;
+        if (out_fd >= 0)
+            close(out_fd);
+        if (in_fd >= 0)
+            close(in_fd);
+    }
+
+    // Configure flush policy & stats from stage options:
+    //   flush=eager|adaptive   flush_us=<output latency deadline>   fifo_stats=<print every N syncs>
+    void SetFlushPolicy(const StageOptions &options)
+    {
+        std::string mode = options.Get("flush", "adaptive");
+        if (mode == "eager")
+            flush_mode = IOFIFO_FLUSH_EAGER;
+        else if (mode == "adaptive")
+            flush_mode = IOFIFO_FLUSH_ADAPTIVE;
+        else
+            std::cerr << "Unknown FIFO flush mode " << mode << std::endl;
+        deadline_us = options.GetInt("flush_us", IOFIFO_DEADLINE_US);
+        stats_period = options.GetInt("fifo_stats", 0);
+        name = options.Name();
+    }
+
+    void PrintStats() const
+    {
+        std::cerr << name << " FIFO: " << words_out << " words out, flushes: "
+            << flush_count[IOFIFO_FLUSH_FORCED] << " forced, "
+            << flush_count[IOFIFO_FLUSH_CMD] << " cmd, "
+            << flush_count[IOFIFO_FLUSH_FULL] << " full, "
+            << flush_count[IOFIFO_FLUSH_DEADLINE] << " deadline, "
+            << flush_count[IOFIFO_FLUSH_IDLE] << " idle ("
+            << (flush_mode == IOFIFO_FLUSH_EAGER ? "eager" : "adaptive") << ", "
+            << deadline_us << " us)" << std::endl;
+    }
+
+    // ######################## Bulk ops ########################
+
+    // Write n 32-bit words to output FIFO
+    void WriteWords(const uint32_t *x, size_t n)
+    {
+        #if PRINT_FIFO
+        for (size_t i = 0; i < n; i++)
+            printf("%08X\n", x[i]);
+        #endif
+        words_out += n;
+        if (out_ring)
+        {
+            MarkPending();
+            out_ring->WriteWords(x, n);
+            return;
+        }
+
+        if (out_pos + n > IOFIFO_BUF_WORDS)
+        {
+            FlushFull();
+            if (n > IOFIFO_BUF_WORDS)
+            {
+                // no need to copy huge blocks
+                WriteOut(x, n);
+                return;
+            }
+        }
+        MarkPending();
+        memcpy(out_buf + out_pos, x, n*sizeof(uint32_t));
+        out_pos += n;
+    }
+
+    // Read n 32-bit words from input FIFO
+    void ReadWords(uint32_t *x, size_t n)
+    {
+        if (in_ring)
+        {
+            if (OutPending())
+                IdleFlush();
+            if (in_ring->ReadWords(x, n) != n)
+                InputClosed();
+            return;
+        }
+
+        while (n)
+        {
+            if (in_pos == in_words)
+                FillIn();
+            size_t len = std::min(n, in_words - in_pos);
+            memcpy(x, in_buf + in_pos, len*sizeof(uint32_t));
+            in_pos += len;
+            x += len;
+            n -= len;
         }
     }
-    
+
+    // Float versions of bulk ops
+    void WriteFloats(const float *x, size_t n)
+    {
+        WriteWords((const uint32_t*)x, n);
+    }
+
+    void ReadFloats(float *x, size_t n)
+    {
+        ReadWords((uint32_t*)x, n);
+    }
+
     // ######################## Basic ops ########################
-    
+
     // Write 32-bit word to output FIFO
     void WriteToFifo32(const uint32_t x)
     {
         #if PRINT_FIFO
         printf("%08X\n", x);
         #endif
-        out_fifo.write((char*)&x, sizeof(x));
+        words_out++;
+        if (out_ring)
+        {
+            MarkPending();
+            out_ring->Write(x);
+        }
+        else
+        {
+            if (out_pos == IOFIFO_BUF_WORDS)
+                FlushFull();
+            MarkPending();
+            out_buf[out_pos++] = x;
+        }
     }
-    
+
     // Write 32-bit word to output FIFO
     void WriteToFifoFloat(const float x)
     {
-        #if PRINT_FIFO
-        printf("%08X\n", *(uint32_t*)&x);
-        #endif
-        out_fifo.write((char*)&x, sizeof(x));
+        uint32_t w;
+        memcpy(&w, &x, sizeof(w));
+        WriteToFifo32(w);
     }
-    
+
     // Read 32-bit word from input FIFO
     uint32_t ReadFromFifo32()
     {
-        uint32_t x;
-        in_fifo.read((char*)&x, sizeof(x));
-        return x;
+        if (in_ring)
+        {
+            if (OutPending())
+                IdleFlush();
+            if (!in_ring->WaitData())
+                InputClosed();
+            return in_ring->Read();
+        }
+        if (in_pos == in_words)
+            FillIn();
+        return in_buf[in_pos++];
     }
-    
+
     // Read float from input FIFO
     float ReadFromFifoFloat()
     {
-        float x;
-        in_fifo.read((char*)&x, sizeof(x));
-        return x;
+        uint32_t x = ReadFromFifo32();
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    // Input could be read without blocking (end of stream is not counted as data)
+    bool InputReady()
+    {
+        if (in_ring)
+            return !in_ring->Empty();
+        if (in_pos != in_words)
+            return true;
+        struct pollfd pfd = {in_fd, POLLIN, 0};
+        return (poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLIN);
     }
-    
+
     // Force finish all FIFO writes from buffer
     void Flush()
     {
-        out_fifo.flush();
+        Flush(IOFIFO_FLUSH_FORCED);
     }
-    
-    
+
+    // Stage finished processing of command, flush output if policy says so
+    void CommandDone(const uint32_t cmd)
+    {
+        bool sync = (cmd == GPU_PIPE_CMD_SYNC) || (cmd == GPU_PIPE_CMD_CLEAR_FB) || (cmd == GPU_PIPE_CMD_CLEAR_ZB) ||
+                    (cmd == GPU_PIPE_CMD_FRAME_END);
+        if (cmd == GPU_PIPE_CMD_SYNC && stats_period && (++sync_count % stats_period) == 0)
+            PrintStats();
+
+        if (!OutPending())
+            return;
+
+        if (sync || flush_mode == IOFIFO_FLUSH_EAGER)
+            Flush(IOFIFO_FLUSH_CMD);
+        else if (++deadline_cmds >= IOFIFO_DEADLINE_CHECK_CMDS)
+        {
+            // don't let output stay in buffer too long while stage is busy with input
+            deadline_cmds = 0;
+            if (TimeUs() - pending_since >= (uint64_t)deadline_us)
+                Flush(IOFIFO_FLUSH_DEADLINE);
+        }
+    }
+
+
     // ######################## Complex ops ########################
-    
+
     // Write fragment from rasterizer (uint color)
     void WriteFragment(const uint32_t x, const uint32_t y, const uint32_t z, const uint32_t c)
     {
-        WriteToFifo32(GPU_PIPE_CMD_FRAGMENT); 
-        WriteToFifo32((y << 16) | x); 
-        WriteToFifo32(z); 
-        WriteToFifo32(c); 
+        const uint32_t fragment[] = {GPU_PIPE_CMD_FRAGMENT, (y << 16) | x, z, c};
+        WriteWords(fragment, 4);
     }
-    
+
     // Write fragment from rasterizer
     void WriteFragment(const uint32_t x, const uint32_t y, const uint32_t z, const float r, const float g, const float b, const float a)
     {
-        WriteFragment(x, y, z, ArgbToU32(a, r, g, b)); 
+        WriteFragment(x, y, z, ArgbToU32(a, r, g, b));
     }
-    
+
     // Write fragment with texture coords
     void WriteTexFragment(const uint32_t x, const uint32_t y, const uint32_t z, const float t_x, const float t_y)
     {
-        WriteToFifo32(GPU_PIPE_CMD_TEXFRAGMENT); 
-        WriteToFifo32((y << 16) | x);
-        WriteToFifo32(z); 
-        WriteToFifoFloat(t_x); 
-        WriteToFifoFloat(t_y); 
+        uint32_t fragment[] = {GPU_PIPE_CMD_TEXFRAGMENT, (y << 16) | x, z, 0, 0};
+        memcpy(&fragment[3], &t_x, sizeof(float));
+        memcpy(&fragment[4], &t_y, sizeof(float));
+        WriteWords(fragment, 5);
     }
-    
+
     // Read fragment into fragment ops
     void ReadFragment(uint32_t fragment[])
     {
-        fragment[0] = ReadFromFifo32();     // x & y
-        fragment[1] = (fragment[0] >> 16) & 0xFFFF;     // y
-        fragment[0] &= 0xFFFF;              // x
-        fragment[2] = ReadFromFifo32();     // z
-        fragment[3] = ReadFromFifo32();     // 32-bit Color
+        uint32_t words[3];
+        ReadWords(words, 3);
+        fragment[0] = words[0] & 0xFFFF;            // x
+        fragment[1] = (words[0] >> 16) & 0xFFFF;    // y
+        fragment[2] = words[1];                     // z
+        fragment[3] = words[2];                     // 32-bit Color
     }
-    
+
     // Bypass command with its arguments to next stage
-    void BypassCmd(const int32_t cmd)
+    void BypassCmd(const uint32_t cmd)
     {
-        WriteToFifo32(cmd);
-        for (int i = 0; i < (cmd & 0xFF00) >> 8; i++)
-        {
-            uint32_t tmp = ReadFromFifo32(); 
-            WriteToFifo32(tmp);
-        }
-        Flush();
+        uint32_t words[1 + 0xFF];
+        size_t args = (cmd & 0xFF00) >> 8;
+        words[0] = cmd;
+        ReadWords(words + 1, args);
+        WriteWords(words, 1 + args);
+        CommandDone(cmd);
     }
 };
 
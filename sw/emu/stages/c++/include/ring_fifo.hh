@@ -0,0 +1,305 @@
+#ifndef _RING_FIFO_HH
+#define _RING_FIFO_HH
+
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Lock-free single-producer/single-consumer ring of 32-bit words placed in
+// shared memory (memfd created by pipeline launcher and passed as "memfd:N").
+// Zero filled memory is a valid empty ring, so no initialization handshake is
+// needed between producer & consumer. Sleeping is done with futexes on event
+// words, which are bumped on every wakeup (so wakeup isn't lost even if index
+// doesn't change, like on close), wakeups are only issued when the other side
+// is waiting.
+// Producer could close the ring, consumer sees it as end of stream.
+
+const std::string RING_FIFO_PREFIX = "memfd:";
+
+class RingFifo
+{
+    // Shared ring header, producer & consumer words are on separate cache lines
+    struct Header
+    {
+        alignas(64) std::atomic<uint32_t> head;             // next word to write
+        std::atomic<uint32_t> consumer_waiting;
+        std::atomic<uint32_t> consumer_event;
+        std::atomic<uint32_t> closed;
+        alignas(64) std::atomic<uint32_t> tail;             // next word to read
+        std::atomic<uint32_t> producer_waiting;
+        std::atomic<uint32_t> producer_event;
+    };
+
+    static const int SPIN_COUNT = 256;
+
+    Header *hdr;
+    uint32_t *data;
+    uint32_t mask;
+    uint32_t publish_step;
+
+    void *mmap_addr;
+    size_t mmap_len;
+
+    // local copies of indexes
+    uint32_t local_head, cached_tail, published_head;
+    uint32_t local_tail, cached_head, published_tail;
+
+    static long Futex(std::atomic<uint32_t> *addr, int op, uint32_t val)
+    {
+        return syscall(SYS_futex, (uint32_t*)addr, op, val, nullptr, nullptr, 0);
+    }
+
+    // Sleep till word at addr differs from val or ring is closed
+    void Wait(std::atomic<uint32_t> &addr, std::atomic<uint32_t> &waiting, std::atomic<uint32_t> &event, uint32_t val)
+    {
+        for (int i = 0; i < SPIN_COUNT; i++)
+        {
+            if (addr.load(std::memory_order_acquire) != val || hdr->closed.load(std::memory_order_acquire))
+                return;
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+        }
+
+        // event is read before the check, so wakeup after it makes futex wait return at once
+        waiting.store(1, std::memory_order_seq_cst);
+        while (true)
+        {
+            uint32_t ev = event.load(std::memory_order_seq_cst);
+            if (addr.load(std::memory_order_seq_cst) != val || hdr->closed.load(std::memory_order_seq_cst))
+                break;
+            Futex(&event, FUTEX_WAIT, ev);
+        }
+        waiting.store(0, std::memory_order_relaxed);
+    }
+
+    static void Wake(std::atomic<uint32_t> &waiting, std::atomic<uint32_t> &event)
+    {
+        if (waiting.load(std::memory_order_seq_cst))
+        {
+            event.fetch_add(1, std::memory_order_seq_cst);
+            Futex(&event, FUTEX_WAKE, 1);
+        }
+    }
+
+    static void Publish(std::atomic<uint32_t> &addr, std::atomic<uint32_t> &waiting, std::atomic<uint32_t> &event, uint32_t val)
+    {
+        addr.store(val, std::memory_order_seq_cst);
+        Wake(waiting, event);
+    }
+
+    public:
+
+    // ######################## Initialization ########################
+
+    // Check if FIFO name describes shared memory ring
+    static bool IsRingName(const std::string &name)
+    {
+        return name.compare(0, RING_FIFO_PREFIX.size(), RING_FIFO_PREFIX) == 0;
+    }
+
+    RingFifo(const std::string &name)
+    {
+        assert(IsRingName(name));
+        int fd = atoi(name.c_str() + RING_FIFO_PREFIX.size());
+        struct stat st;
+
+        if (fstat(fd, &st) || (size_t)st.st_size <= sizeof(Header))
+        {
+            std::cerr << "Failed to open ring FIFO " << name << std::endl;
+            exit(ENFILE);
+        }
+
+        mmap_len = st.st_size;
+        mmap_addr = mmap(NULL, mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mmap_addr == MAP_FAILED)
+        {
+            std::cerr << "Failed to map ring FIFO " << name << std::endl;
+            exit(ENFILE);
+        }
+
+        hdr = (Header*)mmap_addr;
+        data = (uint32_t*)((uint8_t*)mmap_addr + sizeof(Header));
+
+        // capacity is the largest power of two fitting into memory after header
+        uint32_t words = (mmap_len - sizeof(Header)) / sizeof(uint32_t);
+        uint32_t capacity = 1;
+        while (capacity*2 <= words)
+            capacity *= 2;
+        mask = capacity - 1;
+        publish_step = std::max(capacity / 8, 1u);
+
+        local_head = cached_head = published_head = hdr->head.load();
+        local_tail = cached_tail = published_tail = hdr->tail.load();
+    }
+
+    ~RingFifo()
+    {
+        Flush();
+        munmap(mmap_addr, mmap_len);
+    }
+
+    // ######################## Producer side ########################
+
+    // Return number of free words, blocks till there is at least one
+    uint32_t WaitSpace()
+    {
+        if (local_head - cached_tail > mask)
+        {
+            cached_tail = hdr->tail.load(std::memory_order_acquire);
+            while (local_head - cached_tail > mask)
+            {
+                // ring is full, let consumer see everything & wait for it
+                Flush();
+                Wait(hdr->tail, hdr->producer_waiting, hdr->producer_event, cached_tail);
+                cached_tail = hdr->tail.load(std::memory_order_acquire);
+            }
+        }
+        return mask + 1 - (local_head - cached_tail);
+    }
+
+    void Write(const uint32_t x)
+    {
+        WaitSpace();
+        data[local_head & mask] = x;
+        local_head++;
+
+        // publish big chunks without explicit flush to keep consumer busy
+        if (local_head - published_head >= publish_step)
+            Flush();
+    }
+
+    void WriteWords(const uint32_t *x, size_t n)
+    {
+        while (n)
+        {
+            // copy till ring end, free space end or data end
+            uint32_t pos = local_head & mask;
+            size_t len = std::min({n, (size_t)WaitSpace(), (size_t)(mask + 1 - pos)});
+            memcpy(data + pos, x, len*sizeof(uint32_t));
+            local_head += len;
+            x += len;
+            n -= len;
+
+            if (local_head - published_head >= publish_step)
+                Flush();
+        }
+    }
+
+    // Check if there are written but not yet published words
+    bool Pending() const
+    {
+        return local_head != published_head;
+    }
+
+    // Make all written words visible to consumer
+    void Flush()
+    {
+        if (published_head != local_head)
+        {
+            published_head = local_head;
+            Publish(hdr->head, hdr->consumer_waiting, hdr->consumer_event, local_head);
+        }
+    }
+
+    // Publish everything & mark end of stream
+    void Close()
+    {
+        Flush();
+        hdr->closed.store(1, std::memory_order_seq_cst);
+        Wake(hdr->consumer_waiting, hdr->consumer_event);
+    }
+
+    // ######################## Consumer side ########################
+
+    // Return number of available words, blocks till there is at least one
+    // (returns zero only if ring is closed & empty)
+    uint32_t WaitData()
+    {
+        if (local_tail == cached_head)
+        {
+            cached_head = hdr->head.load(std::memory_order_acquire);
+            while (local_tail == cached_head)
+            {
+                if (hdr->closed.load(std::memory_order_acquire))
+                {
+                    // producer could write more before closing
+                    cached_head = hdr->head.load(std::memory_order_acquire);
+                    if (local_tail == cached_head)
+                        return 0;
+                    break;
+                }
+                // ring is empty, return all consumed space to producer & wait
+                Release();
+                Wait(hdr->head, hdr->consumer_waiting, hdr->consumer_event, cached_head);
+                cached_head = hdr->head.load(std::memory_order_acquire);
+            }
+        }
+        return cached_head - local_tail;
+    }
+
+    // Check if there is nothing to read without blocking
+    bool Empty()
+    {
+        if (local_tail != cached_head)
+            return false;
+        cached_head = hdr->head.load(std::memory_order_acquire);
+        return local_tail == cached_head;
+    }
+
+    // Read one word, WaitData() has to be checked before if ring could be closed
+    uint32_t Read()
+    {
+        WaitData();
+        uint32_t x = data[local_tail & mask];
+        local_tail++;
+
+        if (local_tail - published_tail >= publish_step)
+            Release();
+        return x;
+    }
+
+    // Read n words, returns less only if ring is closed
+    size_t ReadWords(uint32_t *x, size_t n)
+    {
+        size_t total = n;
+        while (n)
+        {
+            uint32_t pos = local_tail & mask;
+            size_t len = std::min({n, (size_t)WaitData(), (size_t)(mask + 1 - pos)});
+            if (!len)
+                break;
+            memcpy(x, data + pos, len*sizeof(uint32_t));
+            local_tail += len;
+            x += len;
+            n -= len;
+
+            if (local_tail - published_tail >= publish_step)
+                Release();
+        }
+        return total - n;
+    }
+
+    // Return consumed words to producer
+    void Release()
+    {
+        if (published_tail != local_tail)
+        {
+            published_tail = local_tail;
+            Publish(hdr->tail, hdr->producer_waiting, hdr->producer_event, local_tail);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef _SIMD_HH
+#define _SIMD_HH
+
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+#include "stage_options.hh"
+
+// Runtime selection of SIMD kernels. Kernels are compiled for their instruction
+// set with target attributes, so stage binaries still run on any CPU and pick
+// implementation on startup. Build uses -ffp-contract=off, so kernels do the
+// same float operations as scalar code & produce bit-exact results.
+
+enum SimdLevel
+{
+    SIMD_NONE,
+    SIMD_SSE41,
+    SIMD_AVX2       // AVX2 + FMA
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86            1
+#define SIMD_TARGET_SSE41   __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2    __attribute__((target("avx2,fma")))
+#else
+#define SIMD_X86            0
+#endif
+
+// Best SIMD level supported by CPU
+static inline SimdLevel SimdDetect()
+{
+    #if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+    #endif
+    return SIMD_NONE;
+}
+
+static inline const char *SimdName(SimdLevel level)
+{
+    switch (level)
+    {
+        case SIMD_AVX2:     return "avx2";
+        case SIMD_SSE41:    return "sse4.1";
+        default:            return "off";
+    }
+}
+
+// SIMD level from stage option simd=auto|avx2|sse4.1|off limited by CPU capabilities
+static inline SimdLevel SimdSelect(const StageOptions &options)
+{
+    SimdLevel cpu = SimdDetect();
+    SimdLevel level = cpu;
+    std::string mode = options.Get("simd", "auto");
+
+    if (mode == "off")
+        level = SIMD_NONE;
+    else if (mode == "sse4.1")
+        level = SIMD_SSE41;
+    else if (mode == "avx2")
+        level = SIMD_AVX2;
+    else if (mode != "auto")
+        std::cerr << "Unknown SIMD mode " << mode << std::endl;
+
+    if (level > cpu)
+        std::cerr << "SIMD mode " << mode << " is not supported by CPU, using " << SimdName(cpu) << std::endl;
+    return std::min(level, cpu);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _STAGE_OPTIONS_HH
+#define _STAGE_OPTIONS_HH
+
+#include <string>
+#include <map>
+#include <cstdlib>
+
+// Optional stage parameters passed as "key=value" arguments after the
+// mandatory ones (width height in_fifo out_fifo). Filled from the "options"
+// object of stage description in pipeline JSON config.
+
+const int STAGE_OPTIONS_FIRST_ARG = 5;
+
+class StageOptions
+{
+    std::map<std::string, std::string> values;
+    std::string name;
+
+    public:
+
+    StageOptions() {}
+
+    StageOptions(int argc, char **argv, int first = STAGE_OPTIONS_FIRST_ARG)
+    {
+        if (argc > 0)
+        {
+            // stage name is binary name without path
+            name = argv[0];
+            size_t slash = name.rfind('/');
+            if (slash != std::string::npos)
+                name = name.substr(slash + 1);
+        }
+
+        for (int i = first; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos)
+                values[arg] = "1";  // flag without value
+            else
+                values[arg.substr(0, eq)] = arg.substr(eq + 1);
+        }
+    }
+
+    const std::string &Name() const
+    {
+        return name;
+    }
+
+    bool Has(const std::string &key) const
+    {
+        return values.count(key);
+    }
+
+    std::string Get(const std::string &key, const std::string &def = "") const
+    {
+        auto it = values.find(key);
+        return (it == values.end()) ? def : it->second;
+    }
+
+    long GetInt(const std::string &key, long def = 0) const
+    {
+        auto it = values.find(key);
+        return (it == values.end()) ? def : strtol(it->second.c_str(), nullptr, 0);
+    }
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ring_fifo.hh>
+
+// Threaded emulator pipeline: all stages are loaded as shared objects (built
+// with BUILD_STAGE) into one process & each one runs in own thread. Neighbour
+// stages are linked with shared memory rings, only the first input & the last
+// output are FIFOs given on command line.
+//
+// Usage: oglory_pipeline width height in_fifo out_fifo stage.so [key=value ...] [stage.so [key=value ...]] ...
+
+const size_t PIPELINE_RING_SIZE     = 4*1024*1024;
+const size_t PIPELINE_STACK_SIZE    = 8*1024*1024;     // same as usual process stack
+
+typedef int (*StageEntry)(int argc, char **argv);
+
+struct PipelineStage
+{
+    std::string lib;
+    std::vector<std::string> args;
+    std::vector<char*> argv;
+    StageEntry entry;
+    pthread_t thread;
+};
+
+static bool IsStageLib(const std::string &arg)
+{
+    const std::string ext = ".so";
+    return (arg.size() > ext.size()) && (arg.compare(arg.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+// Stage name (used in messages & stats) is library name without path & suffix
+static std::string StageName(const std::string &lib)
+{
+    std::string name = lib.substr(lib.rfind('/') + 1);
+    name = name.substr(0, name.rfind(".so"));
+    const std::string suffix = "_stage";
+    if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+        name.resize(name.size() - suffix.size());
+    return name;
+}
+
+static std::string CreateRing()
+{
+    int fd = memfd_create("oglory_ring", 0);
+    if (fd < 0 || ftruncate(fd, PIPELINE_RING_SIZE))
+    {
+        perror("Failed to create ring");
+        exit(1);
+    }
+    return RING_FIFO_PREFIX + std::to_string(fd);
+}
+
+static void *StageThread(void *arg)
+{
+    PipelineStage *stage = (PipelineStage*)arg;
+    int ret = stage->entry(stage->argv.size() - 1, stage->argv.data());
+
+    // stages return only on errors
+    fprintf(stderr, "Stage %s finished with code %d\n", stage->lib.c_str(), ret);
+    exit(ret ? ret : 1);
+    return nullptr;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 6 || !IsStageLib(argv[5]))
+    {
+        puts("Wrong parameters!");
+        printf("Usage: %s width height in_fifo out_fifo stage.so [key=value ...] [stage.so [key=value ...]] ...\n", argv[0]);
+        return 1;
+    }
+
+    // Parse stage list, each library could be followed by its options
+    std::vector<PipelineStage> stages;
+    for (int i = 5; i < argc; i++)
+    {
+        if (IsStageLib(argv[i]))
+        {
+            stages.emplace_back();
+            stages.back().lib = argv[i];
+        }
+        else
+            stages.back().args.push_back(argv[i]);
+    }
+
+    // Load stages, every library has own copy of stage globals so one library could be used only once
+    std::set<std::string> loaded;
+    for (auto &s : stages)
+    {
+        char path[PATH_MAX];
+        if (!realpath(s.lib.c_str(), path) || !loaded.insert(path).second)
+        {
+            fprintf(stderr, "Stage library %s not found or used twice\n", s.lib.c_str());
+            return 1;
+        }
+
+        void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+        {
+            fprintf(stderr, "Failed to load stage: %s\n", dlerror());
+            return 1;
+        }
+        s.entry = (StageEntry)dlsym(handle, "oglory_stage_main");
+        if (!s.entry)
+        {
+            fprintf(stderr, "No stage entry in %s\n", s.lib.c_str());
+            return 1;
+        }
+    }
+
+    // Link stages & build their command lines
+    std::string in_fifo = argv[3];
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        std::string out_fifo = (i == stages.size() - 1) ? argv[4] : CreateRing();
+        std::vector<std::string> args = {StageName(stages[i].lib), argv[1], argv[2], in_fifo, out_fifo};
+        args.insert(args.end(), stages[i].args.begin(), stages[i].args.end());
+        stages[i].args = args;
+        for (auto &a : stages[i].args)
+            stages[i].argv.push_back((char*)a.c_str());
+        stages[i].argv.push_back(nullptr);
+        in_fifo = out_fifo;
+    }
+
+    // Launch stage threads
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PIPELINE_STACK_SIZE);
+    for (auto &s : stages)
+    {
+        printf("Pipeline stage %s: launching thread\n", s.argv[0]);
+        if (pthread_create(&s.thread, &attr, StageThread, &s))
+        {
+            fprintf(stderr, "Failed to create thread for stage %s\n", s.argv[0]);
+            return 1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Stages finish one by one after input FIFO is closed
+    for (auto &s : stages)
+        pthread_join(s.thread, nullptr);
+
+    return 0;
+}
@@ -5,13 +5,18 @@
 #include <unistd.h>  
 
 #include <functional> 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#include <gpu_pipeline.hh> 
+#include "rast.hh"
 
 IoFifo *iofifo;
 
 bool draw_front = true;
 bool draw_back = true;
+bool edge_incremental = false;  // step edge functions with additions (not bit-exact with HDL)
+int32_t tile_size = 8;          // size of tiles for hierarchical traversal, 0 - scan whole bounding box
 
 #if VERBOSE
 void printVertex(const float *coords, const float *colors) {
@@ -35,13 +40,8 @@ void printPolygon(const float *coords, const float *colors) {
 // Matches edge function in HDL: E_01(P)=(V0.y*V1.x-V0.x*V1.y)+P.y*(V0.x-V1.x)+P.x*(V1.y-V0.y)
 float edgeFunction(const Vec4 &a, const Vec4 &b, const Vec4 &c) 
 { 
-    // uses FMACs to get same precision
-    float cached0 = fmaf(-a[0], b[1], (a[1] * b[0]));
-    float cached1 = (a[0] - b[0]);
-    float cached2 = (b[1] - a[1]);
-    float cached3 = fmaf(c[1], cached1, cached0);
-    float edge = fmaf(c[0], cached2, cached3);
-    return edge;
+    EdgeCoefs e = edgeSetup(a, b);
+    return edgePoint(e, edgeLine(e, c[1]), c[0]);
 } 
 
 int32_t MinCoord(float x0, float x1, float x2, int32_t lo, int32_t hi)
@@ -68,19 +68,403 @@ int32_t MaxCoord(float x0, float x1, float x2, int32_t lo, int32_t hi)
     }
 }
 
-// Calculate vertex attribs with FMACs to align precision with hardware
-float fmac_attribs(float v0, float v1, float v2, float w0, float w1, float w2)
+// Rasterize span of polygon bounding box line
+void rasterizeLineScalar(const TriangleSetup &t, FragmentBuffer &out, uint32_t y, int32_t x0, int32_t x1, bool covered)
 {
-    return fmaf(w2, v2, fmaf(w1, v1, w0*v0));
+    // line part of edge functions is calculated once per line as in HDL
+    float py = y + 0.5f;
+    float l0 = edgeLine(t.e0, py);
+    float l1 = edgeLine(t.e1, py);
+    float l2 = edgeLine(t.e2, py);
+    
+    // incremental mode starts every line from exact value & then adds x step
+    float px = x0 + 0.5f;
+    float s0 = edgePoint(t.e0, l0, px);
+    float s1 = edgePoint(t.e1, l1, px);
+    float s2 = edgePoint(t.e2, l2, px);
+    bool line_inside = false;
+    
+    for (int32_t x = x0; x <= x1; ++x) 
+    { 
+        verbose("Checking point x = %d (%d, %d), y = %d\n", x, x0, x1, y); 
+        float w0, w1, w2;
+        if (edge_incremental)
+        {
+            w0 = check_zero_edge(s0);
+            w1 = check_zero_edge(s1);
+            w2 = check_zero_edge(s2);
+            s0 += t.e0.dx;
+            s1 += t.e1.dx;
+            s2 += t.e2.dx;
+        }
+        else
+        {
+            px = x + 0.5f;
+            w0 = check_zero_edge(edgePoint(t.e0, l0, px)); 
+            w1 = check_zero_edge(edgePoint(t.e1, l1, px)); 
+            w2 = check_zero_edge(edgePoint(t.e2, l2, px));
+        }
+
+        verbose("area = %f, front_face = %d, w0 = %f, w1 = %f, w2 = %f\n", t.area, t.front_face, w0, w1, w2);
+        if (!covered && !(((w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) && !t.front_face) ||
+           ((w0 <= 0.f && w1 <= 0.f && w2 <= 0.f) && t.front_face)))
+        {
+            // edge functions are monotonic along the line, so it can't enter triangle again
+            if (line_inside)
+                break;
+            continue;
+        }
+        line_inside = true;
+        
+        float fz = (t.v0[2] * w0 + t.v1[2] * w1 + t.v2[2] * w2) * t.area;
+        
+        if (fz < 0 || fz > 1)
+            continue;
+            
+        uint32_t z = (uint32_t)(fz * PIPELINE_MAX_Z) & PIPELINE_MAX_Z;
+            
+        // calculate pixel attributes
+        float wn = 1. / fmac_attribs(t.v0[3], t.v1[3], t.v2[3], w0, w1, w2);
+            
+        if (!t.do_texture)
+        {
+            float r = fmac_attribs(t.c0[0], t.c1[0], t.c2[0], w0, w1, w2) * wn; 
+            float g = fmac_attribs(t.c0[1], t.c1[1], t.c2[1], w0, w1, w2) * wn; 
+            float b = fmac_attribs(t.c0[2], t.c1[2], t.c2[2], w0, w1, w2) * wn; 
+            float a = fmac_attribs(t.c0[3], t.c1[3], t.c2[3], w0, w1, w2) * wn; 
+            
+            out.WriteFragment(x, y, z, r, g, b, a);   
+        }
+        else
+        {
+            float t_x = fmac_attribs(t.tc0[0], t.tc1[0], t.tc2[0], w0, w1, w2) * wn;
+            float t_y = fmac_attribs(t.tc0[1], t.tc1[1], t.tc2[1], w0, w1, w2) * wn;
+            out.WriteTexFragment(x, y, z, t_x, t_y);   
+        }
+    } 
+}
+
+// Pixel coverage test of exact edge mode
+static inline bool pixelInside(const TriangleSetup &t, const float *line, int32_t x)
+{
+    float px = x + 0.5f;
+    float w0 = check_zero_edge(edgePoint(t.e0, line[0], px)); 
+    float w1 = check_zero_edge(edgePoint(t.e1, line[1], px)); 
+    float w2 = check_zero_edge(edgePoint(t.e2, line[2], px));
+    return ((w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) && !t.front_face) || 
+           ((w0 <= 0.f && w1 <= 0.f && w2 <= 0.f) && t.front_face);
+}
+
+// Send covered part of line as span, its pixels are evaluated by next stages
+void rasterizeLineSpan(const TriangleSetup &t, FragmentBuffer &out, uint32_t y, int32_t x0, int32_t x1, bool covered)
+{
+    float py = y + 0.5f;
+    float line[3] = {edgeLine(t.e0, py), edgeLine(t.e1, py), edgeLine(t.e2, py)};
+    
+    if (!covered)
+    {
+        // edge functions are monotonic along the line, so covered pixels form one run
+        while (x0 <= x1 && !pixelInside(t, line, x0))
+            x0++;
+        int32_t x = x0;
+        while (x <= x1 && pixelInside(t, line, x))
+            x++;
+        x1 = x - 1;
+    }
+    
+    if (x0 <= x1)
+        out.WriteSpan(t, x0, y, x1 - x0 + 1, line);
+}
+
+RasterizeLineFunc rasterize_line = rasterizeLineScalar;
+
+// Relative error bound of per pixel edge function (two FMA roundings) with margin
+const double TILE_EDGE_EPS = 1. / (1 << 21);
+
+enum TileCoverage { TILE_OUTSIDE, TILE_PARTIAL, TILE_INSIDE };
+
+// Conservative test of tile [x0,x1]x[y0,y1] against polygon edges. Edge functions are
+// linear, so their extremes are in corner pixel centers. Rounding error of per pixel
+// evaluation & check_zero_edge() threshold are taken into account, so tile is rejected
+// or accepted only if every pixel in it would be rejected or accepted by exact test.
+static TileCoverage classifyTile(const TriangleSetup &t, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+{
+    double px0 = x0 + 0.5, px1 = x1 + 0.5;
+    double py0 = y0 + 0.5, py1 = y1 + 0.5;
+    double sign = t.front_face ? -1. : 1.;  // pixel is inside if sign*E > -EDGE_ZERO_VAL for all edges
+    const EdgeCoefs *edges[3] = {&t.e0, &t.e1, &t.e2};
+    TileCoverage result = TILE_INSIDE;
+    
+    for (const EdgeCoefs *e : edges)
+    {
+        double c = sign * e->c, dx = sign * e->dx, dy = sign * e->dy;
+        double emax = c + std::max(px0 * dx, px1 * dx) + std::max(py0 * dy, py1 * dy);
+        double emin = c + std::min(px0 * dx, px1 * dx) + std::min(py0 * dy, py1 * dy);
+        double err = (fabs(c) + px1 * fabs(dx) + py1 * fabs(dy)) * TILE_EDGE_EPS;
+        
+        if (emax + err <= -EDGE_ZERO_VAL)
+            return TILE_OUTSIDE;
+        if (emin - err <= -EDGE_ZERO_VAL)
+            result = TILE_PARTIAL;
+    }
+    return result;
+}
+
+// Coarse depth buffer for early depth test, holds upper bound of fragment ops depth buffer
+// values per tile. Depth test passes on LESS OR EQUAL, so between clears depth buffer values
+// could only decrease & bound is lowered only when polygon surely writes depth to whole tile.
+struct HierZ
+{
+    bool enabled = false;
+    bool depth_test = false;        // FRAG_STATE depth test
+    bool depth_write = false;       // FRAG_STATE depth mask
+    int32_t width, height;
+    int32_t tiles_x;
+    std::vector<uint32_t> zmax;
+    
+    void Init(int32_t w, int32_t h)
+    {
+        enabled = true;
+        width = w;
+        height = h;
+        tiles_x = (w + tile_size - 1) / tile_size;
+        zmax.resize(tiles_x * ((h + tile_size - 1) / tile_size));
+        Clear();
+    }
+    
+    void Clear()
+    {
+        std::fill(zmax.begin(), zmax.end(), PIPELINE_MAX_Z);
+    }
+    
+    uint32_t &TileZmax(int32_t tx, int32_t ty)
+    {
+        return zmax[(ty / tile_size) * tiles_x + tx / tile_size];
+    }
+    
+    // Rectangle [x0,x1]x[y0,y1] is whole tile starting at tx,ty
+    bool WholeTile(int32_t tx, int32_t ty, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+    {
+        return (x0 == tx) && (y0 == ty) && (x1 == std::min(tx + tile_size, width) - 1) && (y1 == std::min(ty + tile_size, height) - 1);
+    }
+};
+
+HierZ hiz;
+
+// Conservative range of integer depth of polygon pixels in tile, returns false if some
+// pixels could be dropped for depth out of [0,1]. Depth is linear combination of edge
+// functions, so it is bounded the same way as edges in classifyTile().
+static bool tileDepthRange(const TriangleSetup &t, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t &zmin, uint32_t &zmax)
+{
+    double px0 = x0 + 0.5, px1 = x1 + 0.5;
+    double py0 = y0 + 0.5, py1 = y1 + 0.5;
+    const EdgeCoefs *edges[3] = {&t.e0, &t.e1, &t.e2};
+    const float z[3] = {t.v0[2], t.v1[2], t.v2[2]};
+    double c = 0, dx = 0, dy = 0, err = 0;
+    
+    for (int i = 0; i < 3; i++)
+    {
+        const EdgeCoefs *e = edges[i];
+        c += z[i] * (double)e->c;
+        dx += z[i] * (double)e->dx;
+        dy += z[i] * (double)e->dy;
+        // rounding of edge function & depth sum, zeroing of small edge values
+        err += fabs(z[i]) * ((fabs(e->c) + px1 * fabs(e->dx) + py1 * fabs(e->dy)) * 2 * TILE_EDGE_EPS + EDGE_ZERO_VAL);
+    }
+    
+    double emax = c + std::max(px0 * dx, px1 * dx) + std::max(py0 * dy, py1 * dy);
+    double emin = c + std::min(px0 * dx, px1 * dx) + std::min(py0 * dy, py1 * dy);
+    double lo = std::min(emin * t.area, emax * t.area);
+    double hi = std::max(emin * t.area, emax * t.area);
+    err = err * fabs(t.area) + (fabs(lo) + fabs(hi)) * TILE_EDGE_EPS;
+    lo -= err;
+    hi += err;
+    
+    // pixel depth is truncated after float multiplication, so leave a couple of units margin
+    zmin = (lo <= 0) ? 0 : (uint32_t)std::max(0., std::min((double)PIPELINE_MAX_Z, floor(lo * PIPELINE_MAX_Z) - 2));
+    zmax = (hi >= 1) ? PIPELINE_MAX_Z : (uint32_t)std::max(0., std::min((double)PIPELINE_MAX_Z, ceil(hi * PIPELINE_MAX_Z) + 2));
+    return (lo >= 0) && (hi <= 1);
 }
 
-float check_zero_edge(float w)
+// Two level traversal: whole tiles are rejected or accepted, only partial ones are tested per pixel
+static void rasterizeTiles(const TriangleSetup &t, FragmentBuffer &out, int32_t xmin, int32_t ymin, int32_t xmax, int32_t ymax)
 {
-    //const float ZERO_VAL = 0.0078125; // exp = 120
-    const float ZERO_VAL = 0.001953125; // exp = 118
-    return (fabs(w) < ZERO_VAL) ? 0. : w;
+    for (int32_t ty = ymin - ymin % tile_size; ty <= ymax; ty += tile_size)
+    {
+        int32_t y0 = std::max(ty, ymin);
+        int32_t y1 = std::min(ty + tile_size - 1, ymax);
+        for (int32_t tx = xmin - xmin % tile_size; tx <= xmax; tx += tile_size)
+        {
+            int32_t x0 = std::max(tx, xmin);
+            int32_t x1 = std::min(tx + tile_size - 1, xmax);
+            TileCoverage coverage = classifyTile(t, x0, y0, x1, y1);
+            if (coverage == TILE_OUTSIDE)
+                continue;
+            
+            if (hiz.enabled && hiz.depth_test)
+            {
+                uint32_t zmin, zmax;
+                bool in_range = tileDepthRange(t, x0, y0, x1, y1, zmin, zmax);
+                uint32_t &tile_zmax = hiz.TileZmax(tx, ty);
+                
+                // all fragments would fail depth test in fragment ops
+                if (zmin > tile_zmax)
+                    continue;
+                
+                // every pixel of tile gets fragment, which leaves depth not greater than its z
+                if (hiz.depth_write && in_range && coverage == TILE_INSIDE && hiz.WholeTile(tx, ty, x0, y0, x1, y1))
+                    tile_zmax = std::min(tile_zmax, zmax);
+            }
+            
+            for (int32_t y = y0; y <= y1; ++y)
+                rasterize_line(t, out, y, x0, x1, coverage == TILE_INSIDE);
+        }
+    }
 }
 
+// Polygon after setup with its bounding box on screen
+struct RasterPolygon
+{
+    TriangleSetup t;
+    int32_t xmin, ymin, xmax, ymax;
+    bool tiled;         // tile bounds are meaningless for broken polygons
+};
+
+// Rasterize part of polygon inside clip rectangle [cx0,cx1]x[cy0,cy1]
+static void rasterizePolygon(const RasterPolygon &p, FragmentBuffer &out, int32_t cx0, int32_t cy0, int32_t cx1, int32_t cy1)
+{
+    int32_t xmin = std::max(p.xmin, cx0);
+    int32_t ymin = std::max(p.ymin, cy0);
+    int32_t xmax = std::min(p.xmax, cx1);
+    int32_t ymax = std::min(p.ymax, cy1);
+    if (xmin > xmax || ymin > ymax)
+        return;
+    
+    if (p.tiled)
+        rasterizeTiles(p.t, out, xmin, ymin, xmax, ymax);
+    else
+        for (int32_t y = ymin; y <= ymax; ++y) 
+            rasterize_line(p.t, out, y, xmin, xmax, false);
+}
+
+// Max polygons collected before parallel rasterization starts
+const size_t RAST_BATCH_POLYGONS = 4096;
+// Default size of screen regions polygons are binned into
+const int32_t RAST_BIN_SIZE = 32;
+
+// Sort-middle parallel rasterization. Polygons are collected into batch & binned into
+// screen regions, every region belongs to one worker. Workers rasterize polygons of their
+// regions in input order, so fragments of every pixel keep primitive order. Worker buffers
+// are written to output one after another when whole batch is done.
+class RasterizerPool
+{
+    int workers;
+    int32_t bin_size;
+    int32_t bins_x, bins_y;
+    std::vector<RasterPolygon> batch;
+    std::vector<std::vector<uint32_t>> bins;    // batch indexes of polygons touching region
+    std::vector<FragmentBuffer> out;            // per worker
+    std::vector<std::thread> threads;
+    
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+    uint64_t generation = 0;    // incremented for every batch
+    int busy = 0;               // threads still working on batch
+    
+    void Rasterize(int worker)
+    {
+        for (int32_t by = 0; by < bins_y; by++)
+            for (int32_t bx = 0; bx < bins_x; bx++)
+            {
+                // diagonal interleaving spreads neighbour regions over different workers
+                if ((bx + by) % workers != worker)
+                    continue;
+                int32_t x0 = bx * bin_size;
+                int32_t y0 = by * bin_size;
+                for (uint32_t i : bins[by * bins_x + bx])
+                    rasterizePolygon(batch[i], out[worker], x0, y0, x0 + bin_size - 1, y0 + bin_size - 1);
+            }
+    }
+    
+    void WorkerThread(int worker)
+    {
+        uint64_t done = 0;
+        while (1)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&] { return generation != done; });
+                done = generation;
+            }
+            Rasterize(worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy == 0)
+                    done_cv.notify_one();
+            }
+        }
+    }
+    
+    public:
+    RasterizerPool(int workers, int32_t bin_size, int32_t width, int32_t height) : 
+        workers(workers), bin_size(bin_size), out(workers)
+    {
+        bins_x = (width + bin_size - 1) / bin_size;
+        bins_y = (height + bin_size - 1) / bin_size;
+        bins.resize(bins_x * bins_y);
+        
+        // calling thread works as worker 0
+        for (int i = 1; i < workers; i++)
+            threads.emplace_back(&RasterizerPool::WorkerThread, this, i);
+    }
+    
+    void Add(const RasterPolygon &p)
+    {
+        uint32_t index = batch.size();
+        batch.push_back(p);
+        for (int32_t by = p.ymin / bin_size; by <= p.ymax / bin_size; by++)
+            for (int32_t bx = p.xmin / bin_size; bx <= p.xmax / bin_size; bx++)
+                bins[by * bins_x + bx].push_back(index);
+    }
+    
+    bool Empty() const
+    {
+        return batch.empty();
+    }
+    
+    bool Full() const
+    {
+        return batch.size() >= RAST_BATCH_POLYGONS;
+    }
+    
+    // Rasterize collected polygons & write fragments to FIFO
+    void Flush(IoFifo *fifo)
+    {
+        if (batch.empty())
+            return;
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+            busy = workers - 1;
+        }
+        start_cv.notify_all();
+        Rasterize(0);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [&] { return busy == 0; });
+        }
+        
+        for (FragmentBuffer &o : out)
+            o.WriteTo(fifo);
+        batch.clear();
+        for (auto &b : bins)
+            b.clear();
+    }
+};
+
+RasterizerPool *rast_pool = nullptr;    // used only if rasterizer has several threads
+
 // Single polygon rasterization
 int polygon_cnt = 0;
 extern "C"
@@ -171,71 +555,44 @@ int rasterize(float* polygon, u_int32_t* fragments, int SCREEN_WIDTH, int SCREEN
     Vec2 tc1 = {texcoord[2]*v1[3], texcoord[3]*v1[3]}; 
     Vec2 tc2 = {texcoord[4]*v2[3], texcoord[5]*v2[3]}; 
     
-    for (uint32_t y = ymin; y <= ymax; ++y) 
-    { 
-        for (uint32_t x = xmin; x <= xmax; ++x) 
-        { 
-            verbose("Checking point x = %d (%d, %d), y = %d (%d, %d)\n", x, xmin, xmax, y, ymin, ymax); 
-            Vec4 p = {x + 0.5f, y + 0.5f, 0, 0}; 
-            float w0 = check_zero_edge(edgeFunction(v1, v2, p)); 
-            float w1 = check_zero_edge(edgeFunction(v2, v0, p)); 
-            float w2 = check_zero_edge(edgeFunction(v0, v1, p));
-
-            verbose("area = %f, front_face = %d, w0 = %f, w1 = %f, w2 = %f\n", area, front_face, w0, w1, w2);
-            if (((w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) && !front_face) ||
-               ((w0 <= 0.f && w1 <= 0.f && w2 <= 0.f) && front_face))
-            {
-                float fz = (v0[2] * w0 + v1[2] * w1 + v2[2] * w2) * area;
-                
-                if (fz < 0 || fz > 1)
-                    continue;
-                    
-                uint32_t z = (uint32_t)(fz * PIPELINE_MAX_Z) & PIPELINE_MAX_Z;
-                    
-                // calculate pixel attributes
-                float wn = 1. / fmac_attribs(v0[3], v1[3], v2[3], w0, w1, w2);
-                    
-                if (!do_texture)
-                {
-                    float r = fmac_attribs(c0[0], c1[0], c2[0], w0, w1, w2) * wn; 
-                    float g = fmac_attribs(c0[1], c1[1], c2[1], w0, w1, w2) * wn; 
-                    float b = fmac_attribs(c0[2], c1[2], c2[2], w0, w1, w2) * wn; 
-                    float a = fmac_attribs(c0[3], c1[3], c2[3], w0, w1, w2) * wn; 
-                    
-                    iofifo->WriteFragment(x, y, z, r, g, b, a);   
-                }
-                else
-                {
-                    float t_x = fmac_attribs(tc0[0], tc1[0], tc2[0], w0, w1, w2) * wn;
-                    float t_y = fmac_attribs(tc0[1], tc1[1], tc2[1], w0, w1, w2) * wn;
-                    iofifo->WriteTexFragment(x, y, z, t_x, t_y);   
-                }
-                
-                #if 0
-                #if BUILD_BINARY
-                iofifo->WriteFragment(x, y, z, r, g, b);   
-                #else
-                fragments[fragments_amount*5] = GPU_PIPE_CMD_FRAGMENT;
-                fragments[fragments_amount*5 + 1] = x;
-                fragments[fragments_amount*5 + 2] = y;
-                fragments[fragments_amount*5 + 3] = z;
-                fragments[fragments_amount*5 + 4] = ((u_int32_t)(r * 255) << 16) | ((u_int32_t)(g * 255) << 8) | (u_int32_t)(b * 255);
-                fragments_amount++;
-                #endif
-                #endif
-            } 
-        } 
-    }
+    // Triangle setup: coefficients depending on vertices only
+    TriangleSetup t;
+    CopyV4(t.v0, v0);
+    CopyV4(t.v1, v1);
+    CopyV4(t.v2, v2);
+    CopyV4(t.c0, c0);
+    CopyV4(t.c1, c1);
+    CopyV4(t.c2, c2);
+    CopyV2(t.tc0, tc0);
+    CopyV2(t.tc1, tc1);
+    CopyV2(t.tc2, tc2);
+    t.e0 = edgeSetup(v1, v2);
+    t.e1 = edgeSetup(v2, v0);
+    t.e2 = edgeSetup(v0, v1);
+    t.area = area;
+    t.front_face = front_face;
+    t.do_texture = do_texture;
+    
+    bool finite = true;
+    for (const EdgeCoefs &e : {t.e0, t.e1, t.e2})
+        finite = finite && std::isfinite(e.c) && std::isfinite(e.dx) && std::isfinite(e.dy);
+    RasterPolygon p = {t, xmin, ymin, xmax, ymax, tile_size && finite};
     
-    iofifo->Flush();
+    if (rast_pool)
+        rast_pool->Add(p);
+    else
+    {
+        FragmentBuffer out(iofifo);
+        rasterizePolygon(p, out, 0, 0, SCREEN_WIDTH-1, SCREEN_HEIGHT-1);
+    }
     
     return fragments_amount;
 } 
 
 #if BUILD_BINARY
-int main(int argc, char **argv) 
+STAGE_MAIN(int argc, char **argv)
 {
-    if (argc != 5)
+    if (argc < 5)
     {
         puts("Wrong parameters!");
         return 1;
@@ -245,10 +602,63 @@ int main(int argc, char **argv)
     const uint32_t SCREEN_HEIGHT    = atoi(argv[2]);
         
     // Open output FIFO
-    iofifo = new IoFifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    iofifo = new IoFifo(argv[3], argv[4], options);
+    
+    // edge=exact evaluates edge functions for every pixel like HDL, edge=incremental steps them along the line
+    edge_incremental = (options.Get("edge", "exact") == "incremental");
+    
+    // tile=N sets size of NxN tiles, tile=0 disables tiled traversal
+    tile_size = std::max(0L, options.GetInt("tile", tile_size));
+    
+    // SIMD kernel evaluates edges exactly, so it is used only in exact mode
+    SimdLevel simd = SimdSelect(options);
+    #if SIMD_X86
+    if (simd == SIMD_AVX2 && !edge_incremental)
+        rasterize_line = rasterizeLineAvx2;
+    #endif
+    
+    // spans=1 sends runs of covered pixels instead of fragments, next stages evaluate them like exact mode
+    if (options.GetInt("spans", 0))
+    {
+        if (edge_incremental)
+            std::cerr << "Spans are not supported in incremental edge mode" << std::endl;
+        else
+            rasterize_line = rasterizeLineSpan;
+    }
+    verbose("Rasterizer line kernel: %s\n", (rasterize_line == rasterizeLineScalar) ? "scalar" : 
+        (rasterize_line == rasterizeLineSpan) ? "spans" : SimdName(simd));
+    
+    // threads=N rasterizes with N threads (0 - one per CPU), bin=N sets size of their screen regions
+    long threads = options.GetInt("threads", 1);
+    if (threads <= 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    if (threads > 1)
+    {
+        // regions are made of whole tiles
+        int32_t bin_size = std::max(1L, options.GetInt("bin", RAST_BIN_SIZE));
+        if (tile_size)
+            bin_size = (bin_size + tile_size - 1) / tile_size * tile_size;
+        rast_pool = new RasterizerPool(threads, bin_size, SCREEN_WIDTH, SCREEN_HEIGHT);
+        verbose("Rasterizer threads: %ld, bin size %d\n", threads, bin_size);
+    }
+    
+    // early_z=1 drops tiles of polygons hidden according to coarse depth buffer
+    if (options.GetInt("early_z", 0))
+    {
+        if (tile_size)
+            hiz.Init(SCREEN_WIDTH, SCREEN_HEIGHT);
+        else
+            std::cerr << "Early depth test requires tiled traversal" << std::endl;
+    }
+    
     int first = 1;
     while (1)
     {
+        // don't keep collected polygons while waiting for input
+        if (rast_pool && !rast_pool->Empty() && !iofifo->InputReady())
+            rast_pool->Flush(iofifo);
+        
         bool do_texture = false;
         uint32_t cmd = iofifo->ReadFromFifo32();
         switch (cmd)
@@ -258,16 +668,40 @@ int main(int argc, char **argv)
             case (GPU_PIPE_CMD_POLY_VERTEX4):
             {
                 rasterize(nullptr, nullptr, SCREEN_WIDTH, SCREEN_HEIGHT, do_texture); 
+                if (rast_pool && rast_pool->Full())
+                    rast_pool->Flush(iofifo);
+                iofifo->CommandDone(cmd);
                 polygon_cnt++;
                 break;
             }
             case (GPU_PIPE_CMD_RAST_STATE):
             {
+                // culling is done on polygon setup, so collected polygons are not affected
                 uint32_t state_word = iofifo->ReadFromFifo32();
                 draw_front = state_word & GPU_STATE_RAST_CULLBACK;
                 draw_back = state_word & GPU_STATE_RAST_CULLFRONT;
                 break;
             }
+            case (GPU_PIPE_CMD_FRAG_STATE):
+            {
+                // depth state is tracked for early depth test & passed on to fragment ops
+                if (rast_pool)
+                    rast_pool->Flush(iofifo);
+                uint32_t state_word = iofifo->ReadFromFifo32();
+                hiz.depth_test = state_word & GPU_STATE_FRAG_DEPTH;
+                hiz.depth_write = state_word & GPU_STATE_FRAG_DEPTHMASK;
+                iofifo->WriteToFifo32(cmd);
+                iofifo->WriteToFifo32(state_word);
+                break;
+            }
+            case (GPU_PIPE_CMD_CLEAR_ZB):
+            {
+                if (rast_pool)
+                    rast_pool->Flush(iofifo);
+                hiz.Clear();
+                iofifo->BypassCmd(cmd);
+                break;
+            }
             //case (GPU_PIPE_CMD_SYNC):
                 //if (first)
                     //first = 0;
@@ -277,6 +711,8 @@ int main(int argc, char **argv)
             {
                 // just pass to next stage everything but polygon vertices
                 assert((cmd & 0xFFFF0000) == 0xFFFF0000);
+                if (rast_pool)
+                    rast_pool->Flush(iofifo);
                 iofifo->BypassCmd(cmd);
                 break;
             }
@@ -0,0 +1,150 @@
+#ifndef _RAST_HH
+#define _RAST_HH
+
+#include <cmath>
+#include <vector>
+
+#include <gpu_pipeline.hh>
+#include <fragment_span.hh>
+#include <simd.hh>
+
+extern IoFifo *iofifo;
+
+// Edge function coefficients, same split as cached values in rast_edge_mac.vhd
+struct EdgeCoefs
+{
+    float c;    // V0.y*V1.x-V0.x*V1.y (cached0)
+    float dy;   // V0.x-V1.x (cached1)
+    float dx;   // V1.y-V0.y (cached2)
+};
+
+// Per polygon part of edge function
+static inline EdgeCoefs edgeSetup(const Vec4 &a, const Vec4 &b)
+{
+    // uses FMACs to get same precision
+    return {fmaf(-a[0], b[1], (a[1] * b[0])), (a[0] - b[0]), (b[1] - a[1])};
+}
+
+// Per line part of edge function (cached3)
+static inline float edgeLine(const EdgeCoefs &e, float y)
+{
+    return fmaf(y, e.dy, e.c);
+}
+
+// Edge function in point of line
+static inline float edgePoint(const EdgeCoefs &e, float line, float x)
+{
+    return fmaf(x, e.dx, line);
+}
+
+// Polygon data prepared once for all its lines
+struct TriangleSetup
+{
+    Vec4 v0, v1, v2;
+    Vec4 c0, c1, c2;        // colors divided by w
+    Vec2 tc0, tc1, tc2;     // texcoords divided by w
+    EdgeCoefs e0, e1, e2;
+    float area;             // reciprocal
+    bool front_face;
+    bool do_texture;
+};
+
+// Fragments produced by one rasterizer thread, passed to output FIFO in one piece
+// or written straight to FIFO if buffering isn't needed
+class FragmentBuffer
+{
+    IoFifo *direct;
+    std::vector<uint32_t> words;
+    const TriangleSetup *span_setup = nullptr;  // polygon with setup already in buffer
+    
+    void WriteWords(const uint32_t *x, size_t n)
+    {
+        if (direct)
+            direct->WriteWords(x, n);
+        else
+            words.insert(words.end(), x, x + n);
+    }
+    
+    void WriteSpanSetup(const TriangleSetup &t)
+    {
+        const Vec4 *v[3] = {&t.v0, &t.v1, &t.v2};
+        const EdgeCoefs *e[3] = {&t.e0, &t.e1, &t.e2};
+        float args[SPAN_SETUP_ARGS];
+        int n = 0;
+        for (int i = 0; i < 3; i++)
+            args[n++] = e[i]->dx;
+        for (int i = 0; i < 3; i++)
+            args[n++] = (*v[i])[2];
+        for (int i = 0; i < 3; i++)
+            args[n++] = (*v[i])[3];
+        args[n++] = t.area;
+        if (t.do_texture)
+        {
+            for (const Vec2 *tc : {&t.tc0, &t.tc1, &t.tc2})
+                for (int i = 0; i < 2; i++)
+                    args[n++] = (*tc)[i];
+            for (int i = 0; i < 3; i++)
+                args[n++] = e[i]->dy;
+        }
+        else
+            for (const Vec4 *c : {&t.c0, &t.c1, &t.c2})
+                for (int i = 0; i < 4; i++)
+                    args[n++] = (*c)[i];
+        
+        uint32_t cmd = t.do_texture ? GPU_PIPE_CMD_TEXSPAN_SETUP : GPU_PIPE_CMD_SPAN_SETUP;
+        WriteWords(&cmd, 1);
+        WriteWords((uint32_t*)args, n);
+    }
+    
+    public:
+    FragmentBuffer(IoFifo *direct = nullptr) : direct(direct) {}
+    
+    void WriteFragment(const uint32_t x, const uint32_t y, const uint32_t z, const float r, const float g, const float b, const float a)
+    {
+        if (direct)
+            return direct->WriteFragment(x, y, z, r, g, b, a);
+        const uint32_t fragment[] = {GPU_PIPE_CMD_FRAGMENT, (y << 16) | x, z, ArgbToU32(a, r, g, b)};
+        WriteWords(fragment, 4);
+    }
+    
+    void WriteTexFragment(const uint32_t x, const uint32_t y, const uint32_t z, const float t_x, const float t_y)
+    {
+        if (direct)
+            return direct->WriteTexFragment(x, y, z, t_x, t_y);
+        uint32_t fragment[] = {GPU_PIPE_CMD_TEXFRAGMENT, (y << 16) | x, z, 0, 0};
+        memcpy(&fragment[3], &t_x, sizeof(float));
+        memcpy(&fragment[4], &t_y, sizeof(float));
+        WriteWords(fragment, 5);
+    }
+    
+    // Span of polygon t, setup is sent before first span of polygon
+    void WriteSpan(const TriangleSetup &t, const uint32_t x, const uint32_t y, const uint32_t length, const float *line)
+    {
+        if (span_setup != &t)
+        {
+            WriteSpanSetup(t);
+            span_setup = &t;
+        }
+        uint32_t span[] = {GPU_PIPE_CMD_SPAN, (y << 16) | x, length, 0, 0, 0};
+        memcpy(&span[3], line, 3 * sizeof(float));
+        WriteWords(span, 6);
+    }
+    
+    void WriteTo(IoFifo *fifo)
+    {
+        if (!words.empty())
+            fifo->WriteWords(words.data(), words.size());
+        words.clear();
+        span_setup = nullptr;
+    }
+};
+
+// Rasterize span [x0, x1] of line y, covered = span is known to be inside polygon
+typedef void (*RasterizeLineFunc)(const TriangleSetup &t, FragmentBuffer &out, uint32_t y, int32_t x0, int32_t x1, bool covered);
+
+// SIMD line kernels, produce same fragments in same order as scalar version
+#if SIMD_X86
+void rasterizeLineAvx2(const TriangleSetup &t, FragmentBuffer &out, uint32_t y, int32_t x0, int32_t x1, bool covered);
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+#include <cstdint>
+#include <algorithm>
+
+#include "rast.hh"
+
+#if SIMD_X86
+#include <immintrin.h>
+
+// AVX2 rasterization kernel: edge functions, coverage, depth & attribute
+// interpolation for 8 pixels of a line at once. Every lane performs exactly
+// the same float operations as rasterizeLineScalar() in exact edge mode.
+
+const int AVX2_LANES = 8;
+
+SIMD_TARGET_AVX2
+static inline __m256 checkZeroEdge8(__m256 w)
+{
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 is_zero = _mm256_cmp_ps(_mm256_and_ps(w, abs_mask), _mm256_set1_ps(EDGE_ZERO_VAL), _CMP_LT_OQ);
+    return _mm256_andnot_ps(is_zero, w);
+}
+
+SIMD_TARGET_AVX2
+static inline __m256 fmacAttribs8(float v0, float v1, float v2, __m256 w0, __m256 w1, __m256 w2)
+{
+    return _mm256_fmadd_ps(w2, _mm256_set1_ps(v2), _mm256_fmadd_ps(w1, _mm256_set1_ps(v1), _mm256_mul_ps(w0, _mm256_set1_ps(v0))));
+}
+
+SIMD_TARGET_AVX2
+void rasterizeLineAvx2(const TriangleSetup &t, FragmentBuffer &out, uint32_t y, int32_t x0, int32_t x1, bool covered)
+{
+    // line part of edge functions
+    float py = y + 0.5f;
+    const __m256 l0 = _mm256_set1_ps(edgeLine(t.e0, py));
+    const __m256 l1 = _mm256_set1_ps(edgeLine(t.e1, py));
+    const __m256 l2 = _mm256_set1_ps(edgeLine(t.e2, py));
+    const __m256 dx0 = _mm256_set1_ps(t.e0.dx);
+    const __m256 dx1 = _mm256_set1_ps(t.e1.dx);
+    const __m256 dx2 = _mm256_set1_ps(t.e2.dx);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lane_center = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    bool line_inside = false;
+
+    for (int32_t x = x0; x <= x1; x += AVX2_LANES)
+    {
+        __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lane_center);
+        __m256 w0 = checkZeroEdge8(_mm256_fmadd_ps(px, dx0, l0));
+        __m256 w1 = checkZeroEdge8(_mm256_fmadd_ps(px, dx1, l1));
+        __m256 w2 = checkZeroEdge8(_mm256_fmadd_ps(px, dx2, l2));
+
+        // coverage
+        __m256 inside;
+        if (covered)
+            inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        else if (t.front_face)
+            inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_LE_OQ), _mm256_cmp_ps(w1, zero, _CMP_LE_OQ)), _mm256_cmp_ps(w2, zero, _CMP_LE_OQ));
+        else
+            inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GE_OQ), _mm256_cmp_ps(w1, zero, _CMP_GE_OQ)), _mm256_cmp_ps(w2, zero, _CMP_GE_OQ));
+        int lanes = std::min(AVX2_LANES, x1 - x + 1);
+        int mask = _mm256_movemask_ps(inside) & ((1 << lanes) - 1);
+        if (!mask)
+        {
+            // edge functions are monotonic along the line, so it can't enter triangle again
+            if (line_inside)
+                break;
+            continue;
+        }
+        line_inside = true;
+
+        // depth
+        __m256 fz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t.v0[2]), w0), _mm256_mul_ps(_mm256_set1_ps(t.v1[2]), w1)), _mm256_mul_ps(_mm256_set1_ps(t.v2[2]), w2));
+        fz = _mm256_mul_ps(fz, _mm256_set1_ps(t.area));
+        __m256 fz_out = _mm256_or_ps(_mm256_cmp_ps(fz, zero, _CMP_LT_OQ), _mm256_cmp_ps(fz, _mm256_set1_ps(1.f), _CMP_GT_OQ));
+        mask &= ~_mm256_movemask_ps(fz_out);
+        if (!mask)
+            continue;
+
+        alignas(32) uint32_t z[AVX2_LANES];
+        __m256i zi = _mm256_cvttps_epi32(_mm256_mul_ps(fz, _mm256_set1_ps(PIPELINE_MAX_Z)));
+        _mm256_store_si256((__m256i*)z, _mm256_and_si256(zi, _mm256_set1_epi32(PIPELINE_MAX_Z)));
+
+        // attributes (1/w division is correctly rounded like double division in scalar code)
+        __m256 wn = _mm256_div_ps(_mm256_set1_ps(1.f), fmacAttribs8(t.v0[3], t.v1[3], t.v2[3], w0, w1, w2));
+
+        if (!t.do_texture)
+        {
+            alignas(32) float c[4][AVX2_LANES];
+            for (int i = 0; i < 4; i++)
+                _mm256_store_ps(c[i], _mm256_mul_ps(fmacAttribs8(t.c0[i], t.c1[i], t.c2[i], w0, w1, w2), wn));
+
+            for (int i = 0; i < lanes; i++)
+                if (mask & (1 << i))
+                    out.WriteFragment(x + i, y, z[i], c[0][i], c[1][i], c[2][i], c[3][i]);
+        }
+        else
+        {
+            alignas(32) float tc[2][AVX2_LANES];
+            for (int i = 0; i < 2; i++)
+                _mm256_store_ps(tc[i], _mm256_mul_ps(fmacAttribs8(t.tc0[i], t.tc1[i], t.tc2[i], w0, w1, w2), wn));
+
+            for (int i = 0; i < lanes; i++)
+                if (mask & (1 << i))
+                    out.WriteTexFragment(x + i, y, z[i], tc[0][i], tc[1][i]);
+        }
+    }
+}
+
+#endif
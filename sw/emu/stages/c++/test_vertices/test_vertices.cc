@@ -77,16 +77,17 @@ void normal_calculation(const float *vectors, Vec3 &normal_out)
 }
 
 
-int main(int argc, char **argv) 
+STAGE_MAIN(int argc, char **argv)
 {
-    if (argc != 5)
+    if (argc < 5)
     {
         puts("Wrong parameters!");
         return 1;
     }
 
     // Open output FIFO
-    IoFifo iofifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    IoFifo iofifo(argv[3], argv[4], options);
    
     float w_vertices[3*3];
 	float w_colors[3*4];
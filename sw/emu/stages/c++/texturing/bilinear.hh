@@ -0,0 +1,116 @@
+#ifndef _BILINEAR_HH
+#define _BILINEAR_HH
+
+#include <cstdint>
+#include <cmath>
+
+#include <simd.hh>
+
+// Fixed point bilinear filtering of RGBA8 texels. Sample position in texels is
+// converted to 8.8 fixed point, integer part gives top-left texel of 2x2 footprint
+// & fractional part gives 8 bit weights. Wrap mode is REPEAT, footprint wraps
+// around texture edges (sizes don't have to be powers of 2).
+//
+// Filtering is split in two kernels around texel fetch, which is done by stage as
+// it depends on texture layout & cache model:
+//  - setup: texcoords to wrapped texel coords & weights of every sample;
+//  - lerp: horizontal then vertical lerp of 16 bit channels, both rounded.
+// Every channel is (c0 * (256 - f) + c1 * f + 128) >> 8, so results fit 16 bit
+// lanes & SIMD kernels give the same results as scalar ones.
+
+const uint32_t BILINEAR_BATCH_SIZE = 128;
+
+struct BilinearBatch
+{
+    // input: texcoords & size of mipmap level of every sample
+    float s[BILINEAR_BATCH_SIZE];
+    float t[BILINEAR_BATCH_SIZE];
+    int32_t w[BILINEAR_BATCH_SIZE];
+    int32_t h[BILINEAR_BATCH_SIZE];
+    // setup: texel coords of footprint & weights of right/bottom texels
+    int32_t x0[BILINEAR_BATCH_SIZE];
+    int32_t x1[BILINEAR_BATCH_SIZE];
+    int32_t y0[BILINEAR_BATCH_SIZE];
+    int32_t y1[BILINEAR_BATCH_SIZE];
+    uint32_t fu[BILINEAR_BATCH_SIZE];
+    uint32_t fv[BILINEAR_BATCH_SIZE];
+    // fetched texels (x0,y0), (x1,y0), (x0,y1), (x1,y1) & filtered colors
+    uint32_t texels[4][BILINEAR_BATCH_SIZE];
+    uint32_t colors[BILINEAR_BATCH_SIZE];
+};
+
+typedef void (*BilinearKernel)(BilinearBatch &b, uint32_t n);
+
+// Wrapped footprint of one axis for texcoord c of texture side size
+static inline void BilinearAxis(float c, int32_t size, int32_t &i0, int32_t &i1, uint32_t &f)
+{
+    float wrapped = c - floorf(c);
+    uint32_t u = (uint32_t)(int32_t)(wrapped * (float)(size << 8)) - 128;
+    int32_t i = (int32_t)u >> 8;
+    f = u & 0xFF;
+    // i is -1 left of first texel center, NaN texcoords give anything
+    bool outside = (i < 0) || (i >= size);
+    i0 = outside ? size - 1 : i;
+    i1 = (outside || i + 1 == size) ? 0 : i + 1;
+}
+
+static inline void BilinearSetupScalar(BilinearBatch &b, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        BilinearAxis(b.s[i], b.w[i], b.x0[i], b.x1[i], b.fu[i]);
+        BilinearAxis(b.t[i], b.h[i], b.y0[i], b.y1[i], b.fv[i]);
+    }
+}
+
+// Lerp of two channels with 8 bit weight f of c1
+static inline uint32_t BilinearLerp(uint32_t c0, uint32_t c1, uint32_t f)
+{
+    return (c0 * (256 - f) + c1 * f + 128) >> 8;
+}
+
+// Lerp of all channels of two RGBA8 colors
+static inline uint32_t BilinearLerpColor(uint32_t c0, uint32_t c1, uint32_t f)
+{
+    uint32_t res = 0;
+    for (int i = 0; i < 32; i += 8)
+        res |= BilinearLerp((c0 >> i) & 0xFF, (c1 >> i) & 0xFF, f) << i;
+    return res;
+}
+
+static inline void BilinearLerpScalar(BilinearBatch &b, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t top = BilinearLerpColor(b.texels[0][i], b.texels[1][i], b.fu[i]);
+        uint32_t bottom = BilinearLerpColor(b.texels[2][i], b.texels[3][i], b.fu[i]);
+        b.colors[i] = BilinearLerpColor(top, bottom, b.fv[i]);
+    }
+}
+
+#if SIMD_X86
+void BilinearSetupSse41(BilinearBatch &b, uint32_t n);
+void BilinearLerpSse41(BilinearBatch &b, uint32_t n);
+void BilinearSetupAvx2(BilinearBatch &b, uint32_t n);
+void BilinearLerpAvx2(BilinearBatch &b, uint32_t n);
+#endif
+
+static inline void SelectBilinearKernels(SimdLevel simd, BilinearKernel &setup, BilinearKernel &lerp)
+{
+    setup = BilinearSetupScalar;
+    lerp = BilinearLerpScalar;
+    #if SIMD_X86
+    if (simd == SIMD_AVX2)
+    {
+        setup = BilinearSetupAvx2;
+        lerp = BilinearLerpAvx2;
+    }
+    else if (simd == SIMD_SSE41)
+    {
+        setup = BilinearSetupSse41;
+        lerp = BilinearLerpSse41;
+    }
+    #endif
+}
+
+#endif
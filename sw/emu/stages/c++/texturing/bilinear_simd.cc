@@ -0,0 +1,175 @@
+#include <cstdint>
+
+#include "bilinear.hh"
+
+#if SIMD_X86
+#include <immintrin.h>
+
+// SSE4.1 & AVX2 bilinear kernels, 4 & 8 samples per iteration. Tails are
+// processed with scalar code, which produces the same results. AVX2 kernels
+// don't call SSE ones to avoid AVX-SSE transition penalties.
+
+SIMD_TARGET_SSE41
+static inline void bilinearAxis4(const float *c, const int32_t *size, int32_t *i0, int32_t *i1, uint32_t *f)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128 v = _mm_loadu_ps(c);
+    __m128i sz = _mm_loadu_si128((const __m128i*)size);
+    __m128 wrapped = _mm_sub_ps(v, _mm_floor_ps(v));
+    __m128i u = _mm_sub_epi32(_mm_cvttps_epi32(_mm_mul_ps(wrapped, _mm_cvtepi32_ps(_mm_slli_epi32(sz, 8)))), _mm_set1_epi32(128));
+    __m128i i = _mm_srai_epi32(u, 8);
+    __m128i next = _mm_add_epi32(i, _mm_set1_epi32(1));
+    __m128i last = _mm_sub_epi32(sz, _mm_set1_epi32(1));
+    __m128i outside = _mm_or_si128(_mm_cmplt_epi32(i, zero), _mm_cmpgt_epi32(i, last));
+    __m128i wrap = _mm_or_si128(outside, _mm_cmpeq_epi32(next, sz));
+    _mm_storeu_si128((__m128i*)i0, _mm_blendv_epi8(i, last, outside));
+    _mm_storeu_si128((__m128i*)i1, _mm_andnot_si128(wrap, next));
+    _mm_storeu_si128((__m128i*)f, _mm_and_si128(u, _mm_set1_epi32(0xFF)));
+}
+
+SIMD_TARGET_SSE41
+void BilinearSetupSse41(BilinearBatch &b, uint32_t n)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        bilinearAxis4(b.s + i, b.w + i, b.x0 + i, b.x1 + i, b.fu + i);
+        bilinearAxis4(b.t + i, b.h + i, b.y0 + i, b.y1 + i, b.fv + i);
+    }
+    for (; i < n; i++)
+    {
+        BilinearAxis(b.s[i], b.w[i], b.x0[i], b.x1[i], b.fu[i]);
+        BilinearAxis(b.t[i], b.h[i], b.y0[i], b.y1[i], b.fv[i]);
+    }
+}
+
+// 16 bit weights of pixel pairs (0, 1) & (2, 3) broadcast to their channels
+SIMD_TARGET_SSE41
+static inline void weights4(const uint32_t *f, __m128i &lo, __m128i &hi)
+{
+    __m128i w = _mm_loadu_si128((const __m128i*)f);
+    w = _mm_packs_epi32(w, w);
+    w = _mm_unpacklo_epi16(w, w);
+    lo = _mm_unpacklo_epi32(w, w);
+    hi = _mm_unpackhi_epi32(w, w);
+}
+
+SIMD_TARGET_SSE41
+static inline __m128i lerp4(__m128i c0, __m128i c1, __m128i f)
+{
+    __m128i f0 = _mm_sub_epi16(_mm_set1_epi16(256), f);
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(c0, f0), _mm_mullo_epi16(c1, f));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+SIMD_TARGET_SSE41
+void BilinearLerpSse41(BilinearBatch &b, uint32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i fu_lo, fu_hi, fv_lo, fv_hi;
+        weights4(b.fu + i, fu_lo, fu_hi);
+        weights4(b.fv + i, fv_lo, fv_hi);
+        __m128i t[4];
+        for (int k = 0; k < 4; k++)
+            t[k] = _mm_loadu_si128((const __m128i*)(b.texels[k] + i));
+        __m128i top_lo = lerp4(_mm_unpacklo_epi8(t[0], zero), _mm_unpacklo_epi8(t[1], zero), fu_lo);
+        __m128i top_hi = lerp4(_mm_unpackhi_epi8(t[0], zero), _mm_unpackhi_epi8(t[1], zero), fu_hi);
+        __m128i bot_lo = lerp4(_mm_unpacklo_epi8(t[2], zero), _mm_unpacklo_epi8(t[3], zero), fu_lo);
+        __m128i bot_hi = lerp4(_mm_unpackhi_epi8(t[2], zero), _mm_unpackhi_epi8(t[3], zero), fu_hi);
+        __m128i lo = lerp4(top_lo, bot_lo, fv_lo);
+        __m128i hi = lerp4(top_hi, bot_hi, fv_hi);
+        _mm_storeu_si128((__m128i*)(b.colors + i), _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; i++)
+    {
+        uint32_t top = BilinearLerpColor(b.texels[0][i], b.texels[1][i], b.fu[i]);
+        uint32_t bottom = BilinearLerpColor(b.texels[2][i], b.texels[3][i], b.fu[i]);
+        b.colors[i] = BilinearLerpColor(top, bottom, b.fv[i]);
+    }
+}
+
+SIMD_TARGET_AVX2
+static inline void bilinearAxis8(const float *c, const int32_t *size, int32_t *i0, int32_t *i1, uint32_t *f)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256 v = _mm256_loadu_ps(c);
+    __m256i sz = _mm256_loadu_si256((const __m256i*)size);
+    __m256 wrapped = _mm256_sub_ps(v, _mm256_floor_ps(v));
+    __m256i u = _mm256_sub_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(wrapped, _mm256_cvtepi32_ps(_mm256_slli_epi32(sz, 8)))), _mm256_set1_epi32(128));
+    __m256i i = _mm256_srai_epi32(u, 8);
+    __m256i next = _mm256_add_epi32(i, _mm256_set1_epi32(1));
+    __m256i last = _mm256_sub_epi32(sz, _mm256_set1_epi32(1));
+    __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(zero, i), _mm256_cmpgt_epi32(i, last));
+    __m256i wrap = _mm256_or_si256(outside, _mm256_cmpeq_epi32(next, sz));
+    _mm256_storeu_si256((__m256i*)i0, _mm256_blendv_epi8(i, last, outside));
+    _mm256_storeu_si256((__m256i*)i1, _mm256_andnot_si256(wrap, next));
+    _mm256_storeu_si256((__m256i*)f, _mm256_and_si256(u, _mm256_set1_epi32(0xFF)));
+}
+
+SIMD_TARGET_AVX2
+void BilinearSetupAvx2(BilinearBatch &b, uint32_t n)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        bilinearAxis8(b.s + i, b.w + i, b.x0 + i, b.x1 + i, b.fu + i);
+        bilinearAxis8(b.t + i, b.h + i, b.y0 + i, b.y1 + i, b.fv + i);
+    }
+    for (; i < n; i++)
+    {
+        BilinearAxis(b.s[i], b.w[i], b.x0[i], b.x1[i], b.fu[i]);
+        BilinearAxis(b.t[i], b.h[i], b.y0[i], b.y1[i], b.fv[i]);
+    }
+}
+
+// Unpacks work inside 128 bit lanes, so weights are broadcast the same way per lane
+SIMD_TARGET_AVX2
+static inline void weights8(const uint32_t *f, __m256i &lo, __m256i &hi)
+{
+    __m256i w = _mm256_loadu_si256((const __m256i*)f);
+    w = _mm256_packs_epi32(w, w);
+    w = _mm256_unpacklo_epi16(w, w);
+    lo = _mm256_unpacklo_epi32(w, w);
+    hi = _mm256_unpackhi_epi32(w, w);
+}
+
+SIMD_TARGET_AVX2
+static inline __m256i lerp8(__m256i c0, __m256i c1, __m256i f)
+{
+    __m256i f0 = _mm256_sub_epi16(_mm256_set1_epi16(256), f);
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(c0, f0), _mm256_mullo_epi16(c1, f));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+}
+
+SIMD_TARGET_AVX2
+void BilinearLerpAvx2(BilinearBatch &b, uint32_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i fu_lo, fu_hi, fv_lo, fv_hi;
+        weights8(b.fu + i, fu_lo, fu_hi);
+        weights8(b.fv + i, fv_lo, fv_hi);
+        __m256i t[4];
+        for (int k = 0; k < 4; k++)
+            t[k] = _mm256_loadu_si256((const __m256i*)(b.texels[k] + i));
+        __m256i top_lo = lerp8(_mm256_unpacklo_epi8(t[0], zero), _mm256_unpacklo_epi8(t[1], zero), fu_lo);
+        __m256i top_hi = lerp8(_mm256_unpackhi_epi8(t[0], zero), _mm256_unpackhi_epi8(t[1], zero), fu_hi);
+        __m256i bot_lo = lerp8(_mm256_unpacklo_epi8(t[2], zero), _mm256_unpacklo_epi8(t[3], zero), fu_lo);
+        __m256i bot_hi = lerp8(_mm256_unpackhi_epi8(t[2], zero), _mm256_unpackhi_epi8(t[3], zero), fu_hi);
+        __m256i lo = lerp8(top_lo, bot_lo, fv_lo);
+        __m256i hi = lerp8(top_hi, bot_hi, fv_hi);
+        _mm256_storeu_si256((__m256i*)(b.colors + i), _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < n; i++)
+    {
+        uint32_t top = BilinearLerpColor(b.texels[0][i], b.texels[1][i], b.fu[i]);
+        uint32_t bottom = BilinearLerpColor(b.texels[2][i], b.texels[3][i], b.fu[i]);
+        b.colors[i] = BilinearLerpColor(top, bottom, b.fv[i]);
+    }
+}
+#endif
@@ -0,0 +1,77 @@
+#ifndef _ETC1_CACHE_HH
+#define _ETC1_CACHE_HH
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include <oglory_gpu_defs.hh>
+
+// Direct mapped cache of decoded ETC1 blocks. Neighbouring fetches mostly hit the
+// same 4x4 block, so every block is decoded once while it is in cache. Entries
+// are tagged with memory offset of block & generation, which is bumped when
+// bound texture changes (instead of clearing all entries).
+class Etc1BlockCache
+{
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t generation;
+        uint32_t texels[16];
+    };
+
+    std::vector<Entry> entries;
+    uint32_t generation = 1;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    public:
+    Etc1BlockCache(uint32_t size)
+    {
+        if (!size || (size & (size - 1)))
+        {
+            std::cerr << "Wrong ETC1 block cache size: " << size << " entries" << std::endl;
+            exit(1);
+        }
+        entries.assign(size, Entry{0, 0, {}});
+    }
+
+    // Decoded texels of block at offset of mem, miss is reported to decode it
+    const uint32_t* Block(const uint8_t *mem, uint32_t offset, bool &miss)
+    {
+        Entry &e = entries[(offset >> 3) & (entries.size() - 1)];
+        miss = (e.offset != offset) || (e.generation != generation);
+        if (miss)
+        {
+            misses++;
+            GpuEtc1DecodeBlock(mem + offset, e.texels);
+            e.offset = offset;
+            e.generation = generation;
+        }
+        else
+            hits++;
+        return e.texels;
+    }
+
+    void Invalidate()
+    {
+        if (!++generation)
+        {
+            // generation wrapped, old entries could match again
+            for (Entry &e : entries)
+                e.generation = 0;
+            generation = 1;
+        }
+    }
+
+    void PrintStats() const
+    {
+        uint64_t total = hits + misses;
+        std::cerr << "ETC1 block cache (" << entries.size() << " blocks): " << total << " fetches, " << hits << " hits, "
+            << misses << " misses, hit rate " << (total ? 100. * hits / total : 0.) << "%" << std::endl;
+    }
+};
+
+#endif
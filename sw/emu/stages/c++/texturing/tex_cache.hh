@@ -0,0 +1,77 @@
+#ifndef _TEX_CACHE_HH
+#define _TEX_CACHE_HH
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// Empty cache line mark, addresses are 32 bit so line number can't be all ones
+const uint32_t TEX_CACHE_INVALID_LINE = UINT32_MAX;
+
+// Set-associative texture cache model with LRU replacement. It doesn't hold data,
+// only counts hits & misses of texel fetches to tune texture layouts & wb_cache
+// parameters (ways=1 is direct mapped like wb_cache).
+class TexCacheModel
+{
+    uint32_t line_shift;
+    uint32_t sets;
+    uint32_t ways;
+    std::vector<uint32_t> lines;    // line numbers of every set, most recently used first
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    static bool IsPow2(uint32_t x)
+    {
+        return x && !(x & (x - 1));
+    }
+
+    public:
+    TexCacheModel(uint32_t size, uint32_t ways, uint32_t line_size) : ways(ways)
+    {
+        if (!IsPow2(line_size) || line_size < 4 || !ways || !IsPow2(size / (line_size * ways)) || size % (line_size * ways))
+        {
+            std::cerr << "Wrong texture cache configuration: " << size << " bytes, " << ways << " ways, " << line_size << " bytes line" << std::endl;
+            exit(1);
+        }
+        line_shift = __builtin_ctz(line_size);
+        sets = size / (line_size * ways);
+        lines.assign(sets * ways, TEX_CACHE_INVALID_LINE);
+    }
+
+    // Fetch of byte address, returns true on hit
+    bool Access(uint32_t addr)
+    {
+        uint32_t line = addr >> line_shift;
+        uint32_t *set = &lines[(line & (sets - 1)) * ways];
+
+        uint32_t way = 0;
+        while (way < ways && set[way] != line)
+            way++;
+        bool hit = (way < ways);
+        if (hit)
+            hits++;
+        else
+        {
+            misses++;
+            way = ways - 1;     // replace least recently used
+        }
+
+        for (; way > 0; way--)
+            set[way] = set[way - 1];
+        set[0] = line;
+        return hit;
+    }
+
+    void PrintStats() const
+    {
+        uint64_t total = hits + misses;
+        std::cerr << "Texture cache (" << sets * ways * (1u << line_shift) << " bytes, " << ways << " ways, "
+            << (1u << line_shift) << " bytes line): " << total << " fetches, " << hits << " hits, " << misses
+            << " misses, hit rate " << (total ? 100. * hits / total : 0.) << "%" << std::endl;
+    }
+};
+
+#endif
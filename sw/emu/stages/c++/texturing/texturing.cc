@@ -2,12 +2,18 @@
 #include <cstdlib> 
 #include <cstring>  
 #include <cmath>  
+#include <algorithm>
 #include <unistd.h>  
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include <gpu_pipeline.hh> 
+#include <fragment_span.hh> 
+
+#include "tex_cache.hh"
+#include "etc1_cache.hh"
+#include "bilinear.hh"
 
 #define CHECKERBOARD    0
 
@@ -31,7 +37,6 @@ class SharedMem
         mmap_addr = (uint8_t*)mmap(NULL, mmap_len, PROT_READ , MAP_SHARED, memfd, 0);
         assert(mmap_addr != MAP_FAILED);
         
-        bpp = 4;
         SetMemOffset(0x400000);
     }
     
@@ -53,14 +58,75 @@ class SharedMem
         ((uint32_t*)mmap_addr)[off/4] = data;
     }
     
-    uint32_t GetColor(int x, int y, int width)
+    uint32_t GetColor(int x, int y, int level = 0)
     {
-        return *((uint32_t*)&(mmap_addr[mem_offset + (y*width+x)*bpp])); 
+        const Level &l = levels[level];
+        if (format == TEXFORMAT_ETC1)
+            return GetEtc1Color(l, x, y);
+        ssize_t off = l.offset + GpuTexelIndex(x, y, l.width, l.height, l.layout)*bpp;
+        if (cache)
+            cache->Access(off);
+        if (format == TEXFORMAT_RGBA8)
+            return *((uint32_t*)&(mmap_addr[off])); 
+        return GpuDecodeTexel(&mmap_addr[off], format);
     }
     
     void SetMemOffset(ssize_t off) 
     {
         mem_offset = off; 
+        SetLevels(levels[0].layout, 0, format);
+    }
+    
+    // Bound texture, it is linear RGBA8 without mipmaps till TEXPARAMS
+    void SetTexture(ssize_t off, int w, int h)
+    {
+        width = w;
+        height = h;
+        mem_offset = off;
+        SetLevels(TEXLAYOUT_LINEAR, 0, TEXFORMAT_RGBA8);
+    }
+    
+    // Layout, number of mipmap levels after base one & texel format
+    void SetLevels(uint32_t layout, int count, uint32_t texel_format)
+    {
+        format = texel_format;
+        bpp = GpuTexelBytes(format);
+        if (etc1_cache)
+            etc1_cache->Invalidate();
+        level_count = std::min(count, MAX_LEVELS - 1);
+        for (int i = 0; i <= level_count; i++)
+        {
+            Level &l = levels[i];
+            l.width = GpuTexLevelSize(width, i);
+            l.height = GpuTexLevelSize(height, i);
+            l.layout = GpuTexLevelLayout(l.width, l.height, layout);
+            l.offset = mem_offset + (ssize_t)GpuTexLevelOffset(width, height, i, format);
+        }
+    }
+    
+    int Width(int level) const
+    {
+        return levels[level].width;
+    }
+    
+    int Height(int level) const
+    {
+        return levels[level].height;
+    }
+    
+    int Levels() const
+    {
+        return level_count;
+    }
+    
+    void SetCacheModel(TexCacheModel *c)
+    {
+        cache = c;
+    }
+    
+    void SetEtc1Cache(Etc1BlockCache *c)
+    {
+        etc1_cache = c;
     }
     
     private:
@@ -68,25 +134,244 @@ class SharedMem
     uint8_t* mmap_addr;
     ssize_t mmap_len;
     
-    //int width, height;
-    int bpp;
+    static const int MAX_LEVELS = 16;
+    struct Level
+    {
+        ssize_t offset;
+        int width, height;
+        uint32_t layout;
+    };
+    
+    int width = 1, height = 1;
+    uint32_t format = TEXFORMAT_RGBA8;
+    int bpp = 4;
     ssize_t mem_offset;
+    Level levels[MAX_LEVELS];
+    int level_count = 0;
+    TexCacheModel *cache = nullptr;
+    Etc1BlockCache *etc1_cache = nullptr;
+    
+    // Texel of ETC1 level, blocks are decoded through block cache if it's enabled
+    uint32_t GetEtc1Color(const Level &l, int x, int y)
+    {
+        ssize_t off = l.offset + ((y >> 2)*((l.width + 3) >> 2) + (x >> 2))*8;
+        assert(off + 8 <= mmap_len);
+        int i = (y & 3)*4 + (x & 3);
+        if (etc1_cache)
+        {
+            bool miss;
+            const uint32_t *texels = etc1_cache->Block(mmap_addr, off, miss);
+            // memory is read only to decode missed block
+            if (miss && cache)
+                cache->Access(off);
+            return texels[i];
+        }
+        if (cache)
+            cache->Access(off);
+        uint32_t texels[16];
+        GpuEtc1DecodeBlock(&mmap_addr[off], texels);
+        return texels[i];
+    }
 };
 
 SharedMem shmem;
 int tex_w, tex_h;
 #endif
 
-float linear_filter(float a, float b, float color[4])
+// Filters of bound texture
+uint32_t tex_min_filter = TEXFILTER_NEAREST;
+uint32_t tex_mag_filter = TEXFILTER_NEAREST;
+
+// tex_filter=gl|nearest|linear stage option, last two ignore TEXPARAMS filters & sample base level
+enum TexFilterMode
 {
-    return Clamp((1 - a)*(1 - b)*color[0] + a*(1 - b)*color[1] + (1 - a)*b*color[2] + a*b*color[3]);
-}
+    TEX_FILTER_GL,
+    TEX_FILTER_NEAREST,
+    TEX_FILTER_LINEAR
+};
+TexFilterMode filter_mode = TEX_FILTER_GL;
 
 IoFifo *iofifo;
 
-int main(int argc, char **argv) 
+static inline bool filter_linear(uint32_t filter)
+{
+    return (filter == TEXFILTER_LINEAR) || (filter == TEXFILTER_LINEAR_MIPMAP_NEAREST) || (filter == TEXFILTER_LINEAR_MIPMAP_LINEAR);
+}
+
+// Textured fragments are collected in batches, so bilinear filtering could run over
+// all of them at once. Every fragment has one sample or two for trilinear filtering
+// (second from the next mipmap level). Nearest samples are fetched right away,
+// bilinear ones are filtered on flush.
+class TexBatch
+{
+    static const uint32_t SIZE = BILINEAR_BATCH_SIZE / 2;
+    
+    uint32_t n = 0;
+    uint32_t xy[SIZE];
+    uint32_t z[SIZE];
+    uint32_t samples[SIZE][2];      // RGBA8 colors of samples
+    uint32_t mix[SIZE];             // 8 bit weight of second sample, 0 for single sample
+    
+    BilinearBatch bilinear;
+    uint32_t bilinear_n = 0;
+    uint32_t bilinear_level[BILINEAR_BATCH_SIZE];
+    uint32_t *bilinear_dst[BILINEAR_BATCH_SIZE];
+    BilinearKernel setup_kernel;
+    BilinearKernel lerp_kernel;
+    
+    void Sample(int level, float t_x, float t_y, bool linear, uint32_t *dst)
+    {
+        #if !CHECKERBOARD
+        int w = shmem.Width(level);
+        int h = shmem.Height(level);
+        if (linear)
+        {
+            // wrapping is done by kernel
+            bilinear.s[bilinear_n] = t_x;
+            bilinear.t[bilinear_n] = t_y;
+            bilinear.w[bilinear_n] = w;
+            bilinear.h[bilinear_n] = h;
+            bilinear_level[bilinear_n] = level;
+            bilinear_dst[bilinear_n++] = dst;
+            return;
+        }
+        
+        // Wrap Mode REPEAT
+        float s = t_x - floor(t_x);
+        float t = t_y - floor(t_y);
+        float u = s * w;  // width = 2 ^ n
+        float v = t * h;  // height = 2 ^ m
+        int i_vt = s < 1 ? floor(u) : w - 1;
+        int j_vt = t < 1 ? floor(v) : h - 1;
+        *dst = shmem.GetColor(i_vt, j_vt, level);
+        #endif
+    }
+    
+    public:
+    void Init(SimdLevel simd)
+    {
+        SelectBilinearKernels(simd, setup_kernel, lerp_kernel);
+    }
+    
+    bool Full() const
+    {
+        return n == SIZE;
+    }
+    
+    // Textured fragment at texcoords (t_x, t_y), lod is log2 of texels per pixel (0 if unknown)
+    void Add(uint32_t x, uint32_t y, uint32_t depth, float t_x, float t_y, float lod)
+    {
+        xy[n] = (y << 16) | x;
+        z[n] = depth;
+        mix[n] = 0;
+        uint32_t *dst = samples[n++];
+        
+        #if CHECKERBOARD
+        bool check = (((int(t_x * 64) & 0x8) == 0) ^ ((int(t_y * 64) & 0x8) == 0));
+        dst[0] = check ? 0xFF00FF00 : 0xFFFF0000;
+        #else
+        int max_level = shmem.Levels();
+        if (filter_mode != TEX_FILTER_GL)
+            Sample(0, t_x, t_y, filter_mode == TEX_FILTER_LINEAR, dst);
+        else if (lod <= 0)
+            Sample(0, t_x, t_y, filter_linear(tex_mag_filter), dst);
+        else if (tex_min_filter <= TEXFILTER_LINEAR || !max_level)
+            Sample(0, t_x, t_y, filter_linear(tex_min_filter), dst);
+        else
+        {
+            bool linear = filter_linear(tex_min_filter);
+            if ((tex_min_filter == TEXFILTER_NEAREST_MIPMAP_NEAREST) || (tex_min_filter == TEXFILTER_LINEAR_MIPMAP_NEAREST))
+            {
+                // nearest level
+                int level = std::min((int)ceilf(lod + 0.5f) - 1, max_level);
+                Sample(level, t_x, t_y, linear, dst);
+            }
+            else if (lod >= max_level)
+                Sample(max_level, t_x, t_y, linear, dst);
+            else
+            {
+                // blend of two nearest levels
+                int level = (int)lod;
+                mix[n - 1] = (uint32_t)((lod - level) * 256);
+                Sample(level, t_x, t_y, linear, &dst[0]);
+                if (mix[n - 1])
+                    Sample(level + 1, t_x, t_y, linear, &dst[1]);
+            }
+        }
+        #endif
+    }
+    
+    // Filter pending samples & write fragments
+    void Flush(IoFifo &fifo)
+    {
+        #if !CHECKERBOARD
+        if (bilinear_n)
+        {
+            setup_kernel(bilinear, bilinear_n);
+            for (uint32_t i = 0; i < bilinear_n; i++)
+            {
+                int level = bilinear_level[i];
+                bilinear.texels[0][i] = shmem.GetColor(bilinear.x0[i], bilinear.y0[i], level);
+                bilinear.texels[1][i] = shmem.GetColor(bilinear.x1[i], bilinear.y0[i], level);
+                bilinear.texels[2][i] = shmem.GetColor(bilinear.x0[i], bilinear.y1[i], level);
+                bilinear.texels[3][i] = shmem.GetColor(bilinear.x1[i], bilinear.y1[i], level);
+            }
+            lerp_kernel(bilinear, bilinear_n);
+            for (uint32_t i = 0; i < bilinear_n; i++)
+                *bilinear_dst[i] = bilinear.colors[i];
+            bilinear_n = 0;
+        }
+        #endif
+        
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint32_t c = mix[i] ? BilinearLerpColor(samples[i][0], samples[i][1], mix[i]) : samples[i][0];
+            // texels are RGBA in memory
+            fifo.WriteFragment(xy[i] & 0xFFFF, xy[i] >> 16, z[i], ArgbToU32(c >> 24, c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF));
+        }
+        n = 0;
+    }
+};
+
+#if !CHECKERBOARD
+// Texcoords at point px of line where edge functions are line[]
+static void span_texcoords(const SpanSetup &s, const float *line, float px, float tc[2])
 {
-    if (argc != 5)
+    float w[3];
+    for (int i = 0; i < 3; i++)
+        w[i] = fmaf(px, s.dx[i], line[i]);
+    float wn = 1. / fmac_attribs(s.w[0], s.w[1], s.w[2], w[0], w[1], w[2]);
+    for (int i = 0; i < 2; i++)
+        tc[i] = fmac_attribs(s.attr[0][i], s.attr[1][i], s.attr[2][i], w[0], w[1], w[2]) * wn;
+}
+
+// Level of detail (log2 of texels per pixel) from texcoord differences in 2x2 quad of span pixel x
+static float quad_lod(const SpanSetup &s, const Span &span, uint32_t x)
+{
+    float line[3], line_next[3];
+    for (int i = 0; i < 3; i++)
+    {
+        line[i] = (span.y & 1) ? span.line[i] - s.dy[i] : span.line[i];
+        line_next[i] = line[i] + s.dy[i];
+    }
+    
+    float px = (x & ~1u) + 0.5f;
+    float tc[2], tc_x[2], tc_y[2];
+    span_texcoords(s, line, px, tc);
+    span_texcoords(s, line, px + 1, tc_x);
+    span_texcoords(s, line_next, px, tc_y);
+    
+    float w = shmem.Width(0), h = shmem.Height(0);
+    float dudx = (tc_x[0] - tc[0]) * w, dvdx = (tc_x[1] - tc[1]) * h;
+    float dudy = (tc_y[0] - tc[0]) * w, dvdy = (tc_y[1] - tc[1]) * h;
+    float rho2 = std::max(dudx*dudx + dvdx*dvdx, dudy*dudy + dvdy*dvdy);
+    return 0.5f * log2f(rho2);
+}
+#endif
+
+STAGE_MAIN(int argc, char **argv)
+{
+    if (argc < 5)
     {
         puts("Wrong parameters!");
         return 1;
@@ -96,78 +381,107 @@ int main(int argc, char **argv)
     const uint32_t SCREEN_HEIGHT    = atoi(argv[2]);
         
     // Open output FIFO
-    iofifo = new IoFifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    iofifo = new IoFifo(argv[3], argv[4], options);
+    
+    // tex_cache=<bytes> enables texture cache model, tex_cache_ways=N, tex_cache_line=<bytes>,
+    // tex_cache_stats=<print every N syncs>
+    // etc1_cache=<decoded blocks> sets size of ETC1 block cache (0 decodes block on every fetch)
+    TexCacheModel *tex_cache = nullptr;
+    Etc1BlockCache *etc1_cache = nullptr;
+    long tex_cache_stats = options.GetInt("tex_cache_stats", 0);
+    uint64_t sync_count = 0;
+    #if !CHECKERBOARD
+    if (options.GetInt("tex_cache", 0))
+    {
+        tex_cache = new TexCacheModel(options.GetInt("tex_cache", 0), options.GetInt("tex_cache_ways", 4), options.GetInt("tex_cache_line", 32));
+        shmem.SetCacheModel(tex_cache);
+    }
+    if (options.GetInt("etc1_cache", 64))
+    {
+        etc1_cache = new Etc1BlockCache(options.GetInt("etc1_cache", 64));
+        shmem.SetEtc1Cache(etc1_cache);
+    }
+    #endif
     
+    std::string filter = options.Get("tex_filter", "gl");
+    if (filter == "nearest")
+        filter_mode = TEX_FILTER_NEAREST;
+    else if (filter == "linear")
+        filter_mode = TEX_FILTER_LINEAR;
+    else if (filter != "gl")
+        std::cerr << "Unknown texture filter " << filter << std::endl;
+    
+    // bilinear kernels are selected with simd option
+    TexBatch *batch = new TexBatch;
+    batch->Init(SimdSelect(options));
+    
+    SpanSetup span_setup = {};
     while (1)
     {
+        // textured fragments are written when batch is full or there is nothing else to do
+        if (!iofifo->InputReady())
+            batch->Flush(*iofifo);
         uint32_t cmd = iofifo->ReadFromFifo32();
+        if ((cmd != GPU_PIPE_CMD_TEXFRAGMENT) && (cmd != GPU_PIPE_CMD_SPAN))
+            batch->Flush(*iofifo);
         switch (cmd)
         {
             case (GPU_PIPE_CMD_TEXFRAGMENT):
             {
-                uint32_t x = iofifo->ReadFromFifo32();
-                uint32_t y = (x >> 16) & 0xFFFF;
-                x &= 0xFFFF;
-                uint32_t z = iofifo->ReadFromFifo32();
-                float t_x = iofifo->ReadFromFifoFloat();
-                float t_y = iofifo->ReadFromFifoFloat();
-                float r, g, b, a;
-                #if CHECKERBOARD
-                const int M = 8;
-                //bool check = ((fmod(t_x * M, 1.0) > 0.5) ^ (fmod(t_y * M, 1.0) < 0.5)) > 0.5;
-                bool check = (((int(t_x * 64) & 0x8) == 0) ^ ((int(t_y * 64) & 0x8) == 0));
-                r = 0;
-                g = check ? 1.0 : 0;
-                b = !check ? 1.0 : 0;
-                a = 1.0;
-                #else
-                // Wrap Mode REPEAT
-                float s = t_x - floor(t_x);
-                float t = t_y - floor(t_y);
-                float u = s * tex_w;  // width = 2 ^ n
-                float v = t * tex_h;  // height = 2 ^ m
-                
-                #if 1
-                // TEXTURE_MIN_FILTER == NEAREST
-                int i_vt = s < 1 ? floor(u) : tex_w - 1;
-                int j_vt = t < 1 ? floor(v) : tex_h - 1;
-                uint32_t tex_color = shmem.GetColor(i_vt, j_vt, tex_w);
-                r = ((tex_color >>  0) & 0xFF) / 255.;
-                g = ((tex_color >>  8) & 0xFF) / 255.;
-                b = ((tex_color >> 16) & 0xFF) / 255.;
-                a = ((tex_color >> 24) & 0xFF) / 255.;
-                #else
-                uint32_t lf_pixels[4];
-                int i0_vt = (u - 0.5) >= 0 ? floor(u - 0.5) : tex_w + floor(u - 0.5);   // !!! edges ???????????????????????????????
-                int j0_vt = (v - 0.5) >= 0 ? floor(v - 0.5) : tex_h + floor(v - 0.5);
-                int i1_vt = i0_vt + 1 < tex_w ? i0_vt+1 : i0_vt-tex_w;
-                int j1_vt = j0_vt + 1 < tex_h ? j0_vt+1 : j0_vt-tex_h;
-                //int j1_vt = (v + 1) < tex_h ? floor(v + 1) : floor(v) - tex_h;
-                lf_pixels[0] = shmem.GetColor(i0_vt, j0_vt, tex_w);
-                lf_pixels[1] = shmem.GetColor(i1_vt, j0_vt, tex_w);
-                lf_pixels[2] = shmem.GetColor(i0_vt, j1_vt, tex_w);
-                lf_pixels[3] = shmem.GetColor(i1_vt, j1_vt, tex_w);
-                Vec4 lf_r, lf_g, lf_b, lf_a;
-                for (int i = 0; i < 4; i++)
+                uint32_t words[4];
+                iofifo->ReadWords(words, 4);
+                uint32_t x = words[0] & 0xFFFF;
+                uint32_t y = (words[0] >> 16) & 0xFFFF;
+                uint32_t z = words[1];
+                float t_x, t_y;
+                memcpy(&t_x, &words[2], sizeof(float));
+                memcpy(&t_y, &words[3], sizeof(float));
+                // single fragments carry no texcoord derivatives, so base level is sampled (TEXPARAMS is reported only with spans)
+                batch->Add(x, y, z, t_x, t_y, 0);
+                if (batch->Full())
+                    batch->Flush(*iofifo);
+                iofifo->CommandDone(cmd);
+                break;
+            }
+            case (GPU_PIPE_CMD_TEXSPAN_SETUP):
+            {
+                ReadSpanSetup(*iofifo, cmd, span_setup);
+                break;
+            }
+            case (GPU_PIPE_CMD_SPAN_SETUP):
+            {
+                // untextured spans are passed to fragment ops
+                span_setup.texture = false;
+                iofifo->BypassCmd(cmd);
+                break;
+            }
+            case (GPU_PIPE_CMD_SPAN):
+            {
+                if (!span_setup.texture)
                 {
-                    lf_r[i] = ((lf_pixels[i] >>  0) & 0xFF) / 255.;
-                    lf_g[i] = ((lf_pixels[i] >>  8) & 0xFF) / 255.;
-                    lf_b[i] = ((lf_pixels[i] >> 16) & 0xFF) / 255.;
-                    lf_a[i] = ((lf_pixels[i] >> 24) & 0xFF) / 255.;
+                    iofifo->BypassCmd(cmd);
+                    break;
                 }
                 
-                float tmp;
-                float alpha = modff(u - 0.5, &tmp);
-                float beta  = modff(v - 0.5, &tmp);
-                
-                r = linear_filter(alpha, beta, lf_r);
-                g = linear_filter(alpha, beta, lf_g);
-                b = linear_filter(alpha, beta, lf_b);
-                a = linear_filter(alpha, beta, lf_a);
-                #endif
-                #endif
-                
-                iofifo->WriteFragment(x, y, z, r, g, b, a);   
+                Span span;
+                ReadSpan(*iofifo, span);
+                // LOD is needed only if min & mag filters differ, it is shared by pixels of 2x2 quad
+                float lod = 0;
+                for (uint32_t x = span.x; x < span.x + span.length; x++)
+                {
+                    #if !CHECKERBOARD
+                    if ((filter_mode == TEX_FILTER_GL) && (tex_min_filter != tex_mag_filter) && (x == span.x || !(x & 1)))
+                        lod = quad_lod(span_setup, span, x);
+                    #endif
+                    SpanPixel p;
+                    if (!SpanPixelSetup(span_setup, span, x, p))
+                        continue;
+                    batch->Add(x, span.y, p.z, SpanAttrib(span_setup, p, 0), SpanAttrib(span_setup, p, 1), lod);
+                    if (batch->Full())
+                        batch->Flush(*iofifo);
+                }
+                iofifo->CommandDone(cmd);
                 break;
             }
             case (GPU_PIPE_CMD_BINDTEXTURE):
@@ -178,8 +492,32 @@ int main(int argc, char **argv)
                 tex_w = size & 0xFFFF;
                 tex_h = (size >> 16) & 0xFFFF;
                 verbose("Set texture ptr %X\n", ptr);
-                shmem.SetMemOffset(ptr);
+                shmem.SetTexture(ptr, tex_w, tex_h);
                 #endif
+                tex_min_filter = tex_mag_filter = TEXFILTER_NEAREST;
+                break;
+            }
+            case (GPU_PIPE_CMD_TEXPARAMS):
+            {
+                uint32_t params = iofifo->ReadFromFifo32();
+                tex_min_filter = (params >> GPU_TEXPARAM_MINF_SHIFT) & GPU_TEXPARAM_FIELD_MASK;
+                tex_mag_filter = (params >> GPU_TEXPARAM_MAGF_SHIFT) & GPU_TEXPARAM_FIELD_MASK;
+                #if !CHECKERBOARD
+                shmem.SetLevels(params & GPU_TEXPARAM_LAYOUT_MASK, (params >> GPU_TEXPARAM_LEVELS_SHIFT) & GPU_TEXPARAM_FIELD_MASK,
+                                (params >> GPU_TEXPARAM_FORMAT_SHIFT) & GPU_TEXPARAM_FIELD_MASK);
+                #endif
+                break;
+            }
+            case (GPU_PIPE_CMD_SYNC):
+            {
+                if (tex_cache_stats && (++sync_count % tex_cache_stats) == 0)
+                {
+                    if (tex_cache)
+                        tex_cache->PrintStats();
+                    if (etc1_cache)
+                        etc1_cache->PrintStats();
+                }
+                iofifo->BypassCmd(cmd);
                 break;
             }
             default:
@@ -0,0 +1,94 @@
+#ifndef _TRANSFORM_HH
+#define _TRANSFORM_HH
+
+#include <cstdint>
+
+#include <gpu_pipeline.hh>
+#include <simd.hh>
+
+// Batched vertex transform. Vertices are kept as struct of arrays, so kernels
+// transform several of them at once with combined model-view-projection matrix
+// to clip coords & then (for vertices which aren't clipped) to window coords:
+// 1/w, perspective divide & viewport transform. Both steps do the same float
+// operations in the same order as scalar code, so results are bit-exact.
+
+const uint32_t VERTEX_BATCH_SIZE = 96;      // 32 triangles
+
+struct VertexBatch
+{
+    // input: object coords (w is 1)
+    float x[VERTEX_BATCH_SIZE];
+    float y[VERTEX_BATCH_SIZE];
+    float z[VERTEX_BATCH_SIZE];
+    // clip coords
+    float cx[VERTEX_BATCH_SIZE];
+    float cy[VERTEX_BATCH_SIZE];
+    float cz[VERTEX_BATCH_SIZE];
+    float cw[VERTEX_BATCH_SIZE];
+    // window coords & 1/w, valid only if w is above clipping plane
+    float sx[VERTEX_BATCH_SIZE];
+    float sy[VERTEX_BATCH_SIZE];
+    float sz[VERTEX_BATCH_SIZE];
+    float rw[VERTEX_BATCH_SIZE];
+};
+
+struct TransformParams
+{
+    M4 mvp;
+    float viewport_x0, viewport_y0;
+    float viewport_size_x, viewport_size_y;
+    float depth_fn2, depth_nf2;
+};
+
+typedef void (*TransformKernel)(VertexBatch &b, const TransformParams &p, uint32_t n);
+
+// Object coords to clip coords & window coords with 1/w in place of w
+static inline void TransformPoint(const TransformParams &p, float x, float y, float z, Vec4 &clip, Vec4 &window)
+{
+    const float (*m)[4] = p.mvp.m;
+    for (int r = 0; r < 4; r++)
+        clip[r] = m[r][0] * x + m[r][1] * y + m[r][2] * z + m[r][3];
+
+    window[3] = 1 / clip[3];
+    window[0] = p.viewport_size_x * (clip[0] * window[3] + 1) + p.viewport_x0;
+    window[1] = p.viewport_size_y * (clip[1] * window[3] + 1) + p.viewport_y0;
+    window[2] = p.depth_fn2 * (clip[2] * window[3]) + p.depth_nf2;
+}
+
+static inline void TransformVertex(VertexBatch &b, const TransformParams &p, uint32_t i)
+{
+    Vec4 clip, window;
+    TransformPoint(p, b.x[i], b.y[i], b.z[i], clip, window);
+    b.cx[i] = clip[0];
+    b.cy[i] = clip[1];
+    b.cz[i] = clip[2];
+    b.cw[i] = clip[3];
+    b.sx[i] = window[0];
+    b.sy[i] = window[1];
+    b.sz[i] = window[2];
+    b.rw[i] = window[3];
+}
+
+static inline void TransformScalar(VertexBatch &b, const TransformParams &p, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        TransformVertex(b, p, i);
+}
+
+#if SIMD_X86
+void TransformSse41(VertexBatch &b, const TransformParams &p, uint32_t n);
+void TransformAvx2(VertexBatch &b, const TransformParams &p, uint32_t n);
+#endif
+
+static inline TransformKernel SelectTransformKernel(SimdLevel simd)
+{
+    #if SIMD_X86
+    if (simd == SIMD_AVX2)
+        return TransformAvx2;
+    if (simd == SIMD_SSE41)
+        return TransformSse41;
+    #endif
+    return TransformScalar;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include <cstdint>
+
+#include "transform.hh"
+
+#if SIMD_X86
+#include <immintrin.h>
+
+// SSE4.1 & AVX2 transform kernels, 4 & 8 vertices per iteration. Matrix
+// elements are broadcast to all lanes, tails are processed with inlined scalar
+// code (AVX2 kernel doesn't call SSE one to avoid AVX-SSE transition penalties).
+// Division is used for 1/w (not reciprocal approximation) to match scalar code.
+
+SIMD_TARGET_SSE41
+void TransformSse41(VertexBatch &b, const TransformParams &p, uint32_t n)
+{
+    __m128 m[4][4];
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            m[r][c] = _mm_set1_ps(p.mvp.m[r][c]);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 x0 = _mm_set1_ps(p.viewport_x0), y0 = _mm_set1_ps(p.viewport_y0);
+    const __m128 size_x = _mm_set1_ps(p.viewport_size_x), size_y = _mm_set1_ps(p.viewport_size_y);
+    const __m128 fn2 = _mm_set1_ps(p.depth_fn2), nf2 = _mm_set1_ps(p.depth_nf2);
+
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(b.x + i), y = _mm_loadu_ps(b.y + i), z = _mm_loadu_ps(b.z + i);
+        __m128 c[4];
+        for (int r = 0; r < 4; r++)
+            c[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), m[r][3]);
+        _mm_storeu_ps(b.cx + i, c[0]);
+        _mm_storeu_ps(b.cy + i, c[1]);
+        _mm_storeu_ps(b.cz + i, c[2]);
+        _mm_storeu_ps(b.cw + i, c[3]);
+
+        __m128 rw = _mm_div_ps(one, c[3]);
+        _mm_storeu_ps(b.rw + i, rw);
+        _mm_storeu_ps(b.sx + i, _mm_add_ps(_mm_mul_ps(size_x, _mm_add_ps(_mm_mul_ps(c[0], rw), one)), x0));
+        _mm_storeu_ps(b.sy + i, _mm_add_ps(_mm_mul_ps(size_y, _mm_add_ps(_mm_mul_ps(c[1], rw), one)), y0));
+        _mm_storeu_ps(b.sz + i, _mm_add_ps(_mm_mul_ps(fn2, _mm_mul_ps(c[2], rw)), nf2));
+    }
+    for (; i < n; i++)
+        TransformVertex(b, p, i);
+}
+
+SIMD_TARGET_AVX2
+void TransformAvx2(VertexBatch &b, const TransformParams &p, uint32_t n)
+{
+    __m256 m[4][4];
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            m[r][c] = _mm256_set1_ps(p.mvp.m[r][c]);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 x0 = _mm256_set1_ps(p.viewport_x0), y0 = _mm256_set1_ps(p.viewport_y0);
+    const __m256 size_x = _mm256_set1_ps(p.viewport_size_x), size_y = _mm256_set1_ps(p.viewport_size_y);
+    const __m256 fn2 = _mm256_set1_ps(p.depth_fn2), nf2 = _mm256_set1_ps(p.depth_nf2);
+
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(b.x + i), y = _mm256_loadu_ps(b.y + i), z = _mm256_loadu_ps(b.z + i);
+        __m256 c[4];
+        for (int r = 0; r < 4; r++)
+            c[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)), _mm256_mul_ps(m[r][2], z)), m[r][3]);
+        _mm256_storeu_ps(b.cx + i, c[0]);
+        _mm256_storeu_ps(b.cy + i, c[1]);
+        _mm256_storeu_ps(b.cz + i, c[2]);
+        _mm256_storeu_ps(b.cw + i, c[3]);
+
+        __m256 rw = _mm256_div_ps(one, c[3]);
+        _mm256_storeu_ps(b.rw + i, rw);
+        _mm256_storeu_ps(b.sx + i, _mm256_add_ps(_mm256_mul_ps(size_x, _mm256_add_ps(_mm256_mul_ps(c[0], rw), one)), x0));
+        _mm256_storeu_ps(b.sy + i, _mm256_add_ps(_mm256_mul_ps(size_y, _mm256_add_ps(_mm256_mul_ps(c[1], rw), one)), y0));
+        _mm256_storeu_ps(b.sz + i, _mm256_add_ps(_mm256_mul_ps(fn2, _mm256_mul_ps(c[2], rw)), nf2));
+    }
+    for (; i < n; i++)
+        TransformVertex(b, p, i);
+}
+#endif
@@ -0,0 +1,117 @@
+#ifndef _VERTEX_CACHE_HH
+#define _VERTEX_CACHE_HH
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+#include <gpu_pipeline.hh>
+
+// Empty entry mark, vertex slots are 16 bit
+const uint32_t VERTEX_CACHE_INVALID_SLOT = UINT32_MAX;
+
+enum VertexCachePolicy
+{
+    VERTEX_CACHE_FIFO,
+    VERTEX_CACHE_LRU
+};
+
+// Post-transform vertex cache of indexed drawing. Holds clip & window coords of
+// recently transformed vertex slots, so vertices shared by triangles of index
+// list are transformed once while they stay in cache. Entries are searched
+// fully associatively like in hardware caches of small size.
+class VertexCache
+{
+    public:
+    struct Entry
+    {
+        uint32_t slot;
+        uint64_t used;      // last access time for LRU
+        Vec4 clip;
+        Vec4 window;
+    };
+
+    private:
+    std::vector<Entry> entries;
+    VertexCachePolicy policy;
+    uint32_t next = 0;      // FIFO replacement pointer
+    uint64_t time = 0;
+    Entry scratch;          // used if cache size is 0
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    public:
+    VertexCache(uint32_t size, VertexCachePolicy policy) : policy(policy)
+    {
+        entries.resize(size);
+        Invalidate();
+    }
+
+    // Entry of transformed slot or nullptr on miss
+    Entry* Lookup(uint32_t slot)
+    {
+        time++;
+        for (Entry &e : entries)
+        {
+            if (e.slot == slot)
+            {
+                hits++;
+                e.used = time;
+                return &e;
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+
+    // Entry to store transformed slot after miss
+    Entry& Insert(uint32_t slot)
+    {
+        Entry *victim = &scratch;
+        if (!entries.empty())
+        {
+            if (policy == VERTEX_CACHE_FIFO)
+            {
+                victim = &entries[next];
+                next = (next + 1) % entries.size();
+            }
+            else
+            {
+                victim = &entries[0];
+                for (Entry &e : entries)
+                    if (e.used < victim->used)
+                        victim = &e;
+            }
+        }
+        victim->slot = slot;
+        victim->used = time;
+        return *victim;
+    }
+
+    // Transformed coords are invalid after matrices or viewport change
+    void Invalidate()
+    {
+        for (Entry &e : entries)
+            e = {VERTEX_CACHE_INVALID_SLOT, 0, {}, {}};
+        next = 0;
+    }
+
+    // Slots were reloaded
+    void Invalidate(uint32_t first, uint32_t count)
+    {
+        for (Entry &e : entries)
+            if (e.slot >= first && e.slot - first < count)
+                e.slot = VERTEX_CACHE_INVALID_SLOT;
+    }
+
+    void PrintStats() const
+    {
+        uint64_t total = hits + misses;
+        std::cerr << "Vertex cache (" << entries.size() << " entries, " << (policy == VERTEX_CACHE_FIFO ? "FIFO" : "LRU") << "): "
+            << total << " lookups, " << hits << " hits, " << misses << " misses, hit rate "
+            << (total ? 100. * hits / total : 0.) << "%" << std::endl;
+    }
+};
+
+#endif
@@ -2,14 +2,21 @@
 #include <cstdlib> 
 #include <cstring>  
 #include <unistd.h>  
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include <cmath>  
 
 #include <functional> 
+#include <algorithm>
 
 //#define PRINT_FIFO 1
 #include <gpu_pipeline.hh> 
 
+#include "transform.hh"
+#include "vertex_cache.hh"
+
 #define PERSPECTIVE_CORRECT     1
 #define TEST_MATRIXES           0
 
@@ -17,6 +24,7 @@
 M4 model_matrix;
 M4 proj_matrix;
 M4 normal_matrix;
+TransformParams transform_params;   // combined MVP matrix & viewport
 
 uint32_t viewport_x0, viewport_y0;
 float viewport_size_x, viewport_size_y;
@@ -46,10 +54,11 @@ void InterpolateV2(const Vec2 &p1, const Vec2 &p2, const float t, Vec2 &vertex_o
         vertex_out[i] = Interpolate(p1[i], p2[i], t);
 }
 
+const float W_CLIPPING_PLANE = 0.00012207031;   // exp = 114
+
 //Clip against plane w=W_CLIPPING_PLANE
 int ClipPolygonOnWAxis(Vec4 polygon[], Vec4 colors[], Vec2 texcoord[])
 {
-    const float W_CLIPPING_PLANE = 0.00012207031;   // exp = 114
     const int MVPCP = 4; // max vertices per clipped polygon
     
     // check for trivial cases
@@ -196,6 +205,19 @@ void ProcessNormal(Vec3 norm, Vec3 &normal_out, float *model_matrix_ptr)
         normal_out[i] = normal[i];
 }
 
+// Combined matrix is rebuilt only when model or projection matrix changes
+void UpdateTransformParams()
+{
+    transform_params.mvp = proj_matrix;
+    gl_M4_MulLeft(&transform_params.mvp, &model_matrix);
+    transform_params.viewport_x0 = viewport_x0;
+    transform_params.viewport_y0 = viewport_y0;
+    transform_params.viewport_size_x = viewport_size_x;
+    transform_params.viewport_size_y = viewport_size_y;
+    transform_params.depth_fn2 = depthtest_fn2;
+    transform_params.depth_nf2 = depthtest_nf2;
+}
+
 void gl_print_matrix(M4 m) {
     int i;
 
@@ -228,9 +250,427 @@ void WriteVertexToFifoLighting(IoFifo &iofifo, Vec4 v, const Vec4 colors, const
     }
 }
 
-int main(int argc, char **argv) 
+// Polygon attributes passed to next stage as is
+struct Polygon
+{
+    uint32_t cmd;
+    Vec4 colors[3];
+    Vec4 colors2[3];
+    Vec3 normals[3];
+    Vec2 texcoord[3];
+};
+
+// Polygon command & vertices to next stage
+static void WritePolygon(IoFifo &iofifo, Polygon &poly, Vec4 vertex[3], Vec4 colors[3], Vec2 texcoord[3])
+{
+    bool do_normals = (poly.cmd == GPU_PIPE_CMD_POLY_VERTEX3N3);
+    bool do_texture = (poly.cmd == GPU_PIPE_CMD_POLY_VERTEX3TC);
+    
+    // Send relevant command
+    if (do_normals)
+        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4N3);
+    else if (do_texture)
+        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4TC);
+    else
+        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4);
+        
+    for (int v = 0; v < 3; ++v)
+    {
+        if (do_normals) 
+        {
+            Vec3 normal;
+            ProcessNormal(poly.normals[v], normal, nullptr);
+            WriteVertexToFifoLighting(iofifo, vertex[v], colors[v], poly.colors2[v], normal);
+        }
+        else
+            WriteVertexToFifo(iofifo, vertex[v], colors[v]);
+        
+        if (do_texture)
+        {    
+            iofifo.WriteToFifoFloat(texcoord[v][0]);
+            iofifo.WriteToFifoFloat(texcoord[v][1]);
+        }
+    }
+}
+
+// Write transformed polygon, clip coords are used only if it crosses W clipping plane
+static void EmitPolygon(IoFifo &iofifo, Polygon &poly, Vec4 clip[3], Vec4 window[3])
+{
+    int inside = 0;
+    for (int v = 0; v < 3; ++v)
+        inside += (clip[v][3] >= W_CLIPPING_PLANE);
+    
+    if (inside == 3)
+    {
+        WritePolygon(iofifo, poly, window, poly.colors, poly.texcoord);
+        return;
+    }
+    if (!inside)
+        return;
+    
+    Vec4 clip_polygon[3*2]; // maximum 2 polygons after clipping
+    Vec4 clip_colors[3*2]; 
+    Vec2 clip_texcoord[3*2];
+    for (int v = 0; v < 3; ++v)
+    { 
+        CopyV4(clip_polygon[v], clip[v]);
+        CopyV4(clip_colors[v], poly.colors[v]);
+        CopyV2(clip_texcoord[v], poly.texcoord[v]);
+    }
+    
+    int clipped_polygons = ClipPolygonOnWAxis(clip_polygon, clip_colors, clip_texcoord);
+    assert(clipped_polygons == 1 || clipped_polygons == 2);
+    
+    for (int i = 0; i < clipped_polygons; ++i)
+    {
+        for (int v = 0; v < 3; ++v)
+            ProcessVertexPostClip(clip_polygon[i*3 + v]);
+        WritePolygon(iofifo, poly, &clip_polygon[i*3], &clip_colors[i*3], &clip_texcoord[i*3]);
+    }
+}
+
+// Read vertex attributes of polygon cmd from input
+static void ReadVertexAttribs(IoFifo &iofifo, uint32_t cmd, Vec4 &color, Vec2 &texcoord, Vec4 &color2, Vec3 &normal)
+{
+    // four color floats per vertex
+    iofifo.ReadFloats(color, 4);
+
+    if (cmd == GPU_PIPE_CMD_POLY_VERTEX3TC)
+    {
+        // two texcoord floats per vertex
+        iofifo.ReadFloats(texcoord, 2);
+    }
+    else
+        texcoord[0] = texcoord[1] = 0;
+
+    if (cmd == GPU_PIPE_CMD_POLY_VERTEX3N3)
+    {
+        // four additional colors in case of lighting
+        iofifo.ReadFloats(color2, 4);
+            
+        // three coords per normal
+        iofifo.ReadFloats(normal, 3);
+    }
+}
+
+// Polygons are collected in batches, so their vertices could be transformed all
+// at once. Polygons entirely above W clipping plane get window coords from batch
+// transform, partially clipped ones are clipped & transformed one by one.
+class PolygonBatch
+{
+    static const uint32_t SIZE = VERTEX_BATCH_SIZE / 3;
+    
+    uint32_t n = 0;
+    Polygon polygons[SIZE];
+    VertexBatch vertices;
+    TransformKernel kernel;
+    
+    public:
+    void Init(SimdLevel simd)
+    {
+        kernel = SelectTransformKernel(simd);
+    }
+    
+    bool Full() const
+    {
+        return n == SIZE;
+    }
+    
+    // Read polygon of cmd from input
+    void Read(IoFifo &iofifo, uint32_t cmd)
+    {
+        Polygon &poly = polygons[n];
+        poly.cmd = cmd;
+        
+        // three vertices per polygon
+        for (int vertex = 0; vertex < 3; ++vertex)
+        {
+            // three coords per vertex
+            uint32_t i = n*3 + vertex;
+            vertices.x[i] = iofifo.ReadFromFifoFloat();
+            vertices.y[i] = iofifo.ReadFromFifoFloat();
+            vertices.z[i] = iofifo.ReadFromFifoFloat();
+            ReadVertexAttribs(iofifo, cmd, poly.colors[vertex], poly.texcoord[vertex], poly.colors2[vertex], poly.normals[vertex]);
+        }
+        n++;
+    }
+    
+    // Transform pending polygons & write them to next stage
+    void Flush(IoFifo &iofifo)
+    {
+        if (!n)
+            return;
+        kernel(vertices, transform_params, n*3);
+        
+        for (uint32_t i = 0; i < n; i++)
+        {
+            Vec4 clip[3], window[3];
+            for (int v = 0; v < 3; ++v)
+            {
+                uint32_t j = i*3 + v;
+                clip[v][0] = vertices.cx[j];
+                clip[v][1] = vertices.cy[j];
+                clip[v][2] = vertices.cz[j];
+                clip[v][3] = vertices.cw[j];
+                window[v][0] = vertices.sx[j];
+                window[v][1] = vertices.sy[j];
+                window[v][2] = vertices.sz[j];
+                window[v][3] = vertices.rw[j];
+            }
+            EmitPolygon(iofifo, polygons[i], clip, window);
+            iofifo.CommandDone(polygons[i].cmd);
+        }
+        n = 0;
+    }
+};
+
+// Indexed drawing: LOAD_VERTICES fills vertex slots, DRAW_INDEXED assembles
+// triangles from slots. Transformed slots are kept in post-transform cache.
+class IndexedVertices
 {
-    if (argc != 5)
+    struct Slot
+    {
+        uint32_t cmd;       // POLY_VERTEX3* command of vertex format
+        Vec3 pos;
+        Vec4 color;
+        Vec2 texcoord;
+        Vec4 color2;
+        Vec3 normal;
+    };
+    
+    Slot slots[GPU_VERTEX_SLOTS];
+    
+    public:
+    VertexCache cache;
+    
+    IndexedVertices(uint32_t cache_size, VertexCachePolicy policy) : cache(cache_size, policy) {}
+    
+    void Load(IoFifo &iofifo, uint32_t cmd)
+    {
+        const uint32_t formats[] = {GPU_PIPE_CMD_POLY_VERTEX3, GPU_PIPE_CMD_POLY_VERTEX3N3, GPU_PIPE_CMD_POLY_VERTEX3TC};
+        uint32_t args = (cmd >> 8) & 0xFF;
+        uint32_t header = iofifo.ReadFromFifo32();
+        uint32_t first = header & GPU_VERTEX_SLOT_MASK;
+        uint32_t format = header >> GPU_VERTEX_FORMAT_SHIFT;
+        assert(format < 3);
+        uint32_t poly_cmd = formats[format];
+        uint32_t words = ((poly_cmd >> 8) & 0xFF) / 3;
+        uint32_t count = (args - 1) / words;
+        assert((args - 1) % words == 0 && first + count <= GPU_VERTEX_SLOTS);
+        
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            Slot &s = slots[i];
+            s.cmd = poly_cmd;
+            iofifo.ReadFloats(s.pos, 3);
+            ReadVertexAttribs(iofifo, poly_cmd, s.color, s.texcoord, s.color2, s.normal);
+        }
+        cache.Invalidate(first, count);
+    }
+    
+    void Draw(IoFifo &iofifo, uint32_t cmd)
+    {
+        uint32_t words[0xFF];
+        uint32_t args = (cmd >> 8) & 0xFF;
+        iofifo.ReadWords(words, args);
+        uint32_t count = words[0];
+        assert(count % 3 == 0 && (count + 1) / 2 <= args - 1);
+        
+        for (uint32_t i = 0; i < count; i += 3)
+        {
+            Polygon poly;
+            Vec4 clip[3], window[3];
+            for (int v = 0; v < 3; ++v)
+            {
+                uint32_t index = (words[1 + (i + v) / 2] >> (((i + v) & 1) * 16)) & 0xFFFF;
+                assert(index < GPU_VERTEX_SLOTS);
+                Slot &s = slots[index];
+                
+                // coords are copied right away, next vertices could evict entry
+                VertexCache::Entry *e = cache.Lookup(index);
+                if (!e)
+                {
+                    e = &cache.Insert(index);
+                    TransformPoint(transform_params, s.pos[0], s.pos[1], s.pos[2], e->clip, e->window);
+                }
+                CopyV4(clip[v], e->clip);
+                CopyV4(window[v], e->window);
+                
+                poly.cmd = slots[index].cmd;
+                CopyV4(poly.colors[v], s.color);
+                CopyV2(poly.texcoord[v], s.texcoord);
+                CopyV4(poly.colors2[v], s.color2);
+                CopyV3(poly.normals[v], s.normal);
+            }
+            EmitPolygon(iofifo, poly, clip, window);
+        }
+        iofifo.CommandDone(cmd);
+    }
+};
+
+// GPU memory shared by parent process, it is mapped on first vertex buffer access
+class SharedMem
+{
+    int memfd = -1;
+    uint8_t* mmap_addr = nullptr;
+    size_t mmap_len = 0;
+    
+    void Map()
+    {
+        // same way as texturing does
+        struct stat st;
+        char fname[100];
+        snprintf(fname, 100, "/proc/%d/fd/3", getppid());
+        memfd = open(fname, O_RDONLY);
+        assert(memfd > 0);
+        assert(!fstat(memfd, &st));
+        mmap_len = st.st_size;
+        mmap_addr = (uint8_t*)mmap(NULL, mmap_len, PROT_READ, MAP_SHARED, memfd, 0);
+        assert(mmap_addr != MAP_FAILED);
+    }
+    
+    public:
+    ~SharedMem()
+    {
+        if (mmap_addr)
+        {
+            munmap(mmap_addr, mmap_len);
+            close(memfd);
+        }
+    }
+    
+    // Pointer to len bytes at offset of GPU memory
+    const uint8_t* Ptr(uint32_t off, uint32_t len)
+    {
+        if (!mmap_addr)
+            Map();
+        assert((size_t)off + len <= mmap_len);
+        return mmap_addr + off;
+    }
+};
+
+// Vertex buffer drawing: VERTEX_POINTER sets vertex arrays in GPU memory, DRAW_BUFFER
+// assembles triangles of vertices fetched from them. Transformed vertices are kept in
+// post-transform cache by vertex index during draw.
+class VertexBuffers
+{
+    struct Array
+    {
+        uint32_t addr;
+        uint32_t components;
+        uint32_t type;      // bytes per component
+        uint32_t stride;
+    };
+    
+    Array arrays[GPU_ARRAYS] = {};
+    SharedMem mem;
+    
+    // Fetch n floats of array element (missing components are zero)
+    void Fetch(uint32_t array, uint32_t vertex, float *v, uint32_t n)
+    {
+        const Array &a = arrays[array];
+        uint32_t components = std::min(a.components, n);
+        const uint8_t *p = mem.Ptr(a.addr + vertex*a.stride, components*a.type);
+        for (uint32_t c = 0; c < components; c++)
+        {
+            if (a.type == 1)
+                v[c] = p[c]/255.f;
+            else if (a.type == 2)
+                v[c] = ((const uint16_t*)p)[c];
+            else
+                memcpy(&v[c], p + c*4, 4);
+        }
+        for (uint32_t c = components; c < n; c++)
+            v[c] = 0;
+    }
+    
+    public:
+    void SetPointer(IoFifo &iofifo)
+    {
+        uint32_t params = iofifo.ReadFromFifo32();
+        uint32_t array = params & GPU_DRAW_FIELD_MASK;
+        assert(array < GPU_ARRAYS);
+        Array &a = arrays[array];
+        a.components = (params >> GPU_ARRAY_COMPONENTS_SHIFT) & GPU_DRAW_FIELD_MASK;
+        a.type = (params >> GPU_ARRAY_TYPE_SHIFT) & GPU_DRAW_FIELD_MASK;
+        assert(a.type == 1 || a.type == 2 || a.type == 4);
+        a.addr = iofifo.ReadFromFifo32();
+        a.stride = iofifo.ReadFromFifo32();
+    }
+    
+    void Draw(IoFifo &iofifo, uint32_t cmd, VertexCache &cache)
+    {
+        const uint32_t formats[] = {GPU_PIPE_CMD_POLY_VERTEX3, GPU_PIPE_CMD_POLY_VERTEX3N3, GPU_PIPE_CMD_POLY_VERTEX3TC};
+        uint32_t args = (cmd >> 8) & 0xFF;
+        uint32_t count = iofifo.ReadFromFifo32();
+        uint32_t params = iofifo.ReadFromFifo32();
+        uint32_t index_addr = iofifo.ReadFromFifo32();
+        uint32_t first = iofifo.ReadFromFifo32();
+        
+        uint32_t mode = params & GPU_DRAW_FIELD_MASK;
+        uint32_t index_size = (params >> GPU_DRAW_INDEX_SHIFT) & GPU_DRAW_FIELD_MASK;
+        uint32_t format = params >> GPU_VERTEX_FORMAT_SHIFT;
+        assert(format < 3 && (index_size == 0 || index_size == 1 || index_size == 2));
+        
+        // colors for all vertices are passed instead of color array
+        Polygon poly = {};
+        poly.cmd = formats[format];
+        uint32_t const_colors = args - 4;
+        assert(const_colors == 0 || const_colors == 4 || const_colors == 8);
+        Vec4 colors[2] = {};
+        iofifo.ReadFloats(&colors[0][0], const_colors);
+        
+        const uint8_t *indices = index_size ? mem.Ptr(index_addr, count*index_size) : nullptr;
+        
+        // cache entries are tagged with vertex indices till the end of draw
+        cache.Invalidate();
+        uint32_t triangles = GpuPrimTriangles(mode, count);
+        for (uint32_t t = 0; t < triangles; t++)
+        {
+            uint32_t e[3];
+            GpuPrimTriangle(mode, t, e);
+            Vec4 clip[3], window[3];
+            for (int v = 0; v < 3; ++v)
+            {
+                uint32_t vertex = first + e[v];
+                if (index_size == 1)
+                    vertex = indices[e[v]];
+                else if (index_size == 2)
+                    vertex = ((const uint16_t*)indices)[e[v]];
+                
+                VertexCache::Entry *entry = cache.Lookup(vertex);
+                if (!entry)
+                {
+                    Vec3 pos;
+                    Fetch(GPU_ARRAY_VERTEX, vertex, pos, 3);
+                    entry = &cache.Insert(vertex);
+                    TransformPoint(transform_params, pos[0], pos[1], pos[2], entry->clip, entry->window);
+                }
+                CopyV4(clip[v], entry->clip);
+                CopyV4(window[v], entry->window);
+                
+                if (const_colors)
+                    CopyV4(poly.colors[v], colors[0]);
+                else
+                    Fetch(GPU_ARRAY_COLOR, vertex, poly.colors[v], 4);
+                if (poly.cmd == GPU_PIPE_CMD_POLY_VERTEX3N3)
+                {
+                    CopyV4(poly.colors2[v], colors[1]);
+                    Fetch(GPU_ARRAY_NORMAL, vertex, poly.normals[v], 3);
+                }
+                if (poly.cmd == GPU_PIPE_CMD_POLY_VERTEX3TC)
+                    Fetch(GPU_ARRAY_TEXCOORD, vertex, poly.texcoord[v], 2);
+            }
+            EmitPolygon(iofifo, poly, clip, window);
+        }
+        cache.Invalidate();
+        iofifo.CommandDone(cmd);
+    }
+};
+
+STAGE_MAIN(int argc, char **argv)
+{
+    if (argc < 5)
     {
         puts("Wrong parameters!");
         return 1;
@@ -245,7 +685,8 @@ int main(int argc, char **argv)
     depthtest_nf2 = 0.5;
         
     // Open output FIFO
-    IoFifo iofifo(argv[3], argv[4]);
+    StageOptions options(argc, argv);
+    IoFifo iofifo(argv[3], argv[4], options);
     
     // Create matrixes
     #if TEST_MATRIXES
@@ -285,156 +726,65 @@ int main(int argc, char **argv)
     gl_print_matrix(model_matrix);
     #endif
     
+    // transform kernel is selected with simd option
+    PolygonBatch *batch = new PolygonBatch;
+    batch->Init(SimdSelect(options));
+    UpdateTransformParams();
+    
+    // vertex_cache=<entries> sets size of post-transform cache of indexed drawing (0 disables it),
+    // vertex_cache_policy=fifo|lru, vertex_cache_stats=<print every N syncs>
+    VertexCachePolicy policy = VERTEX_CACHE_FIFO;
+    std::string policy_name = options.Get("vertex_cache_policy", "fifo");
+    if (policy_name == "lru")
+        policy = VERTEX_CACHE_LRU;
+    else if (policy_name != "fifo")
+        std::cerr << "Unknown vertex cache policy " << policy_name << std::endl;
+    IndexedVertices *indexed = new IndexedVertices(options.GetInt("vertex_cache", 32), policy);
+    long vertex_cache_stats = options.GetInt("vertex_cache_stats", 0);
+    VertexBuffers *buffers = new VertexBuffers;
+    uint64_t sync_count = 0;
+    
     while (1)
     {
-        bool do_normals = false;
-        bool do_texture = false;
+        // polygons are written when batch is full or there is nothing else to do
+        if (!iofifo.InputReady())
+            batch->Flush(iofifo);
         uint32_t cmd = iofifo.ReadFromFifo32();
+        bool polygon = (cmd == GPU_PIPE_CMD_POLY_VERTEX3) || (cmd == GPU_PIPE_CMD_POLY_VERTEX3TC) || (cmd == GPU_PIPE_CMD_POLY_VERTEX3N3);
+        if (!polygon)
+            batch->Flush(iofifo);
 
         switch (cmd)
         {
             case GPU_PIPE_CMD_POLY_VERTEX3N3:
-                do_normals = true;
-                goto v3;
             case GPU_PIPE_CMD_POLY_VERTEX3TC:
-                do_texture = true;
             case GPU_PIPE_CMD_POLY_VERTEX3:
             {
-                v3:
-                // Read input vertices & colors
-                Vec3 vertices[3];
-                Vec4 colors[3];
-                Vec4 colors2[3];
-                Vec3 normals[3];
-                Vec2 texcoord[3];
-                
-                // three vertices per polygon
-                for (int vertex = 0; vertex < 3; ++vertex)
-                {
-                    // three coords per vertex
-                    for (int i = 0; i < 3; ++i)
-                        vertices[vertex][i] = iofifo.ReadFromFifoFloat();
-
-                    // four color floats per vertex
-                    for (int i = 0; i < 4; ++i)
-                        colors[vertex][i] = iofifo.ReadFromFifoFloat();
-
-                    if (do_texture)
-                    {
-                        // two texcoord floats per vertex
-                        for (int i = 0; i < 2; ++i)
-                            texcoord[vertex][i] = iofifo.ReadFromFifoFloat();
-                    }
-
-                    if (do_normals)
-                    {
-                        // four additional colors in case of lighting
-                        for (int i = 0; i < 4; ++i)
-                            colors2[vertex][i] = iofifo.ReadFromFifoFloat();
-                            
-                        // three coords per normal
-                        for (int i = 0; i < 3; ++i)
-                            normals[vertex][i] = iofifo.ReadFromFifoFloat();
-                    }
-                }
-
-                Vec4 polygon[3];
-
-                // Process polygon vertices (pre-clipping)
-                for (int v = 0; v < 3; ++v)
-                    ProcessVertexMatMul(vertices[v], polygon[v]);
-                
-                // Clip polygons    
-                Vec4 clip_polygon[3*2]; // maximum 2 polygons after clipping
-                Vec4 clip_colors[3*2]; 
-                Vec2 clip_texcoord[3*2];
-                for (int v = 0; v < 3; ++v)
-                { 
-                    CopyV4(clip_polygon[v], polygon[v]);
-                    CopyV4(clip_colors[v], colors[v]);
-                    CopyV2(clip_texcoord[v], texcoord[v]);
-                }
-                                        
-                int clipped_polygons;
-                if (!(clipped_polygons = ClipPolygonOnWAxis(clip_polygon, clip_colors, clip_texcoord)))
-                    continue;
-                assert(clipped_polygons == 1 || clipped_polygons == 2);
-                
-                // Process clipped polygons
-                for (int i = 0; i < clipped_polygons; ++i)
-                {
-                    for (int v = 0; v < 3; ++v)
-                    {
-                       CopyV4(polygon[v], clip_polygon[i*3 + v]);
-                       CopyV4(colors[v], clip_colors[i*3 + v]);
-                       CopyV2(texcoord[v], clip_texcoord[i*3 + v]);
-                    }
-                        
-                    // Send relevant command
-                    if (do_normals)
-                        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4N3);
-                    else if (do_texture)
-                        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4TC);
-                    else
-                        iofifo.WriteToFifo32(GPU_PIPE_CMD_POLY_VERTEX4);
-                        
-                    // Pass resulting vertices to next stage
-                    for (int v = 0; v < 3; ++v)
-                    {
-                        ProcessVertexPostClip(polygon[v]);
-                        
-                        if (do_normals) 
-                        {
-                            Vec3 normal;
-                            ProcessNormal(normals[v], normal, nullptr);
-                            WriteVertexToFifoLighting(iofifo, polygon[v], colors[v], colors2[v], normal);
-                        }
-                        else
-                            WriteVertexToFifo(iofifo, polygon[v], colors[v]);
-                        
-                        if (do_texture)
-                        {    
-                            iofifo.WriteToFifoFloat(texcoord[v][0]);
-                            iofifo.WriteToFifoFloat(texcoord[v][1]);
-                        }
-                    }
-                }
-                
-                #if 0
-                for (int j = 0; j < 4; ++j) printf("%f ", v0[j]);
-                printf("\n");
-                for (int j = 0; j < 4; ++j) printf("%f ", v1[j]);
-                printf("\n");
-                for (int j = 0; j < 4; ++j) printf("%f ", v2[j]);
-                printf("\n\n");
-                #endif
-                
-                iofifo.Flush();
-                
+                batch->Read(iofifo, cmd);
+                if (batch->Full())
+                    batch->Flush(iofifo);
                 break;
             }
 
             case GPU_PIPE_CMD_MODEL_MATRIX:
             {
-                for (int i = 0; i < 4; ++i)
-                    for (int j = 0; j < 4; ++j)
-                        model_matrix.m[i][j] = iofifo.ReadFromFifoFloat();
+                iofifo.ReadFloats(&model_matrix.m[0][0], 16);
+                UpdateTransformParams();
+                indexed->cache.Invalidate();
                 break;
             }
             
             case GPU_PIPE_CMD_PROJ_MATRIX:
             {
-                for (int i = 0; i < 4; ++i)
-                    for (int j = 0; j < 4; ++j)
-                        proj_matrix.m[i][j] = iofifo.ReadFromFifoFloat();
+                iofifo.ReadFloats(&proj_matrix.m[0][0], 16);
+                UpdateTransformParams();
+                indexed->cache.Invalidate();
                 break;
             }
             
             case GPU_PIPE_CMD_NORMAL_MATRIX:
             {
-                for (int i = 0; i < 4; ++i)
-                    for (int j = 0; j < 4; ++j)
-                        normal_matrix.m[i][j] = iofifo.ReadFromFifoFloat();
+                iofifo.ReadFloats(&normal_matrix.m[0][0], 16);
                 break;
             }
             
@@ -446,11 +796,44 @@ int main(int argc, char **argv)
                 viewport_size_y = iofifo.ReadFromFifoFloat();
                 depthtest_fn2 = iofifo.ReadFromFifoFloat();
                 depthtest_nf2 = iofifo.ReadFromFifoFloat();
+                UpdateTransformParams();
+                indexed->cache.Invalidate();
+                break;
+            }
+            
+            case GPU_PIPE_CMD_SYNC:
+            {
+                if (vertex_cache_stats && (++sync_count % vertex_cache_stats) == 0)
+                    indexed->cache.PrintStats();
+                iofifo.BypassCmd(cmd);
+                break;
+            }
+            
+            case GPU_PIPE_CMD_VERTEX_POINTER:
+            {
+                buffers->SetPointer(iofifo);
                 break;
             }
             
             default:
             {
+                // indexed drawing commands have variable number of arguments
+                if ((cmd & GPU_PIPE_CMD_CODE_MASK) == GPU_PIPE_CMD_LOAD_VERTICES)
+                {
+                    indexed->Load(iofifo, cmd);
+                    break;
+                }
+                if ((cmd & GPU_PIPE_CMD_CODE_MASK) == GPU_PIPE_CMD_DRAW_INDEXED)
+                {
+                    indexed->Draw(iofifo, cmd);
+                    break;
+                }
+                if ((cmd & GPU_PIPE_CMD_CODE_MASK) == GPU_PIPE_CMD_DRAW_BUFFER)
+                {
+                    buffers->Draw(iofifo, cmd, indexed->cache);
+                    break;
+                }
+                
                 // just pass to next stage everything but polygon vertices & matrix commands
                 //printf("vertex bypass %X\n", cmd);
                 assert((cmd & 0xFFFF0000) == 0xFFFF0000);
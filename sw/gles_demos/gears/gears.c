@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 //#include "window.h"
 
 #define MAX_CONFIGS 10
@@ -119,7 +120,7 @@ typedef struct {
   GLshort *indices;
   GLfloat color[4];
   int nvertices, nindices;
-  GLuint ibo;
+  GLuint vbo, ibo;
 } gear_t;
 
 static gear_t *red_gear;
@@ -300,6 +301,16 @@ gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
     INDEX(ix1, ix3, ix2);
   }
 
+  /* static geometry is kept in buffer objects */
+  glGenBuffers(1, &gear->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+  glBufferData(GL_ARRAY_BUFFER, gear->nvertices * sizeof(vertex_t), gear->vertices, GL_STATIC_DRAW);
+  glGenBuffers(1, &gear->ibo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, gear->nindices * sizeof(GLshort), gear->indices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
   return gear;
 }
 
@@ -307,10 +318,13 @@ gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
 void draw_gear(gear_t* gear) {
 
   glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, gear->color);
-  glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), gear->vertices[0].pos);
-  glNormalPointer(GL_FLOAT, sizeof(vertex_t), gear->vertices[0].norm);
-  glDrawElements(GL_TRIANGLES, gear->nindices/3, GL_UNSIGNED_SHORT,
-                   gear->indices);
+  glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+  glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), (const void*)offsetof(vertex_t, pos));
+  glNormalPointer(GL_FLOAT, sizeof(vertex_t), (const void*)offsetof(vertex_t, norm));
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+  glDrawElements(GL_TRIANGLES, gear->nindices/3, GL_UNSIGNED_SHORT, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 static GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
@@ -4,6 +4,7 @@
 #include <cmath>
 
 #include "GLES/gl.h"
+#include "GLES/glext.h"
 #include "EGL/egl.h"
 #include "oglory_gpu_defs.hh"
 #include <pseudogl.hh>
@@ -112,6 +113,33 @@ static uint8_t ConvBlendFunc(const uint f)
     }
 }
 
+static uint ConvTexFilter(const uint f)
+{
+    switch(f)
+    {
+        case(GL_NEAREST): return TEXFILTER_NEAREST;
+        case(GL_LINEAR): return TEXFILTER_LINEAR;
+        case(GL_NEAREST_MIPMAP_NEAREST): return TEXFILTER_NEAREST_MIPMAP_NEAREST;
+        case(GL_LINEAR_MIPMAP_NEAREST): return TEXFILTER_LINEAR_MIPMAP_NEAREST;
+        case(GL_NEAREST_MIPMAP_LINEAR): return TEXFILTER_NEAREST_MIPMAP_LINEAR;
+        case(GL_LINEAR_MIPMAP_LINEAR): return TEXFILTER_LINEAR_MIPMAP_LINEAR;
+        default: assert(false); // unsupported texture filter
+    }
+}
+
+// Texture parameters, only filters are supported (wrap mode is always GL_REPEAT)
+static void SetTexParameter(GLenum target, GLenum pname, GLint param)
+{
+    assert(target == GL_TEXTURE_2D);
+    if (pname == GL_TEXTURE_MIN_FILTER)
+        context.SetTextureFilter(true, ConvTexFilter(param));
+    else if (pname == GL_TEXTURE_MAG_FILTER)
+    {
+        assert(param == GL_NEAREST || param == GL_LINEAR);
+        context.SetTextureFilter(false, ConvTexFilter(param));
+    }
+}
+
 // OpenGL ES functions
 
 GL_API void GL_APIENTRY glAlphaFunc (GLenum func, GLfloat ref)
@@ -347,7 +375,7 @@ GL_API void GL_APIENTRY glTexEnvf (GLenum target, GLenum pname, GLfloat param)
 
 GL_API void GL_APIENTRY glTexParameterf (GLenum target, GLenum pname, GLfloat param)
 {
-    STUB(); 
+    SetTexParameter(target, pname, (GLint)param);
 }
 
 GL_API void GL_APIENTRY glTranslatef (GLfloat x, GLfloat y, GLfloat z)
@@ -365,6 +393,12 @@ GL_API void GL_APIENTRY glActiveTexture (GLenum texture)
     // assert(texture == GL_TEXTURE0);
 }
 
+GL_API void GL_APIENTRY glBindBuffer (GLenum target, GLuint buffer)
+{
+    assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+    context.BindBuffer(target == GL_ELEMENT_ARRAY_BUFFER, buffer);
+}
+
 GL_API void GL_APIENTRY glBindTexture (GLenum target, GLuint texture)
 {
     STUB(); 
@@ -376,6 +410,21 @@ GL_API void GL_APIENTRY glBlendFunc (GLenum sfactor, GLenum dfactor)
     context.SetBlendFunc({ConvBlendFunc(sfactor), ConvBlendFunc(dfactor)});
 }
 
+GL_API void GL_APIENTRY glBufferData (GLenum target, GLsizeiptr size, const void *data, GLenum usage)
+{
+    // usage hint is ignored, all buffers are in GPU memory
+    assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+    assert(size >= 0);
+    context.BufferData(target == GL_ELEMENT_ARRAY_BUFFER, data, size);
+}
+
+GL_API void GL_APIENTRY glBufferSubData (GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+{
+    assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+    assert(offset >= 0 && size >= 0);
+    context.BufferSubData(target == GL_ELEMENT_ARRAY_BUFFER, data, offset, size);
+}
+
 GL_API void GL_APIENTRY glClear (GLbitfield mask)
 {
     assert(!(mask & ~(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT)));
@@ -400,7 +449,14 @@ GL_API void GL_APIENTRY glColorPointer(GLint size, GLenum type, GLsizei stride,
 GL_API void GL_APIENTRY glCompressedTexImage2D (GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const void *data)
 {
     STUB(); 
-    assert(false);
+    assert(target == GL_TEXTURE_2D);
+    assert(internalformat == GL_ETC1_RGB8_OES);     // the only supported compressed format
+    assert(border == 0);
+    
+    if (!level)
+        context.AllocTexture(internalformat, GL_UNSIGNED_BYTE, width, height);
+    if (data)
+        context.LoadCompressedTexture((const uint8_t*)data, imageSize, level);
 }
 
 GL_API void GL_APIENTRY glCullFace (GLenum mode)
@@ -421,6 +477,12 @@ GL_API void GL_APIENTRY glCullFace (GLenum mode)
     }
 }
 
+GL_API void GL_APIENTRY glDeleteBuffers (GLsizei n, const GLuint *buffers)
+{
+    for (int i = 0; i < n; i++) 
+        context.DeleteBuffer(buffers[i]);
+}
+
 GL_API void GL_APIENTRY glDeleteTextures (GLsizei n, const GLuint *textures)
 {
     STUB(); 
@@ -487,6 +549,12 @@ GL_API void GL_APIENTRY glFrontFace (GLenum mode)
     context.SetFrontFace(mode == GL_CCW);
 }
 
+GL_API void GL_APIENTRY glGenBuffers (GLsizei n, GLuint *buffers)
+{
+    for (int i = 0; i < n; i++) 
+        buffers[i] = context.GenBuffer();
+}
+
 GL_API void GL_APIENTRY glGenTextures (GLsizei n, GLuint *textures)
 {
     for (int i = 0; i < n; i++) 
@@ -586,12 +654,21 @@ GL_API void GL_APIENTRY glTexImage2D (GLenum target, GLint level, GLint internal
 {
     STUB();
     assert(target == GL_TEXTURE_2D);
-    if (level)
-        return;
     // assert(format == internalformat);
     assert(border == 0);
     
-    context.AllocTexture(format, width, height);
+    if (level)
+    {
+        // explicit mipmap level replaces generated ones
+        if (pixels)
+        {
+            context.SetTexture(format, type);
+            context.LoadTexture((const uint8_t*)pixels, 0, 0, width, height, level);
+        }
+        return;
+    }
+    
+    context.AllocTexture(format, type, width, height);
     context.SetTexture(format, type);
 
     if (pixels)
@@ -602,19 +679,17 @@ GL_API void GL_APIENTRY glTexImage2D (GLenum target, GLint level, GLint internal
 
 GL_API void GL_APIENTRY glTexParameteri (GLenum target, GLenum pname, GLint param)
 {
-    STUB();
+    SetTexParameter(target, pname, param);
 }
 
 GL_API void GL_APIENTRY glTexSubImage2D (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void *pixels)
 {
     STUB(); 
     assert(target == GL_TEXTURE_2D);
-    if (level)
-        return;
     assert(pixels);
 
     context.SetTexture(format, type);
-    context.LoadTexture((const uint8_t*)pixels, xoffset, yoffset, width, height);
+    context.LoadTexture((const uint8_t*)pixels, xoffset, yoffset, width, height, level);
 }
 
 GL_API void GL_APIENTRY glVertexPointer (GLint size, GLenum type, GLsizei stride, const void *pointer)
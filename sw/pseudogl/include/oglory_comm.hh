@@ -14,8 +14,14 @@ uint32_t oglory_csr_read32(uint32_t addr);
 void oglory_csr_write32(uint32_t val, uint32_t addr);
 uint32_t oglory_reg_read32(uint32_t addr);
 void oglory_reg_write32(uint32_t val, uint32_t addr);
+void oglory_reg_snapshot(const uint32_t *addrs, uint32_t *vals, int count);
+// Polling of registers which could keep several reads in flight, addrs should be valid till stop
+void oglory_reg_poll_start(const uint32_t *addrs, int count);
+void oglory_reg_poll_next(uint32_t *vals);
+void oglory_reg_poll_stop();
 uint32_t oglory_mem_read32(uint32_t addr);
 void oglory_mem_write32(uint32_t val, uint32_t addr);
+void oglory_mem_read(uint32_t *buf, int count, uint32_t addr);
 void oglory_mem_write(uint32_t *buf, int count, uint32_t addr);
 
 void oglory_hardware_init(uint32_t capabilities);
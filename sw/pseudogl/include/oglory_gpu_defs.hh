@@ -16,6 +16,10 @@ const uint32_t GPU_PIPE_CMD_CLEAR_FB        = 0xFFFF0011;
 const uint32_t GPU_PIPE_CMD_CLEAR_ZB        = 0xFFFF0012;
 const uint32_t GPU_PIPE_CMD_FRAGMENT        = 0xFFFF0320;
 const uint32_t GPU_PIPE_CMD_TEXFRAGMENT     = 0xFFFF0421;
+const uint32_t GPU_PIPE_CMD_SPAN_SETUP      = 0xFFFF1622;
+const uint32_t GPU_PIPE_CMD_TEXSPAN_SETUP   = 0xFFFF1323;
+const uint32_t GPU_PIPE_CMD_SPAN            = 0xFFFF0524;
+const uint32_t GPU_PIPE_CMD_COLORSPAN       = 0xFFFF0025;   // number of arguments is 1 + number of pixels
 const uint32_t GPU_PIPE_CMD_MODEL_MATRIX    = 0xFFFF1030;
 const uint32_t GPU_PIPE_CMD_PROJ_MATRIX     = 0xFFFF1031;
 const uint32_t GPU_PIPE_CMD_NORMAL_MATRIX   = 0xFFFF1035;
@@ -26,7 +30,15 @@ const uint32_t GPU_PIPE_CMD_VIEWPORT_PARAMS = 0xFFFF0650;
 const uint32_t GPU_PIPE_CMD_LIGHT_PARAMS    = 0xFFFF0851;
 const uint32_t GPU_PIPE_CMD_BLEND_PARAMS    = 0xFFFF0152;
 const uint32_t GPU_PIPE_CMD_BINDTEXTURE     = 0xFFFF0260;
+const uint32_t GPU_PIPE_CMD_TEXPARAMS       = 0xFFFF0161;   // follows BINDTEXTURE if GPU_CAP_TEXPARAMS is set
+const uint32_t GPU_PIPE_CMD_LOAD_VERTICES   = 0xFFFF0003;   // number of arguments is 1 + vertex words, requires GPU_CAP_INDEXED
+const uint32_t GPU_PIPE_CMD_DRAW_INDEXED    = 0xFFFF0004;   // number of arguments is 1 + index words, requires GPU_CAP_INDEXED
+const uint32_t GPU_PIPE_CMD_VERTEX_POINTER  = 0xFFFF0305;   // requires GPU_CAP_VERTEX_BUFFERS
+const uint32_t GPU_PIPE_CMD_DRAW_BUFFER     = 0xFFFF0006;   // number of arguments is 4 + constant attribute words, requires GPU_CAP_VERTEX_BUFFERS
 const uint32_t GPU_PIPE_CMD_NOP             = 0xFFFF00F0;
+const uint32_t GPU_PIPE_CMD_FRAME_END       = 0xFFFF00F1;   // emulator only: injected on frame switch if fragment ops exports framebuffer
+const uint32_t GPU_PIPE_CMD_CODE_MASK       = 0xFFFF00FF;   // for commands with variable number of arguments
+const uint32_t GPU_PIPE_COLORSPAN_MAX       = 254;
 
 
 // Addresses
@@ -66,6 +78,10 @@ const uint32_t GPU_STAT_FLUSH_MASK          = 0x07;
 const uint32_t GPU_CAP_VIDEODMA             = 0x00000001;   // requires video DMA init
 const uint32_t GPU_CAP_TEXTURING            = 0x000000F0;   // number of texturing units
 const uint32_t GPU_CAP_LIGHTING             = 0x00000100;   // has lighting support
+const uint32_t GPU_CAP_TEXPARAMS            = 0x00000200;   // texturing supports TEXPARAMS command
+const uint32_t GPU_CAP_TEXFORMATS           = 0x00000400;   // texturing samples compact texel formats (TEXPARAMS format field)
+const uint32_t GPU_CAP_INDEXED              = 0x00000800;   // vertex transform draws indexed triangles (LOAD_VERTICES & DRAW_INDEXED)
+const uint32_t GPU_CAP_VERTEX_BUFFERS       = 0x00001000;   // vertex transform fetches vertices from memory (VERTEX_POINTER & DRAW_BUFFER)
 const uint32_t GPU_CAP_ADV7511              = 0x00010000;   // video output via ADV7511, requires I2C init
 const uint32_t GPU_CAP_SDRAMINIT            = 0x00020000;   // requires manual SDRAM init
 
@@ -85,6 +101,30 @@ const uint32_t GPU_STATE_FRAG_BLENDDF_SHIFT = 16;
 
 const uint32_t GPU_STATE_LIGHT_ENABLE       = 0x00000001;
 
+const uint32_t GPU_TEXPARAM_LAYOUT_MASK     = 0x0000000F;
+const uint32_t GPU_TEXPARAM_MINF_SHIFT      = 4;
+const uint32_t GPU_TEXPARAM_MAGF_SHIFT      = 8;
+const uint32_t GPU_TEXPARAM_LEVELS_SHIFT    = 12;   // number of mipmap levels after base one
+const uint32_t GPU_TEXPARAM_FORMAT_SHIFT    = 16;
+const uint32_t GPU_TEXPARAM_FIELD_MASK      = 0x0000000F;
+
+// LOAD_VERTICES first argument is first vertex slot & vertex format (code of POLY_VERTEX3* command),
+// other arguments are vertices in POLY_VERTEX3* format. DRAW_INDEXED first argument is number of
+// indices (triangle list), others are 16 bit slot indices packed two per word (first one in low half).
+const uint32_t GPU_VERTEX_SLOTS             = 1024;
+const uint32_t GPU_VERTEX_SLOT_MASK         = 0x0000FFFF;
+const uint32_t GPU_VERTEX_FORMAT_SHIFT      = 16;
+
+// VERTEX_POINTER arguments are array (GPU_ARRAY_*) | components << 8 | component bytes << 16 (1 - normalized
+// unsigned byte, 2 - unsigned short, 4 - float), array address & stride in bytes. DRAW_BUFFER arguments are
+// number of indices, mode (GPU_PRIM_*) | index bytes << 8 (0 - no index array) | vertex format << 16, index
+// array address & first vertex (for no index array). Other arguments are colors of all vertices (4 or 8
+// for lighting) used instead of color array.
+const uint32_t GPU_ARRAY_COMPONENTS_SHIFT   = 8;
+const uint32_t GPU_ARRAY_TYPE_SHIFT         = 16;
+const uint32_t GPU_DRAW_INDEX_SHIFT         = 8;
+const uint32_t GPU_DRAW_FIELD_MASK          = 0x000000FF;
+
 // Blending function enum
 enum
 {
@@ -101,5 +141,275 @@ enum
     BLENDF_SRC_ALPHA_SATURATE
 };
 
+// Vertex array enum
+enum
+{
+    GPU_ARRAY_VERTEX,
+    GPU_ARRAY_COLOR,
+    GPU_ARRAY_NORMAL,
+    GPU_ARRAY_TEXCOORD,
+    
+    GPU_ARRAYS
+};
+
+// Primitive enum
+enum
+{
+    GPU_PRIM_TRIANGLES,
+    GPU_PRIM_TRIANGLE_STRIP,
+    GPU_PRIM_TRIANGLE_FAN
+};
+
+// Texture memory layout enum
+enum
+{
+    TEXLAYOUT_LINEAR,       // row-major texels (default after BINDTEXTURE)
+    TEXLAYOUT_MORTON,       // Z-order inside squares of smaller texture side, squares go in a row (power of two sizes)
+    TEXLAYOUT_TILED         // row-major 4x4 texel blocks, row-major texels inside block (sizes multiple of 4)
+};
+
+// Texture filter enum (min filter could use all, mag filter only first two)
+enum
+{
+    TEXFILTER_NEAREST,
+    TEXFILTER_LINEAR,
+    TEXFILTER_NEAREST_MIPMAP_NEAREST,
+    TEXFILTER_LINEAR_MIPMAP_NEAREST,
+    TEXFILTER_NEAREST_MIPMAP_LINEAR,
+    TEXFILTER_LINEAR_MIPMAP_LINEAR
+};
+
+// Texel format enum, texels are little endian words of format size
+enum
+{
+    TEXFORMAT_RGBA8,        // R in low byte, A in high byte (default after BINDTEXTURE)
+    TEXFORMAT_RGB565,       // R in high bits, B in low bits (GL_UNSIGNED_SHORT_5_6_5)
+    TEXFORMAT_RGBA4444,     // R in high bits, A in low bits (GL_UNSIGNED_SHORT_4_4_4_4)
+    TEXFORMAT_L8,           // luminance
+    TEXFORMAT_LA88,         // luminance in low byte, alpha in high byte
+    TEXFORMAT_ETC1          // ETC1 4x4 blocks of 8 bytes in row-major order, texture layout isn't used
+};
+
+static inline uint32_t GpuTexelBytes(uint32_t format)
+{
+    switch (format)
+    {
+        case TEXFORMAT_RGB565:
+        case TEXFORMAT_RGBA4444:
+        case TEXFORMAT_LA88:
+            return 2;
+        case TEXFORMAT_L8:
+            return 1;
+        default:
+            return 4;
+    }
+}
+
+// ETC1 block (64 bit big endian word) to 16 RGBA8 texels, texels[y * 4 + x]
+static inline void GpuEtc1DecodeBlock(const uint8_t *p, uint32_t texels[16])
+{
+    static const int modifiers[8][2] = {{2, 8}, {5, 17}, {9, 29}, {13, 42}, {18, 60}, {24, 80}, {33, 106}, {47, 183}};
+    uint32_t hi = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    uint32_t lo = ((uint32_t)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    bool flip = hi & 1;
+    bool diff = hi & 2;
+
+    // base colors of sub-blocks
+    int base[2][3];
+    for (int c = 0; c < 3; c++)
+    {
+        uint32_t shift = 24 - c * 8;
+        if (diff)
+        {
+            int c1 = (hi >> (shift + 3)) & 0x1F;
+            int d = (int)(((hi >> shift) & 0x7) << 29) >> 29;   // 3 bit signed delta
+            int c2 = (c1 + d) & 0x1F;
+            base[0][c] = (c1 << 3) | (c1 >> 2);
+            base[1][c] = (c2 << 3) | (c2 >> 2);
+        }
+        else
+        {
+            base[0][c] = ((hi >> (shift + 4)) & 0xF) * 17;
+            base[1][c] = ((hi >> shift) & 0xF) * 17;
+        }
+    }
+    const int *table[2] = {modifiers[(hi >> 5) & 7], modifiers[(hi >> 2) & 7]};
+
+    for (int x = 0; x < 4; x++)
+    {
+        for (int y = 0; y < 4; y++)
+        {
+            // pixel indices go by columns, MSBs in high half of low word
+            int i = x * 4 + y;
+            int msb = (lo >> (16 + i)) & 1;
+            int lsb = (lo >> i) & 1;
+            int sub = flip ? (y >= 2) : (x >= 2);
+            int m = table[sub][lsb];
+            if (msb)
+                m = -m;
+            uint32_t color = 0xFF000000;
+            for (int c = 0; c < 3; c++)
+            {
+                int v = base[sub][c] + m;
+                color |= (uint32_t)(v < 0 ? 0 : (v > 255 ? 255 : v)) << (c * 8);
+            }
+            texels[y * 4 + x] = color;
+        }
+    }
+}
+
+// Texel of given format at p to RGBA8 (R in low byte), channels are expanded as c * 255 / max
+static inline uint32_t GpuDecodeTexel(const uint8_t *p, uint32_t format)
+{
+    switch (format)
+    {
+        case TEXFORMAT_RGB565:
+        {
+            uint32_t t = p[0] | (p[1] << 8);
+            uint32_t r = ((t >> 11) & 0x1F) * 255 / 31;
+            uint32_t g = ((t >>  5) & 0x3F) * 255 / 63;
+            uint32_t b = ((t >>  0) & 0x1F) * 255 / 31;
+            return r | (g << 8) | (b << 16) | 0xFF000000;
+        }
+        case TEXFORMAT_RGBA4444:
+        {
+            uint32_t t = p[0] | (p[1] << 8);
+            uint32_t r = ((t >> 12) & 0xF) * 17;
+            uint32_t g = ((t >>  8) & 0xF) * 17;
+            uint32_t b = ((t >>  4) & 0xF) * 17;
+            uint32_t a = ((t >>  0) & 0xF) * 17;
+            return r | (g << 8) | (b << 16) | (a << 24);
+        }
+        case TEXFORMAT_L8:
+            return p[0] * 0x010101 | 0xFF000000;
+        case TEXFORMAT_LA88:
+            return p[0] * 0x010101 | (p[1] << 24);
+        default:
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+}
+
+// RGBA8 texel to format at p, decoding gives the same value for texels decoded from format
+static inline void GpuEncodeTexel(uint32_t c, uint8_t *p, uint32_t format)
+{
+    uint32_t r = c & 0xFF, g = (c >> 8) & 0xFF, b = (c >> 16) & 0xFF, a = c >> 24;
+    uint32_t t;
+    switch (format)
+    {
+        case TEXFORMAT_RGB565:
+            t = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            break;
+        case TEXFORMAT_RGBA4444:
+            t = ((r >> 4) << 12) | ((g >> 4) << 8) | ((b >> 4) << 4) | (a >> 4);
+            break;
+        case TEXFORMAT_L8:
+            p[0] = r;
+            return;
+        case TEXFORMAT_LA88:
+            t = r | (a << 8);
+            break;
+        default:
+            p[0] = r;
+            p[1] = g;
+            p[2] = b;
+            p[3] = a;
+            return;
+    }
+    p[0] = t & 0xFF;
+    p[1] = t >> 8;
+}
+
+// Spread low 16 bits of v to even bit positions
+static inline uint32_t GpuMortonSpread(uint32_t v)
+{
+    v &= 0x0000FFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Index of texel (x, y) in texture of width w & height h stored with given layout
+static inline uint32_t GpuTexelIndex(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t layout)
+{
+    switch (layout)
+    {
+        case TEXLAYOUT_MORTON:
+        {
+            uint32_t shift = __builtin_ctz(w < h ? w : h);
+            uint32_t mask = (1u << shift) - 1;
+            uint32_t square = (x >> shift) + (y >> shift);
+            return (GpuMortonSpread(x & mask) | (GpuMortonSpread(y & mask) << 1)) + (square << (shift * 2));
+        }
+        case TEXLAYOUT_TILED:
+            return (((y >> 2) * (w >> 2) + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+        default:
+            return y * w + x;
+    }
+}
+
+// Mipmap levels are stored one after another starting from base level, level size is
+// base size shifted by level number (at least 1). Level keeps texture layout if its size allows it.
+static inline uint32_t GpuTexLevelSize(uint32_t size, uint32_t level)
+{
+    return (size >> level) ? (size >> level) : 1;
+}
+
+static inline uint32_t GpuTexLevelLayout(uint32_t w, uint32_t h, uint32_t layout)
+{
+    if (layout == TEXLAYOUT_TILED && ((w | h) & 3))
+        return TEXLAYOUT_LINEAR;
+    return layout;
+}
+
+// Bytes of w x h texture in given format
+static inline uint32_t GpuTexLevelBytes(uint32_t w, uint32_t h, uint32_t format)
+{
+    if (format == TEXFORMAT_ETC1)
+        return ((w + 3) / 4) * ((h + 3) / 4) * 8;
+    return w * h * GpuTexelBytes(format);
+}
+
+// Byte offset of mipmap level
+static inline uint32_t GpuTexLevelOffset(uint32_t w, uint32_t h, uint32_t level, uint32_t format)
+{
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < level; i++)
+        offset += GpuTexLevelBytes(GpuTexLevelSize(w, i), GpuTexLevelSize(h, i), format);
+    return offset;
+}
+
+// Number of triangles of count elements in primitive mode
+static inline uint32_t GpuPrimTriangles(uint32_t mode, uint32_t count)
+{
+    if (mode == GPU_PRIM_TRIANGLES)
+        return count / 3;
+    return (count >= 3) ? count - 2 : 0;
+}
+
+// Elements of triangle t, odd strip triangles keep winding of first one
+static inline void GpuPrimTriangle(uint32_t mode, uint32_t t, uint32_t e[3])
+{
+    if (mode == GPU_PRIM_TRIANGLE_STRIP)
+    {
+        e[0] = (t & 1) ? t + 1 : t;
+        e[1] = (t & 1) ? t : t + 1;
+        e[2] = t + 2;
+    }
+    else if (mode == GPU_PRIM_TRIANGLE_FAN)
+    {
+        e[0] = 0;
+        e[1] = t + 1;
+        e[2] = t + 2;
+    }
+    else
+    {
+        e[0] = 3*t;
+        e[1] = 3*t + 1;
+        e[2] = 3*t + 2;
+    }
+}
+
 
 #endif    /* _OGLORY_GPU_DEFS_HH */
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <functional>
 #include <array>
+#include <vector>
 #include <thread>
 #include <cstring>
 #include <cassert>
@@ -15,9 +16,12 @@
 const size_t PGL_MAX_CMD_BUFFERS        = 9;    // ! should be at least cmd fifo length +1
 const size_t PGL_MAX_CMD_BUF_ELEMENTS   = 1024;
 const size_t PGL_MAX_CMD_LEN            = 48;
+const size_t PGL_CMD_BUF_RESERVED       = 5;    // words put without commit check: frag state, clears & closing sync
+const size_t PGL_MAX_DRAW_INDICES       = (PGL_MAX_CMD_LEN - 2) * 2 / 3 * 3;    // triangle list indices per DRAW_INDEXED
 const size_t PGL_MATRIX_STACK_DEPTH     = 64;
 const size_t PGL_MAX_TEXTURES           = 512;
 const size_t PGL_MAX_TEXTURE_SIZE       = 1024;
+const size_t PGL_MAX_BUFFERS            = 512;
 
 const int PGL_WND_SIZE_X = 640;
 const int PGL_WND_SIZE_Y = 480;
@@ -40,13 +44,16 @@ enum
     PGL_VERTEX_ARRAYS
 };
 
+typedef uint32_t BufId;
+
 struct VertexArrayState
 {
     bool enabled;
     int size;
     int type;
     size_t stride;
-    const float *ptr;
+    const float *ptr;           // offset in buffer object if it is set
+    BufId buffer;
 };
 
 typedef std::array<VertexArrayState, PGL_VERTEX_ARRAYS> VertexArraysStates;
@@ -96,11 +103,38 @@ struct TextureState
     uint size;
     uint format;
     uint type;
+    uint layout;
+    uint min_filter;            // TEXFILTER_*
+    uint mag_filter;
+    uint levels;                // allocated mipmap levels after base one
+    bool mips_dirty;            // generated levels don't match base one
+    bool mips_explicit;         // levels are uploaded by application, don't generate them
+    uint gpu_format;            // TEXFORMAT_* of texture memory
+    uint bpp;                   // bytes per texel in texture memory
+    uint32_t *shadow;           // host copy of texture memory (all levels)
     uint32_t gpu_ptr;
 };
 
 typedef std::array<TextureState, PGL_MAX_TEXTURES> TextureArray;
 
+struct BufferState
+{
+    uint size;
+    uint capacity;              // allocated bytes of hw memory
+    bool busy;                  // referenced by commands which could be still running
+    uint32_t *shadow;           // host copy of buffer (for client side drawing)
+    uint32_t gpu_ptr;
+};
+
+typedef std::array<BufferState, PGL_MAX_BUFFERS> BufferArray;
+
+struct HwArrayState
+{
+    uint32_t params;
+    uint32_t ptr;
+    uint32_t stride;
+};
+
 class PseudoGLContext
 {
     public:
@@ -138,10 +172,19 @@ class PseudoGLContext
 
     uint32_t GenTexture() {assert(new_texture_id < PGL_MAX_TEXTURES); return new_texture_id++;}
     void BindHWTexture();
+    uint TextureLayout(const uint width, const uint height);
     void BindTexture(TexId tex);
-    void AllocTexture(const uint format, const uint width, const uint height);
+    void AllocTexture(const uint format, const uint type, const uint width, const uint height);
     void SetTexture(const uint format, const uint type);
-    void LoadTexture(const uint8_t* pixels, const uint xoff, const uint yoff, const uint width, const uint height);
+    void LoadTexture(const uint8_t* pixels, const uint xoff, const uint yoff, const uint width, const uint height, const uint level = 0);
+    void LoadCompressedTexture(const uint8_t* data, const uint data_size, const uint level = 0);
+    void SetTextureFilter(bool min, uint filter);
+
+    BufId GenBuffer() {assert(new_buffer_id < PGL_MAX_BUFFERS); return new_buffer_id++;}
+    void BindBuffer(bool element, BufId buf) {assert(buf < PGL_MAX_BUFFERS); (element ? element_buffer : array_buffer) = buf;}
+    void BufferData(bool element, const void *data, uint size);
+    void BufferSubData(bool element, const void *data, uint offset, uint size);
+    void DeleteBuffer(BufId buf);
 
     const char* GetBoardName() const {return board_name.c_str();}
 
@@ -154,16 +197,32 @@ class PseudoGLContext
     // Internal helper funcs
     static uint32_t FloatToU32(float f) {return *(uint32_t*)(&f);}
     static uint32_t GetValWithSize(const void* ptr, int size, int off);
+    static uint32_t GpuPrim(int mode);
 
     void PutToBuf(uint32_t w, bool committable = false);
     void PutToBuf(float f) {PutToBuf(FloatToU32(f));}
     void PutMatrixToBuffer(PglMatrix &m);
     void PutStateToBuffer();
     void PutVertexDataToBuffer(int array, int vo, int i, const void *indices, int indice_size);
+    void PutVertexToBuffer(int vo, int i, const void *indices, int indice_size);
+    uint32_t PolyCmd();
+    void PutIndexedBatch(uint32_t cmd, const uint32_t *slot_vertex, uint32_t first, uint32_t end, const std::vector<uint16_t> &tri_slots);
+    void DrawIndexed(int first, int count, int mode, const void *indices, int indice_size);
+    bool DrawBuffer(int first, int count, int mode, const void *indices, int indice_size);
+    void PutHwArray(int array);
+    void WaitBufferIdle(BufferState &buf);
+    const uint8_t* ArrayData(const VertexArrayState &v);
+    void WriteBufferRange(BufferState &buf, uint32_t begin, uint32_t end);
+    uint32_t TexelToRGBA(const TextureState &tex, const uint8_t *ptr);
+    uint TextureFormat(const TextureState &tex);
+    void AllocTextureMemory(TextureState &tex);
+    void WriteTextureRange(TextureState &tex, uint32_t begin, uint32_t end);
+    void GenerateMipmaps(TextureState &tex);
     
     void SleepMs(int ms) {std::this_thread::sleep_for(std::chrono::milliseconds(ms));}
 
-    void Profile();
+    void Profile(uint32_t reg);
+    void WaitStatus(uint32_t mask);
     void PipelineFlush();
 
     // Draw array variables
@@ -196,6 +255,19 @@ class PseudoGLContext
     bool alpha_enabled;
     bool blend_enabled;
 
+    // Indexed drawing variables
+    std::vector<uint32_t> vertex_slot;      // slot of vertex index in current batch
+    std::vector<uint32_t> vertex_slot_gen;  // batch generation of vertex_slot
+    uint32_t slot_gen;
+    std::vector<uint16_t> index_batch;      // triangle list of slots
+
+    // Buffer object variables
+    BufId new_buffer_id;
+    BufId array_buffer;
+    BufId element_buffer;
+    BufferArray buffers;
+    HwArrayState hw_arrays[PGL_VERTEX_ARRAYS];  // last VERTEX_POINTER of every array
+
     // Texture variables
     TexId new_texture_id;
     TexId binded_texture;
@@ -209,8 +281,13 @@ class PseudoGLContext
     // Device variables
     uint32_t capabilities;
     bool lighting_supported;
+    bool texparams_supported;
+    bool texformats_supported;
+    bool indexed_supported;
+    bool vertex_buffers_supported;
+    uint tex_layout;            // preferred texture memory layout
     std::string board_name;
-    uint32_t cmd_buffer[PGL_MAX_CMD_BUF_ELEMENTS];
+    uint32_t cmd_buffer[PGL_MAX_CMD_BUF_ELEMENTS];     // host copy of current command buffer
     int current_dev_buf;
     uint32_t dev_buf_ptr[PGL_MAX_CMD_BUFFERS];
     int buffer_elements;
@@ -17,10 +17,31 @@
 
 #include "etherbone.h"
 
+enum {
+    EB_ASYNC_FREE,
+    EB_ASYNC_PENDING,
+    EB_ASYNC_DONE,
+    EB_ASYNC_CANCELLED  // reply is dropped on arrival
+};
+
+struct eb_async_read {
+    int state;
+    int count;
+    uint32_t tag;       // return address of request
+    uint32_t order;     // post sequence number
+    uint32_t data[EB_MAX_ASYNC_WORDS];
+};
+
 struct eb_connection {
     int fd;
     int read_fd;
     int is_direct;
+    int mtu;            // max datagram payload
+    int max_records;    // max records in datagram
+    int window;         // max async reads in flight
+    int in_flight;      // async read slots which are not free
+    uint32_t seq;
+    struct eb_async_read reads[EB_MAX_WINDOW];
     struct addrinfo* addr;
 };
 
@@ -74,10 +95,63 @@ int eb_fill_read32(uint8_t wb_buffer[20], uint32_t address) {
     return eb_fill_readwrite32(wb_buffer, 0, address, 1);
 }
 
+int eb_fill_header(uint8_t *wb_buffer) {
+    memset(wb_buffer, 0, EB_HEADER_SIZE);
+    wb_buffer[0] = 0x4e;	// Magic byte 0
+    wb_buffer[1] = 0x6f;	// Magic byte 1
+    wb_buffer[2] = 0x10;	// Version 1, all other flags 0
+    wb_buffer[3] = 0x44;	// Address is 32-bits, port is 32-bits
+    return EB_HEADER_SIZE;
+}
+
+static int eb_fill_record_header(uint8_t *wb_buffer, int wcount, int rcount, uint32_t address) {
+    wb_buffer[0] = 0;		// No Wishbone flags are set (auto-incremented write address)
+    wb_buffer[1] = 0x0f;	// Byte enable
+    wb_buffer[2] = wcount;	// Write count
+    wb_buffer[3] = rcount;	// Read count
+    address = htobe32(address);
+    memcpy(&wb_buffer[4], &address, sizeof(address));
+    return EB_RECORD_HEADER_SIZE + sizeof(address);
+}
+
+int eb_fill_write_burst(uint8_t *wb_buffer, const uint32_t *data, int count, uint32_t address) {
+    int len = eb_fill_record_header(wb_buffer, count, 0, address);
+    for (int i = 0; i < count; i++) {
+        uint32_t value = htobe32(data[i]);
+        memcpy(&wb_buffer[len], &value, sizeof(value));
+        len += sizeof(value);
+    }
+    return len;
+}
+
+int eb_fill_read_burst(uint8_t *wb_buffer, int count, uint32_t address) {
+    // Return address is unused, read addresses follow it
+    int len = eb_fill_record_header(wb_buffer, 0, count, 0);
+    for (int i = 0; i < count; i++) {
+        uint32_t read_addr = htobe32(address + i*4);
+        memcpy(&wb_buffer[len], &read_addr, sizeof(read_addr));
+        len += sizeof(read_addr);
+    }
+    return len;
+}
+
 int eb_send(struct eb_connection *conn, const void *bytes, size_t len) {
     if (conn->is_direct)
         return sendto(conn->fd, bytes, len, 0, conn->addr->ai_addr, conn->addr->ai_addrlen);
-    return write(conn->fd, bytes, len);
+
+    // Stream socket could take only a part of long burst
+    size_t sent = 0;
+    while (sent < len) {
+        int ret = write(conn->fd, (const uint8_t *)bytes + sent, len - sent);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            fprintf(stderr, "socket write error: %s\n", strerror(errno));
+            return ret;
+        }
+        sent += ret;
+    }
+    return sent;
 }
 
 int eb_recv(struct eb_connection *conn, void *bytes, size_t max_len) {
@@ -92,15 +166,12 @@ void eb_write32(struct eb_connection *conn, uint32_t val, uint32_t addr) {
     eb_send(conn, raw_pkt, sizeof(raw_pkt));
 }
 
-uint32_t eb_read32(struct eb_connection *conn, uint32_t addr) {
-    uint8_t raw_pkt[20];
-    eb_fill_read32(raw_pkt, addr);
-
-    eb_send(conn, raw_pkt, sizeof(raw_pkt));
+// Receive reply packet of known length
+static int eb_recv_packet(struct eb_connection *conn, uint8_t *bytes, size_t len) {
     if (conn->is_direct) {
-        int count = eb_recv(conn, raw_pkt, sizeof(raw_pkt));
+        int count = eb_recv(conn, bytes, len);
 
-        if (count != sizeof(raw_pkt)) {
+        if (count != (int)len) {
             fprintf(stderr, "unexpected read length: %d\n", count);
             return -1;
         }
@@ -108,8 +179,8 @@ uint32_t eb_read32(struct eb_connection *conn, uint32_t addr) {
         // If we are connected via TCP we need to take into account any size
         // read because it is a stream oriented protocol.
         int ret;
-        uint8_t *p   = raw_pkt;
-        uint8_t *end = raw_pkt + sizeof(raw_pkt);
+        uint8_t *p   = bytes;
+        uint8_t *end = bytes + len;
 
         while (p < end) {
             ret = eb_recv(conn, p, end - p);
@@ -128,10 +199,249 @@ uint32_t eb_read32(struct eb_connection *conn, uint32_t addr) {
             p += ret;
         }
     }
+    return len;
+}
+
+// Receive reply of async read & store it in matching slot
+static int eb_recv_async(struct eb_connection *conn) {
+    uint8_t raw_pkt[EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 4 + EB_MAX_BURST*4];
+    int head = EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 4;
+    int wcount;
+
+    if (conn->is_direct) {
+        int len = eb_recv(conn, raw_pkt, sizeof(raw_pkt));
+        wcount = len >= head ? raw_pkt[EB_HEADER_SIZE + 2] : 0;
+        if (len < head + wcount*4) {
+            fprintf(stderr, "unexpected read length: %d\n", len);
+            return -1;
+        }
+    } else {
+        if (eb_recv_packet(conn, raw_pkt, head) < 0)
+            return -1;
+        wcount = raw_pkt[EB_HEADER_SIZE + 2];
+        if (eb_recv_packet(conn, raw_pkt + head, wcount*4) < 0)
+            return -1;
+    }
+
+    uint32_t tag;
+    memcpy(&tag, &raw_pkt[EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE], sizeof(tag));
+    tag = be32toh(tag);
+
+    // Match by tag, or take the oldest request if server doesn't return it
+    struct eb_async_read *match = NULL;
+    for (int i = 0; i < EB_MAX_WINDOW; i++) {
+        struct eb_async_read *r = &conn->reads[i];
+        if (r->state != EB_ASYNC_PENDING && r->state != EB_ASYNC_CANCELLED)
+            continue;
+        if (tag ? (r->tag == tag) : (!match || (int32_t)(r->order - match->order) < 0))
+            match = r;
+        if (tag && match)
+            break;
+    }
+    if (!match) {
+        fprintf(stderr, "unexpected read reply: 0x%08x\n", tag);
+        return 0;
+    }
+
+    if (match->state == EB_ASYNC_CANCELLED) {
+        match->state = EB_ASYNC_FREE;
+        conn->in_flight--;
+        return 0;
+    }
+    for (int i = 0; i < wcount && i < match->count; i++) {
+        uint32_t value;
+        memcpy(&value, &raw_pkt[head + i*4], sizeof(value));
+        match->data[i] = be32toh(value);
+    }
+    match->state = EB_ASYNC_DONE;
+    return 0;
+}
+
+static int eb_awaits_reply(struct eb_connection *conn, int cancelled_only) {
+    for (int i = 0; i < EB_MAX_WINDOW; i++) {
+        int state = conn->reads[i].state;
+        if (state == EB_ASYNC_CANCELLED || (!cancelled_only && state == EB_ASYNC_PENDING))
+            return 1;
+    }
+    return 0;
+}
+
+// Collect replies of async reads, so next reply is the one of synchronous read
+static int eb_read_drain(struct eb_connection *conn) {
+    while (eb_awaits_reply(conn, 0))
+        if (eb_recv_async(conn) < 0)
+            return -1;
+    return 0;
+}
+
+uint32_t eb_read32(struct eb_connection *conn, uint32_t addr) {
+    uint8_t raw_pkt[20];
+    if (eb_read_drain(conn) < 0)
+        return -1;
+    eb_fill_read32(raw_pkt, addr);
+
+    eb_send(conn, raw_pkt, sizeof(raw_pkt));
+    if (eb_recv_packet(conn, raw_pkt, sizeof(raw_pkt)) < 0)
+        return -1;
 
     return eb_unfill_read32(raw_pkt);
 }
 
+void eb_write(struct eb_connection *conn, const uint32_t *data, int count, uint32_t addr) {
+    uint8_t raw_pkt[EB_BUFFER_SIZE];
+    int limit = conn->is_direct ? conn->mtu : (int)sizeof(raw_pkt);
+    int len = 0;
+    int records = 0;
+
+    while (count > 0) {
+        // Stream packets hold one record, datagram is one packet of several records
+        int header = (!conn->is_direct || !len) ? EB_HEADER_SIZE : 0;
+        int room = (limit - len - header - EB_RECORD_HEADER_SIZE - 4) / 4;
+        if (room < 1 || (conn->is_direct && records == conn->max_records)) {
+            eb_send(conn, raw_pkt, len);
+            len = 0;
+            records = 0;
+            continue;
+        }
+
+        int n = count < room ? count : room;
+        if (n > EB_MAX_BURST)
+            n = EB_MAX_BURST;
+        if (header)
+            len += eb_fill_header(&raw_pkt[len]);
+        len += eb_fill_write_burst(&raw_pkt[len], data, n, addr);
+        records++;
+
+        data += n;
+        count -= n;
+        addr += n*4;
+    }
+    if (len)
+        eb_send(conn, raw_pkt, len);
+}
+
+int eb_read(struct eb_connection *conn, uint32_t *data, int count, uint32_t addr) {
+    uint8_t raw_pkt[EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 4 + EB_MAX_BURST*4];
+    int reply_offset = EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 4;
+
+    if (eb_read_drain(conn) < 0)
+        return -1;
+    while (count > 0) {
+        // Reply is a write record of all read values, it should fit in datagram too
+        int n = count < EB_MAX_BURST ? count : EB_MAX_BURST;
+        if (conn->is_direct && n > (conn->mtu - reply_offset) / 4)
+            n = (conn->mtu - reply_offset) / 4;
+
+        int len = eb_fill_header(raw_pkt);
+        len += eb_fill_read_burst(&raw_pkt[len], n, addr);
+        eb_send(conn, raw_pkt, len);
+
+        if (eb_recv_packet(conn, raw_pkt, reply_offset + n*4) < 0)
+            return -1;
+        for (int i = 0; i < n; i++) {
+            uint32_t value;
+            memcpy(&value, &raw_pkt[reply_offset + i*4], sizeof(value));
+            data[i] = be32toh(value);
+        }
+
+        data += n;
+        count -= n;
+        addr += n*4;
+    }
+    return 0;
+}
+
+void eb_set_window(struct eb_connection *conn, int window) {
+    if (window < 1)
+        window = 1;
+    if (window > EB_MAX_WINDOW)
+        window = EB_MAX_WINDOW;
+    conn->window = window;
+}
+
+int eb_read_post(struct eb_connection *conn, const uint32_t *addrs, int count) {
+    uint8_t raw_pkt[EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 4 + EB_MAX_ASYNC_WORDS*4];
+    if (count < 1 || count > EB_MAX_ASYNC_WORDS)
+        return -1;
+
+    // Only replies of cancelled reads could free the window
+    while (conn->in_flight >= conn->window) {
+        if (!eb_awaits_reply(conn, 1) || eb_recv_async(conn) < 0)
+            return -1;
+    }
+
+    int id = 0;
+    while (conn->reads[id].state != EB_ASYNC_FREE)
+        id++;
+
+    // Tag is a nonzero word address
+    if (!(++conn->seq & 0xFFFF))
+        conn->seq++;
+    struct eb_async_read *r = &conn->reads[id];
+    r->state = EB_ASYNC_PENDING;
+    r->count = count;
+    r->order = conn->seq;
+    r->tag = (conn->seq & 0xFFFF) << 2;
+    conn->in_flight++;
+
+    int len = eb_fill_header(raw_pkt);
+    len += eb_fill_record_header(&raw_pkt[len], 0, count, r->tag);
+    for (int i = 0; i < count; i++) {
+        uint32_t read_addr = htobe32(addrs[i]);
+        memcpy(&raw_pkt[len], &read_addr, sizeof(read_addr));
+        len += sizeof(read_addr);
+    }
+    eb_send(conn, raw_pkt, len);
+    return id;
+}
+
+int eb_read_wait(struct eb_connection *conn, int id, uint32_t *data) {
+    if (id < 0 || id >= EB_MAX_WINDOW)
+        return -1;
+    struct eb_async_read *r = &conn->reads[id];
+    if (r->state != EB_ASYNC_PENDING && r->state != EB_ASYNC_DONE)
+        return -1;
+
+    while (r->state == EB_ASYNC_PENDING)
+        if (eb_recv_async(conn) < 0)
+            return -1;
+
+    memcpy(data, r->data, r->count*sizeof(uint32_t));
+    r->state = EB_ASYNC_FREE;
+    conn->in_flight--;
+    return r->count;
+}
+
+void eb_read_cancel(struct eb_connection *conn, int id) {
+    if (id < 0 || id >= EB_MAX_WINDOW)
+        return;
+    struct eb_async_read *r = &conn->reads[id];
+    if (r->state == EB_ASYNC_PENDING)
+        r->state = EB_ASYNC_CANCELLED;
+    else if (r->state == EB_ASYNC_DONE) {
+        r->state = EB_ASYNC_FREE;
+        conn->in_flight--;
+    }
+}
+
+// Read of several registers in one request
+int eb_read_snapshot(struct eb_connection *conn, const uint32_t *addrs, uint32_t *data, int count) {
+    int id = eb_read_post(conn, addrs, count);
+    if (id < 0)
+        return -1;
+    return eb_read_wait(conn, id, data);
+}
+
+void eb_set_mtu(struct eb_connection *conn, int mtu, int max_records) {
+    int min_mtu = EB_HEADER_SIZE + EB_RECORD_HEADER_SIZE + 8;
+    if (mtu < min_mtu)
+        mtu = min_mtu;
+    if (mtu > EB_BUFFER_SIZE)
+        mtu = EB_BUFFER_SIZE;
+    conn->mtu = mtu;
+    conn->max_records = max_records < 1 ? 1 : max_records;
+}
+
 struct eb_connection *eb_connect(const char *addr, const char *port, int is_direct) {
 
     struct addrinfo hints;
@@ -144,6 +454,7 @@ struct eb_connection *eb_connect(const char *addr, const char *port, int is_dire
         perror("couldn't allocate memory for eb_connection");
         return NULL;
     }
+    memset(conn, 0, sizeof(*conn));
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -158,6 +469,8 @@ struct eb_connection *eb_connect(const char *addr, const char *port, int is_dire
     }
 
     conn->is_direct = is_direct;
+    eb_set_mtu(conn, EB_DEFAULT_MTU, 1);
+    eb_set_window(conn, EB_DEFAULT_WINDOW);
 
     if (is_direct) {
         // Rx half
@@ -56,18 +56,54 @@ is set to 1.  For a read, the read_addr is specified.  For a write, the
 write_addr is specified along with a value.
 
 The same type of record is returned, so your data is at offset 16.
+
+Burst records carry up to 255 values (wcount) written to write_addr with
+auto-incremented addresses, or up to 255 read addresses (rcount) after the
+return address.  A burst read is answered with a write record of rcount
+values.  eb_write() splits data into burst records and packs several records
+into one UDP datagram while they fit in MTU, if eb_set_mtu() allowed more than
+one record per packet (the default is one to suit LiteX).  Over TCP every
+record gets its own packet header, but packets are sent in one go.
+
+Asynchronous reads keep up to eb_set_window() requests in flight.  Every
+request carries a tag in its return address, which comes back as the base
+address of the reply, so replies are matched to requests even if they are
+reordered.  Replies with zero base address (servers which don't echo it) are
+matched to the oldest request.  Synchronous reads first collect replies of
+all requests in flight.
 */
 
+#define EB_HEADER_SIZE          8
+#define EB_RECORD_HEADER_SIZE   4
+#define EB_MAX_BURST            255
+#define EB_DEFAULT_MTU          1472    // UDP payload of 1500 byte Ethernet frame
+#define EB_BUFFER_SIZE          16384
+#define EB_MAX_WINDOW           16      // max async reads in flight
+#define EB_DEFAULT_WINDOW       4
+#define EB_MAX_ASYNC_WORDS      16      // max registers in async read
+
 struct eb_connection;
 
 int eb_unfill_read32(uint8_t wb_buffer[20]);
 int eb_fill_write32(uint8_t wb_buffer[20], uint32_t data, uint32_t address);
 int eb_fill_read32(uint8_t wb_buffer[20], uint32_t address);
+int eb_fill_header(uint8_t *wb_buffer);
+int eb_fill_write_burst(uint8_t *wb_buffer, const uint32_t *data, int count, uint32_t address);
+int eb_fill_read_burst(uint8_t *wb_buffer, int count, uint32_t address);
 
 struct eb_connection *eb_connect(const char *addr, const char *port, int is_direct);
 void eb_disconnect(struct eb_connection **conn);
+void eb_set_mtu(struct eb_connection *conn, int mtu, int max_records);
 uint32_t eb_read32(struct eb_connection *conn, uint32_t addr);
 void eb_write32(struct eb_connection *conn, uint32_t val, uint32_t addr);
+int eb_read(struct eb_connection *conn, uint32_t *data, int count, uint32_t addr);
+void eb_write(struct eb_connection *conn, const uint32_t *data, int count, uint32_t addr);
+
+void eb_set_window(struct eb_connection *conn, int window);
+int eb_read_post(struct eb_connection *conn, const uint32_t *addrs, int count);
+int eb_read_wait(struct eb_connection *conn, int id, uint32_t *data);
+void eb_read_cancel(struct eb_connection *conn, int id);
+int eb_read_snapshot(struct eb_connection *conn, const uint32_t *addrs, uint32_t *data, int count);
 
 #ifdef __cplusplus
 };
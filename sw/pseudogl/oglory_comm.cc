@@ -4,6 +4,7 @@
 #include <cstring>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 
 #include <oglory_comm.hh>
@@ -25,11 +26,18 @@
 #include "litex_init.h"
 #endif
 
-// OpenGLory communication routines (only slow & dumb Etherbone 32-bit access and direct /dev/mem for now)
+// OpenGLory communication routines (Etherbone with burst memory access and direct /dev/mem for now)
 
 #if OGLORY_COMM_ETHERBONE
 static struct eb_connection *eb;
 
+// Register polling state: snapshot reads in flight, oldest first
+static uint32_t poll_addrs[EB_MAX_ASYNC_WORDS];
+static int poll_count;
+static int poll_ids[EB_MAX_WINDOW];
+static int poll_head, poll_pending;
+static bool poll_first;
+
 int oglory_comm_init()
 {
     const char *eb_address = getenv("EB_ADDRESS");
@@ -45,6 +53,15 @@ int oglory_comm_init()
     eb = eb_connect(eb_address, port, is_direct);
     if (!eb)
         return -1;
+
+    // UDP burst packing: datagram payload size & records per datagram (if FPGA core supports several)
+    const char *eb_mtu = getenv("EB_MTU");
+    const char *eb_records = getenv("EB_RECORDS");
+    eb_set_mtu(eb, eb_mtu ? atoi(eb_mtu) : EB_DEFAULT_MTU, eb_records ? atoi(eb_records) : 1);
+
+    // Status polling reads in flight
+    const char *eb_window = getenv("EB_WINDOW");
+    eb_set_window(eb, eb_window ? atoi(eb_window) : EB_DEFAULT_WINDOW);
     printf("Connected to %s %s\n", eb_address, port);
     
     return 0;
@@ -60,6 +77,54 @@ void oglory_reg_write32(uint32_t val, uint32_t addr)
     return eb_write32(eb, val, addr);
 }
 
+void oglory_reg_snapshot(const uint32_t *addrs, uint32_t *vals, int count)
+{
+    assert(count <= EB_MAX_ASYNC_WORDS);
+    if (eb_read_snapshot(eb, addrs, vals, count) < 0)
+        memset(vals, 0xFF, count*4);
+}
+
+void oglory_reg_poll_start(const uint32_t *addrs, int count)
+{
+    assert(count <= EB_MAX_ASYNC_WORDS);
+    memcpy(poll_addrs, addrs, count*4);
+    poll_count = count;
+    poll_head = poll_pending = 0;
+    poll_first = true;
+}
+
+void oglory_reg_poll_next(uint32_t *vals)
+{
+    // First snapshot is a single read, window is filled only if polling goes on
+    int window = poll_first ? 1 : EB_MAX_WINDOW;
+    poll_first = false;
+    while (poll_pending < window)
+    {
+        int id = eb_read_post(eb, poll_addrs, poll_count);
+        if (id < 0)
+            break;
+        poll_ids[(poll_head + poll_pending++) % EB_MAX_WINDOW] = id;
+    }
+
+    if (!poll_pending || (eb_read_wait(eb, poll_ids[poll_head], vals) < 0))
+        memset(vals, 0xFF, poll_count*4);
+    if (poll_pending)
+    {
+        poll_head = (poll_head + 1) % EB_MAX_WINDOW;
+        poll_pending--;
+    }
+}
+
+void oglory_reg_poll_stop()
+{
+    // Replies of reads still in flight are dropped on arrival
+    for (; poll_pending; poll_pending--)
+    {
+        eb_read_cancel(eb, poll_ids[poll_head]);
+        poll_head = (poll_head + 1) % EB_MAX_WINDOW;
+    }
+}
+
 uint32_t oglory_csr_read32(uint32_t addr) 
 {
     return eb_read32(eb, addr);
@@ -80,10 +145,14 @@ void oglory_mem_write32(uint32_t val, uint32_t addr)
     eb_write32(eb, val, addr);
 }
 
+void oglory_mem_read(uint32_t *buf, int count, uint32_t addr)
+{
+    eb_read(eb, buf, count, addr);
+}
+
 void oglory_mem_write(uint32_t *buf, int count, uint32_t addr)
 {
-    for (int i = 0; i < count; i++)
-        eb_write32(eb, buf[i], addr + i*4);
+    eb_write(eb, buf, count, addr);
 }
 
 #elif OGLORY_COMM_DEVMEM
@@ -117,6 +186,31 @@ void oglory_reg_write32(uint32_t val, uint32_t addr)
     return devmem_write32(oglory_regs_mmap, addr, val);
 }
 
+static const uint32_t *poll_addrs;
+static int poll_count;
+
+void oglory_reg_snapshot(const uint32_t *addrs, uint32_t *vals, int count)
+{
+    for (int i = 0; i < count; i++)
+        vals[i] = devmem_read32(oglory_regs_mmap, addrs[i]);
+}
+
+// Local bus reads are cheap, nothing to pipeline
+void oglory_reg_poll_start(const uint32_t *addrs, int count)
+{
+    poll_addrs = addrs;
+    poll_count = count;
+}
+
+void oglory_reg_poll_next(uint32_t *vals)
+{
+    oglory_reg_snapshot(poll_addrs, vals, poll_count);
+}
+
+void oglory_reg_poll_stop()
+{
+}
+
 uint32_t oglory_csr_read32(uint32_t addr) 
 {
     return devmem_read32(oglory_csr_mmap, addr);
@@ -137,6 +231,12 @@ void oglory_mem_write32(uint32_t val, uint32_t addr)
     devmem_write32(oglory_buf_mmap, addr, val);
 }
 
+void oglory_mem_read(uint32_t *buf, int count, uint32_t addr)
+{
+    void* src = devmem_getptr(oglory_buf_mmap, addr);
+    memcpy(buf, src, count*4);
+}
+
 void oglory_mem_write(uint32_t *buf, int count, uint32_t addr)
 {
     void* dst = devmem_getptr(oglory_buf_mmap, addr);
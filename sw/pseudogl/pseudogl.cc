@@ -7,9 +7,12 @@
 #define LOAD_TEXTURES   1
 
 #include "GLES/gl.h"
+#include "GLES/glext.h"
 #include "pgl_math.hh"
 #include <cstdint>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -46,6 +49,10 @@ PseudoGLContext::PseudoGLContext() :
     front_face(true),
     new_texture_id(1),   
     binded_texture(0),
+    new_buffer_id(1),
+    array_buffer(0),
+    element_buffer(0),
+    slot_gen(0),
     gpu_freemem_ptr(GPU_TEX_BUF_ADDR)
 {
     if (oglory_comm_init()) 
@@ -58,11 +65,33 @@ PseudoGLContext::PseudoGLContext() :
     oglory_reg_write32(1, GPU_REG_RESET_ADDR);
     SleepMs(1);
     
-    // Get capabilities
-    capabilities = oglory_reg_read32(GPU_REG_CAP_ADDR);
+    // Get capabilities & board name at once
+    const uint32_t id_regs[] = {GPU_REG_CAP_ADDR, GPU_REG_BOARD0_ADDR, GPU_REG_BOARD1_ADDR};
+    uint32_t id_vals[3];
+    oglory_reg_snapshot(id_regs, id_vals, 3);
+    capabilities = id_vals[0];
     // Init functions mentioned in capabilities
     oglory_hardware_init(capabilities);
     lighting_supported = capabilities & GPU_CAP_LIGHTING;
+    texparams_supported = capabilities & GPU_CAP_TEXPARAMS;
+    texformats_supported = texparams_supported && (capabilities & GPU_CAP_TEXFORMATS);
+    indexed_supported = capabilities & GPU_CAP_INDEXED;
+    vertex_buffers_supported = capabilities & GPU_CAP_VERTEX_BUFFERS;
+    
+    // Textures are swizzled if GPU could sample them, PGL_TEX_LAYOUT=linear|morton|tiled overrides it
+    tex_layout = texparams_supported ? TEXLAYOUT_MORTON : TEXLAYOUT_LINEAR;
+    const char *layout_env = getenv("PGL_TEX_LAYOUT");
+    if (layout_env && texparams_supported)
+    {
+        if (!strcmp(layout_env, "linear"))
+            tex_layout = TEXLAYOUT_LINEAR;
+        else if (!strcmp(layout_env, "morton"))
+            tex_layout = TEXLAYOUT_MORTON;
+        else if (!strcmp(layout_env, "tiled"))
+            tex_layout = TEXLAYOUT_TILED;
+        else
+            std::cerr << "Unknown texture layout " << layout_env << std::endl;
+    }
     
     // Set buffers
     for (int i = 0; i < PGL_MAX_CMD_BUFFERS; ++i)
@@ -74,28 +103,33 @@ PseudoGLContext::PseudoGLContext() :
         matrices[i] = matrix_stack[i];
 
     for (int a = 0; a < PGL_VERTEX_ARRAYS; a++)
-        vertex_arrays[a] = {false, 3, GL_FLOAT, 0, nullptr};
+        vertex_arrays[a] = {false, 3, GL_FLOAT, 0, nullptr, 0};
+    memset(&buffers, 0, sizeof(buffers));
+    memset(hw_arrays, 0xFF, sizeof(hw_arrays));     // nothing is sent yet
 
     memset(&textures, 0, sizeof(textures));
+    for (TextureState &tex : textures)
+    {
+        // GL defaults
+        tex.min_filter = TEXFILTER_NEAREST_MIPMAP_LINEAR;
+        tex.mag_filter = TEXFILTER_LINEAR;
+    }
 
     // Get board name
     char tmp_name[9];
-    uint32_t name_reg = oglory_reg_read32(GPU_REG_BOARD0_ADDR);
-    strncpy(tmp_name, (char*)&name_reg, 4);
-    name_reg = oglory_reg_read32(GPU_REG_BOARD1_ADDR);
-    strncpy(tmp_name+4, (char*)&name_reg, 4);
+    memcpy(tmp_name, &id_vals[1], 4);
+    memcpy(tmp_name+4, &id_vals[2], 4);
     tmp_name[8] = '\0';
     board_name = std::string("OpenGlory on ") + tmp_name;
     board_name.erase(board_name.find_last_not_of(" ")+1); // trim
 }
 
-// Simple profiler
-void PseudoGLContext::Profile()
+// Simple profiler (debug register is read with status)
+void PseudoGLContext::Profile(uint32_t reg)
 {
     #if PROFILE
     if (!(profile_cnt++ & 0xF))
     {
-        uint32_t reg = oglory_reg_read32(GPU_REG_DEBUG_ADDR);
         profile++;
         if (reg & 0x0001)
             input_to_vertex_valid++;
@@ -114,9 +148,27 @@ void PseudoGLContext::Profile()
         if (reg & 0x4000)
             fb_wb++;
     }
+    #else
+    (void)reg;
     #endif
 }
 
+// Wait till status mask bits are cleared, status reads are pipelined
+void PseudoGLContext::WaitStatus(uint32_t mask)
+{
+    const uint32_t regs[] = {GPU_REG_STAT_ADDR, GPU_REG_DEBUG_ADDR};
+    uint32_t vals[2] = {0, 0};
+
+    oglory_reg_poll_start(regs, PROFILE ? 2 : 1);
+    oglory_reg_poll_next(vals);
+    while (vals[0] & mask)
+    {
+        Profile(vals[1]);
+        oglory_reg_poll_next(vals);
+    }
+    oglory_reg_poll_stop();
+}
+
 // Swap visible framebuffer
 void PseudoGLContext::SwapBuffers()
 {
@@ -158,8 +210,11 @@ void PseudoGLContext::CommitCmdBuffer()
         // Add sync command
         PutToBuf(GPU_PIPE_CMD_SYNC);
 
+        // Copy whole buffer to hw memory at once
+        oglory_mem_write(cmd_buffer, buffer_elements, dev_buf_ptr[current_dev_buf]);
+
         // Wait for GPU command buffer to become ready to switch to it
-        while (oglory_reg_read32(GPU_REG_STAT_ADDR) & GPU_STAT_FULL) Profile();
+        WaitStatus(GPU_STAT_FULL);
 
         // Start GPU cmd read
         oglory_reg_write32(dev_buf_ptr[current_dev_buf], GPU_REG_CMDBASE_ADDR);
@@ -180,12 +235,11 @@ void PseudoGLContext::PutToBuf(uint32_t w, bool committable)
     #if SKIP_PUTBUF
     if (frame_cnt >= SKIP_FRAMES) {
     #endif
-    if (committable && (buffer_elements > PGL_MAX_CMD_BUF_ELEMENTS-PGL_MAX_CMD_LEN))
+    if (committable && (buffer_elements > PGL_MAX_CMD_BUF_ELEMENTS-PGL_MAX_CMD_LEN-PGL_CMD_BUF_RESERVED))
         CommitCmdBuffer();
     assert(buffer_elements<PGL_MAX_CMD_BUF_ELEMENTS);
-    oglory_mem_write32(w, dev_buf_ptr[current_dev_buf]+buffer_elements*4);
-    
-    buffer_elements++;
+    // commands are staged in host memory till commit
+    cmd_buffer[buffer_elements++] = w;
     #if SKIP_PUTBUF
     }
     #endif
@@ -195,7 +249,7 @@ void PseudoGLContext::PutToBuf(uint32_t w, bool committable)
 void PseudoGLContext::PipelineFlush()
 {
     CommitCmdBuffer();
-    while(oglory_reg_read32(GPU_REG_STAT_ADDR) & GPU_STAT_FLUSH_MASK) Profile();
+    WaitStatus(GPU_STAT_FLUSH_MASK);
 }
 
 // Clear framebuffer & z-buffer
@@ -216,6 +270,7 @@ void PseudoGLContext::SetVertexArray(int array, int size, int type, size_t strid
     vertex_arrays[array].type=type; 
     vertex_arrays[array].stride=stride ? stride : type*size; 
     vertex_arrays[array].ptr=ptr;
+    vertex_arrays[array].buffer=array_buffer;
 }
 
 void PseudoGLContext::SetVertexArrayEnabled(int array, bool e) 
@@ -244,6 +299,16 @@ uint32_t PseudoGLContext::GetValWithSize(const void* ptr, int size, int off)
     }
 }
 
+// GPU primitive of GL drawing mode
+uint32_t PseudoGLContext::GpuPrim(int mode)
+{
+    if (mode == GL_TRIANGLE_STRIP)
+        return GPU_PRIM_TRIANGLE_STRIP;
+    if (mode == GL_TRIANGLE_FAN)
+        return GPU_PRIM_TRIANGLE_FAN;
+    return GPU_PRIM_TRIANGLES;
+}
+
 // Put matrix to command buffer
 void PseudoGLContext::PutMatrixToBuffer(PglMatrix &m)
 {
@@ -260,7 +325,7 @@ void PseudoGLContext::PutVertexDataToBuffer(int array, int vo, int i, const void
     for (int n = 0; n < v.size; n++)
     {
         size_t offn = v.stride*(GetValWithSize(indices, indice_size, vo + i)) + n*v.type;
-        uint8_t* off = ((uint8_t*)v.ptr) + offn;
+        const uint8_t* off = ArrayData(v) + offn;
         switch(v.type)
         {
             case(1):
@@ -289,6 +354,15 @@ void PseudoGLContext::PutVertexDataToBuffer(int array, int vo, int i, const void
 // Copy data from vertex arrays in client memory to command buffer (glDrawArrays & glDrawElements)
 void PseudoGLContext::CopyDrawArray(int first, int count, int mode, const void *indices, int indice_size)
 {
+    // Generate mipmaps of binded texture if they are going to be sampled
+    TextureState &tex = textures[binded_texture];
+    if (texcoord_array.enabled && tex.gpu_ptr && tex.mips_dirty && !tex.mips_explicit && tex.levels &&
+        tex.min_filter >= TEXFILTER_NEAREST_MIPMAP_NEAREST && tex.gpu_format != TEXFORMAT_ETC1)
+    {
+        GenerateMipmaps(tex);
+        BindHWTexture();
+    }
+
     // Add matrices to command buffer
     if (matrices[PGL_MODEL_MATRIX]->CheckDirty())
     {
@@ -365,6 +439,24 @@ void PseudoGLContext::CopyDrawArray(int first, int count, int mode, const void *
         frag_state_dirty = false;
     }
 
+    // Vertices in buffer objects are fetched by GPU itself
+    if (vertex_buffers_supported && DrawBuffer(first, count, mode, indices, indice_size))
+        return;
+    
+    // Otherwise indices in element array buffer are read from its host copy
+    if (indice_size && element_buffer)
+    {
+        assert(buffers[element_buffer].shadow);
+        indices = (const uint8_t*)buffers[element_buffer].shadow + (size_t)indices;
+    }
+
+    // Indexed drawing sends every vertex once per batch, it is useful only if vertices are shared
+    if (indexed_supported && (indice_size || mode != GL_TRIANGLES))
+    {
+        DrawIndexed(first, count, mode, indices, indice_size);
+        return;
+    }
+
     // Generate vertex commands
     if (mode == GL_TRIANGLE_STRIP || mode == GL_TRIANGLE_FAN)
     {
@@ -381,14 +473,7 @@ void PseudoGLContext::CopyDrawArray(int first, int count, int mode, const void *
         int vi = (i - first) % 3;
         if (vi == 0)
         {
-            assert(!(texcoord_array.enabled && normal_array.enabled));
-            uint32_t cmd = GPU_PIPE_CMD_POLY_VERTEX3;
-            if (texcoord_array.enabled)
-                cmd = GPU_PIPE_CMD_POLY_VERTEX3TC;
-            else if (lighting_enabled && normal_array.enabled) 
-                cmd = GPU_PIPE_CMD_POLY_VERTEX3N3;
-
-            PutToBuf(cmd, true);
+            PutToBuf(PolyCmd(), true);
             if (i != first)
             {
                 n++;    // count triangles
@@ -412,47 +497,229 @@ void PseudoGLContext::CopyDrawArray(int first, int count, int mode, const void *
                 vo = -n*3;
         }
         
-        // write vertex to buffer
-        assert(vertex_array.enabled);
+        PutVertexToBuffer(vo, i, indices, indice_size);
+        assert(buffer_elements < PGL_MAX_CMD_BUF_ELEMENTS);
+    }
+}
+
+// Polygon command for enabled vertex arrays
+uint32_t PseudoGLContext::PolyCmd()
+{
+    assert(!(texcoord_array.enabled && normal_array.enabled));
+    if (texcoord_array.enabled)
+        return GPU_PIPE_CMD_POLY_VERTEX3TC;
+    else if (lighting_enabled && normal_array.enabled) 
+        return GPU_PIPE_CMD_POLY_VERTEX3N3;
+    return GPU_PIPE_CMD_POLY_VERTEX3;
+}
 
-        if (vertex_array.enabled)
+// Put vertex (element vo + i) of enabled vertex arrays to command buffer
+void PseudoGLContext::PutVertexToBuffer(int vo, int i, const void *indices, int indice_size)
+{
+    assert(vertex_array.enabled);
+
+    if (vertex_array.enabled)
+    {
+        PutVertexDataToBuffer(PGL_VERTEX_ARRAY, vo, i, indices, indice_size);
+    }
+
+    if (lighting_enabled)
+    {
+        for (int c = 0; c < 4; c++)
+            PutToBuf(FloatToU32(material_params.ambient_color[c]));
+        if (lighting_supported)
+            for (int c = 0; c < 4; c++)
+                PutToBuf(FloatToU32(material_params.diffuse_color[c]));
+    }
+    else 
+    {
+        if (color_array.enabled)
         {
-            PutVertexDataToBuffer(PGL_VERTEX_ARRAY, vo, i, indices, indice_size);
+            PutVertexDataToBuffer(PGL_COLOR_ARRAY, vo, i, indices, indice_size);
         }
-
-        if (lighting_enabled)
+        else 
         {
             for (int c = 0; c < 4; c++)
-                PutToBuf(FloatToU32(material_params.ambient_color[c]));
-            if (lighting_supported)
-                for (int c = 0; c < 4; c++)
-                    PutToBuf(FloatToU32(material_params.diffuse_color[c]));
+                PutToBuf(FloatToU32(cur_color[c]));
         }
-        else 
+    }
+
+    if (normal_array.enabled)  
+    {  
+        PutVertexDataToBuffer(PGL_NORMAL_ARRAY, vo, i, indices, indice_size);
+    }
+
+    if (texcoord_array.enabled)  
+    {  
+        PutVertexDataToBuffer(PGL_TEXCOORD_ARRAY, vo, i, indices, indice_size);
+    }
+}
+
+// Put vertices of slots [first, end) & triangle list of slot indices to command buffer
+void PseudoGLContext::PutIndexedBatch(uint32_t cmd, const uint32_t *slot_vertex, uint32_t first, uint32_t end, const std::vector<uint16_t> &tri_slots)
+{
+    uint32_t format = cmd & 0xFF;
+    uint32_t words = ((cmd >> 8) & 0xFF) / 3;
+    uint32_t max_vertices = (PGL_MAX_CMD_LEN - 2) / words;
+    for (uint32_t s = first; s < end; s += max_vertices)
+    {
+        uint32_t n = std::min(max_vertices, end - s);
+        PutToBuf(GPU_PIPE_CMD_LOAD_VERTICES | ((1 + n*words) << 8), true);
+        PutToBuf(s | (format << GPU_VERTEX_FORMAT_SHIFT));
+        for (uint32_t v = s; v < s + n; v++)
+            PutVertexToBuffer(0, slot_vertex[v], nullptr, 0);
+    }
+    
+    for (size_t i = 0; i < tri_slots.size(); i += PGL_MAX_DRAW_INDICES)
+    {
+        uint32_t n = std::min(PGL_MAX_DRAW_INDICES, tri_slots.size() - i);
+        PutToBuf(GPU_PIPE_CMD_DRAW_INDEXED | ((1 + (n + 1)/2) << 8), true);
+        PutToBuf(n);
+        for (uint32_t j = 0; j < n; j += 2)
+            PutToBuf((uint32_t)tri_slots[i + j] | (j + 1 < n ? (uint32_t)tri_slots[i + j + 1] << 16 : 0));
+    }
+}
+
+// Draw triangles as batches of vertex slots loaded once & indices of them, so vertex
+// transform processes shared vertices once while they stay in its post-transform cache
+void PseudoGLContext::DrawIndexed(int first, int count, int mode, const void *indices, int indice_size)
+{
+    uint32_t cmd = PolyCmd();
+    uint32_t prim = GpuPrim(mode);
+    assert(prim == GPU_PRIM_TRIANGLES ? count%3 == 0 : count >= 3);
+    uint32_t triangles = GpuPrimTriangles(prim, count);
+
+    // vertex index to slot mapping of current batch, it is valid if generation matches
+    uint32_t slot_vertex[GPU_VERTEX_SLOTS];
+    uint32_t loaded = 0, slots = 0;
+    index_batch.clear();
+    slot_gen++;
+    for (uint32_t t = 0; t < triangles; t++)
+    {
+        uint32_t e[3];
+        GpuPrimTriangle(prim, t, e);
+
+        uint32_t vi[3];
+        uint32_t missing = 0;
+        for (int v = 0; v < 3; v++)
         {
-            if (color_array.enabled)
+            vi[v] = GetValWithSize(indices, indice_size, first + e[v]);
+            if (vi[v] >= vertex_slot_gen.size())
             {
-                PutVertexDataToBuffer(PGL_COLOR_ARRAY, vo, i, indices, indice_size);
+                vertex_slot_gen.resize(vi[v] + 1, 0);
+                vertex_slot.resize(vi[v] + 1);
             }
-            else 
+            missing += (vertex_slot_gen[vi[v]] != slot_gen);
+        }
+        if (slots + missing > GPU_VERTEX_SLOTS)
+        {
+            // start new batch when slots are over
+            PutIndexedBatch(cmd, slot_vertex, loaded, slots, index_batch);
+            index_batch.clear();
+            slot_gen++;
+            loaded = slots = 0;
+        }
+
+        for (int v = 0; v < 3; v++)
+        {
+            if (vertex_slot_gen[vi[v]] != slot_gen)
             {
-                for (int c = 0; c < 4; c++)
-                    PutToBuf(FloatToU32(cur_color[c]));
+                vertex_slot_gen[vi[v]] = slot_gen;
+                vertex_slot[vi[v]] = slots;
+                slot_vertex[slots++] = vi[v];
             }
+            index_batch.push_back(vertex_slot[vi[v]]);
         }
-
-        if (normal_array.enabled)  
-        {  
-            PutVertexDataToBuffer(PGL_NORMAL_ARRAY, vo, i, indices, indice_size);
+        if (index_batch.size() >= PGL_MAX_DRAW_INDICES)
+        {
+            // send triangles with vertices loaded so far, slots are still valid
+            PutIndexedBatch(cmd, slot_vertex, loaded, slots, index_batch);
+            index_batch.clear();
+            loaded = slots;
         }
+    }
+    PutIndexedBatch(cmd, slot_vertex, loaded, slots, index_batch);
+}
 
-        if (texcoord_array.enabled)  
-        {  
-            PutVertexDataToBuffer(PGL_TEXCOORD_ARRAY, vo, i, indices, indice_size);
-        }
+// Vertex array data in client memory or host copy of buffer object
+const uint8_t* PseudoGLContext::ArrayData(const VertexArrayState &v)
+{
+    if (v.buffer)
+    {
+        assert(buffers[v.buffer].shadow);
+        return (const uint8_t*)buffers[v.buffer].shadow + (size_t)v.ptr;
+    }
+    return (const uint8_t*)v.ptr;
+}
 
-        assert(buffer_elements < PGL_MAX_CMD_BUF_ELEMENTS);
+// Add VERTEX_POINTER command for array in buffer object if it differs from last one
+void PseudoGLContext::PutHwArray(int array)
+{
+    const VertexArrayState &v = vertex_arrays[array];
+    BufferState &buf = buffers[v.buffer];
+    HwArrayState hw = {(uint32_t)array | (v.size << GPU_ARRAY_COMPONENTS_SHIFT) | (v.type << GPU_ARRAY_TYPE_SHIFT),
+                       (buf.gpu_ptr + (uint32_t)(size_t)v.ptr) & GPU_ADDR_MASK, (uint32_t)v.stride};
+    buf.busy = true;
+    if (!memcmp(&hw, &hw_arrays[array], sizeof(hw)))
+        return;
+    PutToBuf(GPU_PIPE_CMD_VERTEX_POINTER, true);
+    PutToBuf(hw.params);
+    PutToBuf(hw.ptr);
+    PutToBuf(hw.stride);
+    hw_arrays[array] = hw;
+}
+
+// Draw with single command if all used vertex arrays & indices are in buffer objects,
+// GPU fetches vertices from its memory then
+bool PseudoGLContext::DrawBuffer(int first, int count, int mode, const void *indices, int indice_size)
+{
+    uint32_t cmd = PolyCmd();
+    bool colors = !lighting_enabled && color_array.enabled;
+    bool normals = (cmd == GPU_PIPE_CMD_POLY_VERTEX3N3);
+    bool texcoords = (cmd == GPU_PIPE_CMD_POLY_VERTEX3TC);
+    auto in_gpu = [this](BufId b) {return b && buffers[b].gpu_ptr;};
+    if (!vertex_array.enabled || !in_gpu(vertex_array.buffer) || (colors && !in_gpu(color_array.buffer)) ||
+        (normals && !in_gpu(normal_array.buffer)) || (texcoords && !in_gpu(texcoord_array.buffer)) ||
+        (indice_size && !in_gpu(element_buffer)))
+        return false;
+    
+    PutHwArray(PGL_VERTEX_ARRAY);
+    if (colors)
+        PutHwArray(PGL_COLOR_ARRAY);
+    if (normals)
+        PutHwArray(PGL_NORMAL_ARRAY);
+    if (texcoords)
+        PutHwArray(PGL_TEXCOORD_ARRAY);
+    
+    uint32_t prim = GpuPrim(mode);
+    uint32_t index_ptr = 0;
+    if (indice_size)
+    {
+        index_ptr = (buffers[element_buffer].gpu_ptr + (uint32_t)(size_t)indices) & GPU_ADDR_MASK;
+        buffers[element_buffer].busy = true;
+    }
+    
+    // colors which don't come from color array are sent with command
+    uint32_t const_colors = colors ? 0 : (normals ? 8 : 4);
+    PutToBuf(GPU_PIPE_CMD_DRAW_BUFFER | ((4 + const_colors) << 8), true);
+    PutToBuf((uint32_t)count);
+    PutToBuf(prim | (indice_size << GPU_DRAW_INDEX_SHIFT) | ((cmd & 0xFF) << GPU_VERTEX_FORMAT_SHIFT));
+    PutToBuf(index_ptr);
+    PutToBuf((uint32_t)first);
+    if (lighting_enabled)
+    {
+        for (int c = 0; c < 4; c++)
+            PutToBuf(FloatToU32(material_params.ambient_color[c]));
+        if (normals)
+            for (int c = 0; c < 4; c++)
+                PutToBuf(FloatToU32(material_params.diffuse_color[c]));
     }
+    else if (!colors)
+    {
+        for (int c = 0; c < 4; c++)
+            PutToBuf(FloatToU32(cur_color[c]));
+    }
+    return true;
 }
 
 // Push matrix to stack
@@ -496,6 +763,37 @@ void PseudoGLContext::BindHWTexture()
     PutToBuf(GPU_PIPE_CMD_BINDTEXTURE, true);
     PutToBuf(textures[binded_texture].gpu_ptr & GPU_ADDR_MASK);
     PutToBuf(textures[binded_texture].width | (textures[binded_texture].height << 16));
+    if (texparams_supported)
+    {
+        // mipmap levels are sent only when they are valid
+        const TextureState &tex = textures[binded_texture];
+        uint levels = (tex.mips_dirty && !tex.mips_explicit) ? 0 : tex.levels;
+        PutToBuf(GPU_PIPE_CMD_TEXPARAMS, true);
+        PutToBuf((tex.layout & GPU_TEXPARAM_LAYOUT_MASK) | (tex.min_filter << GPU_TEXPARAM_MINF_SHIFT) |
+                 (tex.mag_filter << GPU_TEXPARAM_MAGF_SHIFT) | (levels << GPU_TEXPARAM_LEVELS_SHIFT) |
+                 (tex.gpu_format << GPU_TEXPARAM_FORMAT_SHIFT));
+    }
+}
+
+// Set min or mag filter of binded texture
+void PseudoGLContext::SetTextureFilter(bool min, uint filter)
+{
+    TextureState &tex = textures[binded_texture];
+    if (min)
+        tex.min_filter = filter;
+    else
+        tex.mag_filter = filter;
+    if (tex.gpu_ptr)
+        BindHWTexture();
+}
+
+// Preferred texture layout if texture size allows it
+uint PseudoGLContext::TextureLayout(const uint width, const uint height)
+{
+    bool pow2 = !(width & (width - 1)) && !(height & (height - 1));
+    if ((tex_layout == TEXLAYOUT_MORTON && pow2) || (tex_layout == TEXLAYOUT_TILED && !(width % 4) && !(height % 4)))
+        return tex_layout;
+    return TEXLAYOUT_LINEAR;
 }
 
 // Bind texture in client & hw
@@ -508,11 +806,22 @@ void PseudoGLContext::BindTexture(TexId tex)
 }
 
 // Create texture structure
-void PseudoGLContext::AllocTexture(const uint format, const uint width, const uint height)
+void PseudoGLContext::AllocTexture(const uint format, const uint type, const uint width, const uint height)
 {
     assert(width <= PGL_MAX_TEXTURE_SIZE && height <= PGL_MAX_TEXTURE_SIZE);
 
     TextureState &tex = textures[binded_texture];
+    TextureState respecified = tex;
+    respecified.format = format;
+    respecified.type = type;
+    if (tex.gpu_ptr && (tex.width != width || tex.height != height || TextureFormat(respecified) != tex.gpu_format))
+    {
+        // texture of new size or native format gets new memory
+        tex.gpu_ptr = 0;
+        delete[] tex.shadow;
+        tex.shadow = nullptr;
+        tex.mips_explicit = false;
+    }
     tex.width = width;
     tex.height = height;
     tex.format = format;
@@ -578,71 +887,314 @@ void PseudoGLContext::SetTexture(const uint format, const uint type)
     tex.type = type;
 }
 
-// Copy texture to hw memory
-void PseudoGLContext::LoadTexture(const uint8_t* pixels, const uint xoff, const uint yoff, const uint width, const uint height) 
+// Convert texel of client format to GPU RGBA8
+uint32_t PseudoGLContext::TexelToRGBA(const TextureState &tex, const uint8_t *ptr)
+{
+    if (tex.size == 1)
+    {
+        if (tex.format == GL_RGB || tex.format == GL_RGBA)
+            return *(const uint32_t*)ptr | (tex.vpp==3 ? 0xFF000000 : 0);
+        else if (tex.format == GL_LUMINANCE || tex.format == GL_LUMINANCE_ALPHA)
+        {
+            uint8_t l = *ptr;
+            return l | (l<<8) | (l<<16) | (tex.vpp==1 ? 0xFF000000 : *(ptr + 1) << 24);
+        }
+    }
+    else if (tex.size == 2)
+    {
+        uint16_t word = *(const uint16_t*)ptr;
+        uint32_t r, g, b, a;
+        if (tex.type == GL_UNSIGNED_SHORT_5_6_5)
+        {
+            b = ((word & 0x001F) >>  0) * 255 / 31;
+            g = ((word & 0x07E0) >>  5) * 255 / 63;
+            r = ((word & 0xF800) >> 11) * 255 / 31;
+            a = 0xFF;
+        }
+        else if (tex.type == GL_UNSIGNED_SHORT_4_4_4_4)
+        {
+            a = ((word & 0x000F) >>  0) * 255 / 15;
+            b = ((word & 0x00F0) >>  4) * 255 / 15;
+            g = ((word & 0x0F00) >>  8) * 255 / 15;
+            r = ((word & 0xF000) >> 12) * 255 / 15;
+        }
+        else
+            assert(false);
+        return r | (g<<8) | (b<<16) | (a<<24);
+    }
+    assert(false);
+    return 0;
+}
+
+// GPU texel format for client format of texture, compact ones are kept if texturing supports them
+uint PseudoGLContext::TextureFormat(const TextureState &tex)
+{
+    if (!texformats_supported)
+        return TEXFORMAT_RGBA8;
+    if (tex.format == GL_ETC1_RGB8_OES)
+        return TEXFORMAT_ETC1;
+    if (tex.type == GL_UNSIGNED_SHORT_5_6_5)
+        return TEXFORMAT_RGB565;
+    if (tex.type == GL_UNSIGNED_SHORT_4_4_4_4)
+        return TEXFORMAT_RGBA4444;
+    if (tex.format == GL_LUMINANCE)
+        return TEXFORMAT_L8;
+    if (tex.format == GL_LUMINANCE_ALPHA)
+        return TEXFORMAT_LA88;
+    return TEXFORMAT_RGBA8;
+}
+
+// Copy bytes [begin, end) of texture memory from host copy to hw memory
+void PseudoGLContext::WriteTextureRange(TextureState &tex, uint32_t begin, uint32_t end)
+{
+    begin &= ~3u;
+    end = (end + 3) & ~3u;
+    #if LOAD_TEXTURES
+    if (end > begin)
+        oglory_mem_write(tex.shadow + begin/4, (end - begin)/4, tex.gpu_ptr + begin);
+    #endif
+}
+
+// Build mipmap levels from base level with 2x2 box filter & copy them to hw memory
+void PseudoGLContext::GenerateMipmaps(TextureState &tex)
+{
+    uint8_t *mem = (uint8_t*)tex.shadow;
+    std::vector<uint32_t> src(tex.width*tex.height);
+    std::vector<uint32_t> dst;
+    for (uint y = 0; y < tex.height; y++)
+        for (uint x = 0; x < tex.width; x++)
+            src[y*tex.width + x] = GpuDecodeTexel(mem + GpuTexelIndex(x, y, tex.width, tex.height, tex.layout)*tex.bpp, tex.gpu_format);
+    
+    uint sw = tex.width, sh = tex.height;
+    for (uint level = 1; level <= tex.levels; level++)
+    {
+        uint w = GpuTexLevelSize(tex.width, level);
+        uint h = GpuTexLevelSize(tex.height, level);
+        uint layout = GpuTexLevelLayout(w, h, tex.layout);
+        uint8_t *level_mem = mem + GpuTexLevelOffset(tex.width, tex.height, level, tex.gpu_format);
+        dst.resize(w*h);
+        for (uint y = 0; y < h; y++)
+        {
+            // odd side of 1 texel is reused
+            uint y0 = y*2, y1 = std::min(y*2 + 1, sh - 1);
+            for (uint x = 0; x < w; x++)
+            {
+                uint x0 = x*2, x1 = std::min(x*2 + 1, sw - 1);
+                uint32_t t[4] = {src[y0*sw + x0], src[y0*sw + x1], src[y1*sw + x0], src[y1*sw + x1]};
+                uint32_t color = 0;
+                for (int c = 0; c < 32; c += 8)
+                {
+                    uint32_t sum = 2;
+                    for (int i = 0; i < 4; i++)
+                        sum += (t[i] >> c) & 0xFF;
+                    color |= (sum / 4) << c;
+                }
+                // next level is built from stored (maybe compacted) texels
+                uint8_t *p = level_mem + GpuTexelIndex(x, y, w, h, layout)*tex.bpp;
+                GpuEncodeTexel(color, p, tex.gpu_format);
+                dst[y*w + x] = GpuDecodeTexel(p, tex.gpu_format);
+            }
+        }
+        src.swap(dst);
+        sw = w;
+        sh = h;
+    }
+    WriteTextureRange(tex, GpuTexLevelOffset(tex.width, tex.height, 1, tex.gpu_format), GpuTexLevelOffset(tex.width, tex.height, tex.levels + 1, tex.gpu_format));
+    tex.mips_dirty = false;
+}
+
+// Wait for commands which could read buffer before it is changed
+void PseudoGLContext::WaitBufferIdle(BufferState &buf)
+{
+    if (!buf.busy)
+        return;
+    PipelineFlush();
+    for (BufferState &b : buffers)
+        b.busy = false;
+}
+
+// Copy bytes [begin, end) of buffer from host copy to hw memory
+void PseudoGLContext::WriteBufferRange(BufferState &buf, uint32_t begin, uint32_t end)
+{
+    begin &= ~3u;
+    end = (end + 3) & ~3u;
+    if (buf.gpu_ptr && end > begin)
+        oglory_mem_write(buf.shadow + begin/4, (end - begin)/4, buf.gpu_ptr + begin);
+}
+
+// Set size & data of bound buffer, hw memory is allocated only if GPU could fetch vertices
+void PseudoGLContext::BufferData(bool element, const void *data, uint size)
+{
+    BufId id = element ? element_buffer : array_buffer;
+    assert(id);
+    BufferState &buf = buffers[id];
+    WaitBufferIdle(buf);
+    if (!buf.shadow || size > buf.capacity)
+    {
+        // primitive "GPU memory management" as for textures, memory of smaller buffer is lost
+        delete[] buf.shadow;
+        buf.capacity = (size + 3) & ~3u;
+        buf.shadow = new uint32_t[buf.capacity/4]();
+        buf.gpu_ptr = 0;
+        if (vertex_buffers_supported && buf.capacity)
+        {
+            buf.gpu_ptr = gpu_freemem_ptr;
+            gpu_freemem_ptr += buf.capacity;
+        }
+    }
+    buf.size = size;
+    if (data)
+    {
+        memcpy(buf.shadow, data, size);
+        WriteBufferRange(buf, 0, size);
+    }
+}
+
+// Update part of bound buffer
+void PseudoGLContext::BufferSubData(bool element, const void *data, uint offset, uint size)
+{
+    BufId id = element ? element_buffer : array_buffer;
+    assert(id && data);
+    BufferState &buf = buffers[id];
+    assert(offset + size <= buf.size);
+    WaitBufferIdle(buf);
+    memcpy((uint8_t*)buf.shadow + offset, data, size);
+    WriteBufferRange(buf, offset, offset + size);
+}
+
+// Free host copy of buffer & unbind it, hw memory isn't reused
+void PseudoGLContext::DeleteBuffer(BufId id)
+{
+    if (!id || id >= PGL_MAX_BUFFERS)
+        return;
+    delete[] buffers[id].shadow;
+    buffers[id] = {};
+    if (array_buffer == id)
+        array_buffer = 0;
+    if (element_buffer == id)
+        element_buffer = 0;
+    // all bindings of deleted buffer are reset to zero
+    for (VertexArrayState &v : vertex_arrays)
+        if (v.buffer == id)
+            v.buffer = 0;
+}
+
+// Allocate hw memory & host copy for all levels of binded texture
+void PseudoGLContext::AllocTextureMemory(TextureState &tex)
+{
+    // primitive "GPU memory management", just alloc, never free
+    tex.gpu_ptr = gpu_freemem_ptr;
+    tex.gpu_format = TextureFormat(tex);
+    // ETC1 blocks are stored in row-major order
+    tex.layout = (tex.gpu_format == TEXFORMAT_ETC1) ? TEXLAYOUT_LINEAR : TextureLayout(tex.width, tex.height);
+    tex.bpp = GpuTexelBytes(tex.gpu_format);
+    tex.levels = 0;
+    if (texparams_supported)
+    {
+        // space for full mipmap chain
+        while (tex.levels < GPU_TEXPARAM_FIELD_MASK && ((tex.width | tex.height) >> (tex.levels + 1)))
+            tex.levels++;
+    }
+    // host copy of texture memory is kept to update it by words & to generate mipmaps
+    uint32_t words = (GpuTexLevelOffset(tex.width, tex.height, tex.levels + 1, tex.gpu_format) + 3) / 4;
+    tex.shadow = new uint32_t[words]();
+    gpu_freemem_ptr += words*4;
+}
+
+// Copy texture or its mipmap level to hw memory
+void PseudoGLContext::LoadTexture(const uint8_t* pixels, const uint xoff, const uint yoff, const uint width, const uint height, const uint level) 
 {
     assert(pixels); 
     
     // Copy texture to GPU memory
     TextureState &tex = textures[binded_texture];
+    assert(tex.format != GL_ETC1_RGB8_OES);     // compressed textures can't be updated by texels
     
-    // primitive "GPU memory management", just alloc, never free
     if (!tex.gpu_ptr)
     {
-        tex.gpu_ptr = gpu_freemem_ptr;
-        gpu_freemem_ptr += tex.width*tex.height*4;
+        if (level)
+            return;     // base level should be specified first
+        AllocTextureMemory(tex);
     }
-
-    #if LOAD_TEXTURES
+    if (level > tex.levels)
+        return;
+    
+    uint level_w = GpuTexLevelSize(tex.width, level);
+    uint level_h = GpuTexLevelSize(tex.height, level);
+    uint layout = GpuTexLevelLayout(level_w, level_h, tex.layout);
+    uint32_t level_off = GpuTexLevelOffset(tex.width, tex.height, level, tex.gpu_format);
+    uint8_t *level_mem = (uint8_t*)tex.shadow + level_off;
+    uint32_t begin = UINT32_MAX, end = 0;
     for (uint y = 0; y < height; y++)
     {
         for (uint x = 0; x < width; x++)
         {
             const uint8_t *ptr = pixels + (y * width + x)*tex.size*tex.vpp;
-            uint32_t gpu_off = tex.gpu_ptr + ((yoff+y) * tex.width + (x+xoff))*4;
-            
-            if (tex.size == 1)
-            {
-                if (tex.format == GL_RGB || tex.format == GL_RGBA)
-                {
-                    uint32_t word = *(const uint32_t*)ptr | (tex.vpp==3 ? 0xFF000000 : 0);
-                    oglory_mem_write32(word, gpu_off);
-                }
-                else if (tex.format == GL_LUMINANCE || tex.format == GL_LUMINANCE_ALPHA)
-                {
-                    uint8_t l = *ptr;
-                    oglory_mem_write32(l | (l<<8) | (l<<16) | (tex.vpp==1 ? 0xFF000000 : *(ptr + 1) << 24), gpu_off);
-                }
-                else
-                    assert(false);
-            }
-            else if (tex.size == 2)
+            uint32_t off = GpuTexelIndex(x+xoff, yoff+y, level_w, level_h, layout)*tex.bpp;
+            GpuEncodeTexel(TexelToRGBA(tex, ptr), level_mem + off, tex.gpu_format);
+            begin = std::min(begin, off);
+            end = std::max(end, off + tex.bpp);
+        }
+    }
+    WriteTextureRange(tex, level_off + begin, level_off + end);
+    
+    if (level)
+        tex.mips_explicit = true;
+    else
+        tex.mips_dirty = true;
+
+    BindHWTexture();
+}
+
+// Copy ETC1 texture or its mipmap level to hw memory, blocks are decoded on host
+// if texturing can't sample them
+void PseudoGLContext::LoadCompressedTexture(const uint8_t* data, const uint data_size, const uint level)
+{
+    assert(data);
+    
+    TextureState &tex = textures[binded_texture];
+    assert(tex.format == GL_ETC1_RGB8_OES);
+    if (!tex.gpu_ptr)
+    {
+        if (level)
+            return;     // base level should be specified first
+        AllocTextureMemory(tex);
+    }
+    if (level > tex.levels)
+        return;
+    
+    uint level_w = GpuTexLevelSize(tex.width, level);
+    uint level_h = GpuTexLevelSize(tex.height, level);
+    uint32_t level_off = GpuTexLevelOffset(tex.width, tex.height, level, tex.gpu_format);
+    uint32_t level_size = GpuTexLevelBytes(level_w, level_h, tex.gpu_format);
+    uint8_t *level_mem = (uint8_t*)tex.shadow + level_off;
+    uint block_w = (level_w + 3) / 4;
+    assert(data_size >= block_w * ((level_h + 3) / 4) * 8);
+    
+    if (tex.gpu_format == TEXFORMAT_ETC1)
+        memcpy(level_mem, data, level_size);
+    else
+    {
+        uint layout = GpuTexLevelLayout(level_w, level_h, tex.layout);
+        uint32_t texels[16];
+        for (uint by = 0; by < level_h; by += 4)
+        {
+            for (uint bx = 0; bx < level_w; bx += 4)
             {
-                uint16_t word = *(const uint16_t*)ptr;
-                uint32_t r, g, b, a;
-                if (tex.type == GL_UNSIGNED_SHORT_5_6_5)
-                {
-                    b = ((word & 0x001F) >>  0) * 255 / 31;
-                    g = ((word & 0x07E0) >>  5) * 255 / 63;
-                    r = ((word & 0xF800) >> 11) * 255 / 31;
-                    a = 0xFF;
-                }
-                else if (tex.type == GL_UNSIGNED_SHORT_4_4_4_4)
-                {
-                    a = ((word & 0x000F) >>  0) * 255 / 15;
-                    b = ((word & 0x00F0) >>  4) * 255 / 15;
-                    g = ((word & 0x0F00) >>  8) * 255 / 15;
-                    r = ((word & 0xF000) >> 12) * 255 / 15;
-                }
-                else
-                    assert(false);
-                oglory_mem_write32(r | (g<<8) | (b<<16) | (a<<24), gpu_off);
+                GpuEtc1DecodeBlock(data + ((by / 4) * block_w + bx / 4) * 8, texels);
+                // partial blocks at right & bottom edges
+                for (uint y = by; y < std::min(by + 4, level_h); y++)
+                    for (uint x = bx; x < std::min(bx + 4, level_w); x++)
+                        GpuEncodeTexel(texels[(y - by) * 4 + (x - bx)], level_mem + GpuTexelIndex(x, y, level_w, level_h, layout)*tex.bpp, tex.gpu_format);
             }
-            else
-                assert(false);
         }
     }
-    #endif
+    WriteTextureRange(tex, level_off, level_off + level_size);
+    
+    if (level)
+        tex.mips_explicit = true;
+    else
+        tex.mips_dirty = true;
 
     BindHWTexture();
-}
\ No newline at end of file
+}